@@ -1,67 +1,82 @@
-#pragma once
-
-#include "packed_types.h"
-
-#pragma pack(push, 4)
-typedef union
-{
-	struct
-	{
-		unsigned char H : 4;
-		unsigned char M : 4;
-		unsigned char L : 4;
-	};
-	unsigned int value : 12;
-} FAT_entry;
-#pragma pack(pop)
-
-static inline void load_FAT_entry(FAT_entry* table, const byte* disk, unsigned int FAT_offset, int entry)
-{
-	// Grab the two bytes that support this FAT entry
-	byte a = disk[FAT_offset + 3 * entry / 2];
-	byte b = disk[FAT_offset + 3 * entry / 2 + 1];
-		
-	// If the entry is even...
-	if (entry % 2 == 0)
-	{	
-		// ... use the low order bits from the higher location
-		table[entry].L = b.L;
-		// And the whole byte in the base location
-		table[entry].M = a.H;
-		table[entry].H = a.L;
-	}
-	else
-	{
-		// ... use the whole byte from the high location
-		table[entry].L = b.H;
-		table[entry].M = b.L;
-		// and the high order bits from the lower location
-		table[entry].H = a.H;
-	}
-}
-
-static inline void update_disk_FAT(FAT_entry* table, byte* disk, unsigned int FAT_offset, int entry)
-{
-	// Update the FAT entries on disk
-	byte* a = &disk[FAT_offset + 3 * entry / 2];
-	byte* b = &disk[FAT_offset + 3 * entry / 2 + 1];
-		
-	// If the entry is even...
-	if (entry % 2 == 0)
-	{	
-		// ... use the low order bits from the higher location
-		b->L = table[entry].L;
-		// And the whole byte in the base location
-		a->H = table[entry].M;
-		a->L = table[entry].H;
-	}
-	else
-	{
-		// ... use the whole byte from the high location
-		b->H = table[entry].L;
-		b->L = table[entry].M;
-		// and the high order bits from the lower location
-		a->H = table[entry].H;
-	}
-
-}
+#pragma once
+
+#include <stdint.h>
+
+#include "packed_types.h"
+
+#pragma pack(push, 4)
+typedef union
+{
+	struct
+	{
+		unsigned char H : 4;
+		unsigned char M : 4;
+		unsigned char L : 4;
+	};
+	unsigned int value : 12;
+} FAT_entry;
+#pragma pack(pop)
+
+static inline void load_FAT_entry(FAT_entry* table, const byte* disk, uint64_t FAT_offset, unsigned int entry)
+{
+	// Grab the two bytes that support this FAT entry
+	byte a = disk[FAT_offset + 3 * (uint64_t)entry / 2];
+	byte b = disk[FAT_offset + 3 * (uint64_t)entry / 2 + 1];
+		
+	// If the entry is even...
+	if (entry % 2 == 0)
+	{	
+		// ... use the low order bits from the higher location
+		table[entry].L = b.L;
+		// And the whole byte in the base location
+		table[entry].M = a.H;
+		table[entry].H = a.L;
+	}
+	else
+	{
+		// ... use the whole byte from the high location
+		table[entry].L = b.H;
+		table[entry].M = b.L;
+		// and the high order bits from the lower location
+		table[entry].H = a.H;
+	}
+}
+
+static inline void update_disk_FAT(FAT_entry* table, byte* disk, uint64_t FAT_offset, unsigned int entry)
+{
+	// Update the FAT entries on disk
+	byte* a = &disk[FAT_offset + 3 * (uint64_t)entry / 2];
+	byte* b = &disk[FAT_offset + 3 * (uint64_t)entry / 2 + 1];
+		
+	// If the entry is even...
+	if (entry % 2 == 0)
+	{	
+		// ... use the low order bits from the higher location
+		b->L = table[entry].L;
+		// And the whole byte in the base location
+		a->H = table[entry].M;
+		a->L = table[entry].H;
+	}
+	else
+	{
+		// ... use the whole byte from the high location
+		b->H = table[entry].L;
+		b->L = table[entry].M;
+		// and the high order bits from the lower location
+		a->H = table[entry].H;
+	}
+
+}
+
+static inline unsigned int read_FAT_entry(const byte* disk, uint64_t FAT_offset, unsigned int entry)
+{
+	// Same two bytes as load_FAT_entry, assembled straight into a value
+	unsigned int a = disk[FAT_offset + 3 * (uint64_t)entry / 2].value;
+	unsigned int b = disk[FAT_offset + 3 * (uint64_t)entry / 2 + 1].value;
+
+	// Even entries take the whole low byte and the low nibble of the high byte,
+	// odd entries the high nibble of the low byte and the whole high byte
+	return (entry % 2 == 0)
+		 ? (a | (b & 0x0F) << 8)
+		 : (a >> 4 | b << 4);
+}
@@ -0,0 +1,481 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "FAT_entry.h"
+#include "disk_io.h"
+#include "sfs_index.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Entries at or above this mark the end of a chain
+#define FAT_END_OF_CHAIN 0xFF8
+
+// The optional decoded-page cache, a handful of direct mapped pages of entries
+#define FAT_CACHE_PAGES   8
+#define FAT_CACHE_ENTRIES 512
+
+typedef enum
+{
+	// Decode single entries straight from the metadata as they're asked for
+	FAT_LAZY,
+	// As above, but decode a page of neighbouring entries at a time and keep
+	// a few of them around. Not safe to share between threads.
+	FAT_CACHED,
+	// Decode the whole table up front, for tools that visit every entry
+	FAT_DECODED
+} FAT_ACCESS;
+
+typedef struct
+{
+	disk_io* io;
+	FAT_ACCESS mode;
+	uint64_t FAT_offset;
+	unsigned int FAT_size;
+
+	unsigned short* table;
+
+	int tags[FAT_CACHE_PAGES];
+	unsigned short pages[FAT_CACHE_PAGES][FAT_CACHE_ENTRIES];
+} FAT_view;
+
+// A run of physically contiguous clusters belonging to one chain
+typedef struct
+{
+	unsigned int cluster;
+	unsigned int count;
+} cluster_extent;
+
+// Fill a view's table from the first FAT of the metadata
+static inline void FAT_view_decode(FAT_view* fat, const byte* disk)
+{
+	TRACE_BEGIN(span);
+	for (unsigned int FAT_idx = 0; FAT_idx < fat->FAT_size; ++FAT_idx)
+	{
+		fat->table[FAT_idx] = read_FAT_entry(disk, fat->FAT_offset, FAT_idx);
+	}
+	TRACE_END(span, "decode FAT", "entries", fat->FAT_size);
+}
+
+static inline void FAT_view_init(FAT_view* fat, disk_io* io, const boot_extra* boot_calc, FAT_ACCESS mode)
+{
+	fat->io = io;
+	fat->mode = mode;
+	fat->FAT_offset = boot_calc->FAT1_offset;
+	fat->FAT_size = boot_calc->FAT_size;
+	fat->table = NULL;
+
+	for (int page = 0; page < FAT_CACHE_PAGES; ++page)
+	{
+		fat->tags[page] = -1;
+	}
+
+	if (mode == FAT_DECODED)
+	{
+		// Two bytes per entry rather than the four a FAT_entry takes
+		fat->table = malloc(fat->FAT_size * sizeof(unsigned short));
+		if (fat->table == NULL)
+		{
+			quit("Out of memory while decoding the FAT.");
+		}
+
+		// The index has it decoded already. It's copied, the table outlives the metadata lock.
+		sfs_index* index = disk_index(io, boot_calc);
+		if (index != NULL)
+		{
+			memcpy(fat->table, index->table, fat->FAT_size * sizeof(unsigned short));
+			return;
+		}
+
+		FAT_view_decode(fat, disk_metadata(io));
+	}
+}
+
+/* FAT VIEW INIT METADATA
+ * Decode the FAT straight from a copy of a disk's metadata, for callers without a disk_io.
+ * @param FAT_view*         : fat - Receives the view, always FAT_DECODED, release with FAT_view_free()
+ * @param const byte*       : disk - The metadata, indexed by absolute image offset
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ */
+static inline void FAT_view_init_metadata(FAT_view* fat, const byte* disk, const boot_extra* boot_calc)
+{
+	fat->io = NULL;
+	fat->mode = FAT_DECODED;
+	fat->FAT_offset = boot_calc->FAT1_offset;
+	fat->FAT_size = boot_calc->FAT_size;
+
+	for (int page = 0; page < FAT_CACHE_PAGES; ++page)
+	{
+		fat->tags[page] = -1;
+	}
+
+	fat->table = malloc(fat->FAT_size * sizeof(unsigned short));
+	if (fat->table == NULL)
+	{
+		quit("Out of memory while decoding the FAT.");
+	}
+
+	FAT_view_decode(fat, disk);
+}
+
+static inline void FAT_view_free(FAT_view* fat)
+{
+	free(fat->table);
+	fat->table = NULL;
+}
+
+static inline unsigned int FAT_lazy_entry(FAT_view* fat, unsigned int entry)
+{
+	// Only the two bytes holding this entry are touched
+	disk_metadata_range(fat->io, fat->FAT_offset + 3 * (uint64_t)entry / 2, 2);
+	return read_FAT_entry(fat->io->metadata, fat->FAT_offset, entry);
+}
+
+/* FAT NEXT
+ * Look up the FAT entry for a cluster, which is the next cluster of its chain.
+ * @param FAT_view*    : fat - The table to consult
+ * @param unsigned int : entry - The cluster to look up
+ * @returns unsigned int - The entry's value, or an end of chain marker when @param(entry) is out of range.
+ */
+static inline unsigned int FAT_next(FAT_view* fat, unsigned int entry)
+{
+	if (entry >= fat->FAT_size)
+	{
+		return 0xFFF;
+	}
+
+	switch (fat->mode)
+	{
+		case FAT_DECODED:
+			return fat->table[entry];
+
+		case FAT_CACHED:
+			{
+				int page = entry / FAT_CACHE_ENTRIES;
+				int slot = page % FAT_CACHE_PAGES;
+
+				if (fat->tags[slot] != page)
+				{
+					// Decode the page of entries this one lives in
+					TRACE_BEGIN(span);
+					unsigned int first = page * FAT_CACHE_ENTRIES;
+					unsigned int count = MIN(FAT_CACHE_ENTRIES, fat->FAT_size - first);
+					uint64_t location = fat->FAT_offset + 3 * (uint64_t)first / 2;
+					disk_metadata_range(fat->io, location, (3 * count + 1) / 2);
+
+					for (unsigned int i = 0; i < count; ++i)
+					{
+						fat->pages[slot][i] = read_FAT_entry(fat->io->metadata, fat->FAT_offset, first + i);
+					}
+					fat->tags[slot] = page;
+					TRACE_END(span, "decode FAT page", "page", page);
+				}
+
+				return fat->pages[slot][entry % FAT_CACHE_ENTRIES];
+			}
+
+		default:
+		case FAT_LAZY:
+			return FAT_lazy_entry(fat, entry);
+	}
+}
+
+static inline bool FAT_in_chain(const FAT_view* fat, unsigned int cluster)
+{
+	return cluster >= 2 && cluster < fat->FAT_size && cluster < FAT_END_OF_CHAIN;
+}
+
+/* FAT NEXT EXTENT
+ * Collect the next run of physically contiguous clusters from a chain.
+ * @param FAT_view*       : fat - The table to consult
+ * @param unsigned int*   : chain - The cluster to start from, advanced to the cluster after the run
+ * @param unsigned int    : max_clusters - Upper bound on the length of the run
+ * @param cluster_extent* : extent - Receives the run
+ * @returns bool - false once @param(chain) no longer points at a valid cluster.
+ */
+static inline bool FAT_next_extent(FAT_view* fat, unsigned int* chain, unsigned int max_clusters, cluster_extent* extent)
+{
+	if (!FAT_in_chain(fat, *chain) || max_clusters == 0)
+	{
+		return false;
+	}
+
+	extent->cluster = *chain;
+	extent->count = 1;
+
+	unsigned int next = FAT_next(fat, *chain);
+	while (extent->count < max_clusters && next == extent->cluster + extent->count)
+	{
+		extent->count += 1;
+		next = FAT_next(fat, next);
+	}
+
+	*chain = next;
+	return true;
+}
+
+// Most ranges a chain reader hints to the backend in one call
+#define CHAIN_PREFETCH_BATCH 64
+
+// Most ranges a chain reader reads in one call, when it can't map them
+#define CHAIN_READ_BATCH 256
+
+// Walks a file's cluster chain, handing out its data in order while telling the
+// I/O backend about the clusters a window ahead of the data being consumed.
+// The kernel's own readahead only sees the order clusters are read in, which
+// stops helping as soon as a file is fragmented.
+typedef struct
+{
+	FAT_view* fat;
+	disk_io* io;
+	uint64_t data_offset;
+	unsigned int cluster_size;
+
+	// Where the walk has got to, and how much of the file it has left
+	unsigned int chain;
+	unsigned int remaining;
+	unsigned int visited;
+	uint64_t window;
+
+	// Ranges found by the walk, not yet handed out
+	disk_range* queue;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	uint64_t queued_bytes;
+
+	// How many of the queued ranges, from the head, the backend was told about
+	size_t hinted;
+	uint64_t hinted_bytes;
+
+	// Data is read into here when the backend doesn't map the image
+	byte* scratch;
+	size_t scratch_size;
+
+	// Set when the chain turns out to be damaged
+	const char* error;
+} chain_reader;
+
+/* CHAIN READER INIT
+ * Prepare to read a file by following its cluster chain.
+ * @param chain_reader*     : reader - The reader to set up, release with chain_reader_free()
+ * @param FAT_view*         : fat - The table the chain lives in
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @param unsigned int      : first_cluster - The file's first cluster
+ * @param unsigned int      : size - The file's size in bytes
+ * @param uint64_t          : window - How many bytes ahead of the reader to prefetch, 0 for none
+ * @param byte*             : scratch - Buffer data is read into for backends that don't map the image
+ * @param size_t            : scratch_size - Size of @param(scratch), at least one cluster
+ */
+static inline void chain_reader_init(chain_reader* reader, FAT_view* fat, const boot_extra* boot_calc, unsigned int first_cluster, unsigned int size, uint64_t window, byte* scratch, size_t scratch_size)
+{
+	memset(reader, 0, sizeof(chain_reader));
+	reader->fat = fat;
+	reader->io = fat->io;
+	reader->data_offset = boot_calc->data_offset;
+	reader->cluster_size = boot_calc->cluster_size;
+	reader->chain = first_cluster;
+	reader->remaining = size;
+	reader->window = window;
+	reader->scratch = scratch;
+	reader->scratch_size = scratch_size;
+
+	// Every range but a file's last is at least a cluster long
+	uint64_t target = window > scratch_size ? window : scratch_size;
+	reader->capacity = target / reader->cluster_size + 2;
+	reader->queue = malloc(reader->capacity * sizeof(disk_range));
+	if (reader->queue == NULL)
+	{
+		quit("Out of memory while setting up a chain reader.");
+	}
+}
+
+static inline void chain_reader_free(chain_reader* reader)
+{
+	free(reader->queue);
+	reader->queue = NULL;
+}
+
+/* CHAIN READER WALK
+ * Follow the chain further, queueing its extents until @param(target) bytes are waiting.
+ * @param chain_reader* : reader - The reader to top up
+ * @param uint64_t      : target - How many bytes to have queued
+ */
+static inline void chain_reader_walk(chain_reader* reader, uint64_t target)
+{
+	while (reader->remaining > 0 && reader->error == NULL &&
+		   reader->count < reader->capacity &&
+		   (reader->count == 0 || reader->queued_bytes < target))
+	{
+		unsigned int wanted = (reader->remaining + reader->cluster_size - 1) / reader->cluster_size;
+		unsigned int longest = reader->scratch_size / reader->cluster_size;
+
+		cluster_extent extent;
+		if (!FAT_next_extent(reader->fat, &reader->chain, MIN(wanted, longest), &extent))
+		{
+			reader->error = "corrupt cluster chain";
+			break;
+		}
+
+		// A chain longer than the table has to be going round in circles
+		reader->visited += extent.count;
+		if (reader->visited > reader->fat->FAT_size)
+		{
+			reader->error = "corrupt cluster chain";
+			break;
+		}
+
+		disk_range range;
+		range.offset = reader->data_offset + (uint64_t)(extent.cluster - 2) * reader->cluster_size;
+		range.length = MIN((uint64_t)extent.count * reader->cluster_size, reader->remaining);
+
+		if (range.offset > reader->io->size || range.length > reader->io->size - range.offset)
+		{
+			reader->error = "cluster chain runs past the end of the disk";
+			break;
+		}
+
+		reader->queue[(reader->head + reader->count) % reader->capacity] = range;
+		reader->count += 1;
+		reader->queued_bytes += range.length;
+		reader->remaining -= range.length;
+	}
+}
+
+/* CHAIN READER FILL
+ * Keep the queue ahead of the reader, and tell the backend about the ranges that
+ * came within the prefetch window since the last call.
+ * @param chain_reader* : reader - The reader to top up
+ */
+static inline void chain_reader_fill(chain_reader* reader)
+{
+	// Without a mapping, reads are batched a scratch buffer at a time, so
+	// at least that much must be queued for them to draw on
+	uint64_t target = reader->window;
+	if (reader->io->map == NULL && reader->scratch_size > target)
+	{
+		target = reader->scratch_size;
+	}
+	chain_reader_walk(reader, target);
+
+	disk_range batch[CHAIN_PREFETCH_BATCH];
+	size_t batched = 0;
+
+	while (reader->hinted < reader->count && reader->hinted_bytes < reader->window)
+	{
+		disk_range range = reader->queue[(reader->head + reader->hinted) % reader->capacity];
+		reader->hinted += 1;
+		reader->hinted_bytes += range.length;
+
+		batch[batched++] = range;
+		if (batched == CHAIN_PREFETCH_BATCH)
+		{
+			disk_prefetch(reader->io, batch, batched);
+			batched = 0;
+		}
+	}
+
+	disk_prefetch(reader->io, batch, batched);
+}
+
+/* CHAIN READER RESOLVE
+ * Follow the whole chain now, so the FAT isn't needed again while the file is read.
+ * Lets a tool look at the metadata under a lock and copy the data after releasing it.
+ * @param chain_reader* : reader - A reader fresh from chain_reader_init()
+ * @returns bool - false when the chain is damaged, @param(reader)'s error says how.
+ */
+static inline bool chain_reader_resolve(chain_reader* reader)
+{
+	// Every extent holds at least one cluster, so the table size bounds their number
+	size_t capacity = reader->fat->FAT_size + 2;
+	if (capacity > reader->capacity)
+	{
+		disk_range* queue = realloc(reader->queue, capacity * sizeof(disk_range));
+		if (queue == NULL)
+		{
+			quit("Out of memory while following a cluster chain.");
+		}
+		reader->queue = queue;
+		reader->capacity = capacity;
+	}
+
+	chain_reader_walk(reader, UINT64_MAX);
+	return reader->error == NULL;
+}
+
+static inline void chain_reader_pop(chain_reader* reader, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint64_t length = reader->queue[reader->head].length;
+		if (reader->hinted > 0)
+		{
+			reader->hinted -= 1;
+			reader->hinted_bytes -= length;
+		}
+
+		reader->head = (reader->head + 1) % reader->capacity;
+		reader->count -= 1;
+		reader->queued_bytes -= length;
+	}
+}
+
+/* CHAIN READ
+ * Get the next piece of the file.
+ * @param chain_reader* : reader - The reader to advance
+ * @param const byte**  : data - Receives a pointer to the piece, valid until the next call
+ * @param size_t*       : length - Receives the size of the piece
+ * @returns bool - false once the file has been read, or the chain stopped early in which
+ *                 case @param(reader)'s error says why.
+ */
+static inline bool chain_read(chain_reader* reader, const byte** data, size_t* length)
+{
+	chain_reader_fill(reader);
+
+	if (reader->count == 0)
+	{
+		return false;
+	}
+
+	if (reader->io->map != NULL)
+	{
+		// Mapped, hand out one range at a time straight from the image
+		disk_range range = reader->queue[reader->head];
+		*data = disk_view(reader->io, range.offset, range.length, reader->scratch);
+		*length = range.length;
+
+		chain_reader_pop(reader, 1);
+		return true;
+	}
+
+	// Otherwise read as many queued ranges as fit in the scratch buffer in one go,
+	// so backends that can keep several reads in flight get to
+	disk_range batch[CHAIN_READ_BATCH];
+	size_t batched = 0;
+	size_t total = 0;
+
+	while (batched < reader->count && batched < CHAIN_READ_BATCH)
+	{
+		disk_range range = reader->queue[(reader->head + batched) % reader->capacity];
+		if (total + range.length > reader->scratch_size)
+		{
+			break;
+		}
+
+		batch[batched++] = range;
+		total += range.length;
+	}
+
+	disk_read_ranges(reader->io, batch, batched, reader->scratch);
+	chain_reader_pop(reader, batched);
+
+	*data = reader->scratch;
+	*length = total;
+	return true;
+}
@@ -1,209 +1,765 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/mman.h>
-#include <fcntl.h>
-
-#include "packed_types.h"
-
-#include "SFS.h"
-
-// Our 4 processes, defintions required here since they're in seperate C files
-extern void diskinfo(const byte* disk);
-extern void disklist(const byte* disk);
-extern void diskget(const byte* disk, const char* filename);
-extern void diskput(const byte* disk, FILE* file, const char* input_filename);
-
-int main(int argc, char** argv)
-{
-	DISK_ACTION run_prog = checkProgram(argv[0]);
-
-	byte* disk = NULL;
-	
-	if (run_prog == DISK_ACTION_NONE)
-	{
-		usage(run_prog);
-	}
-
-	int disk_image = 0;
-	int disk_size = 0;
-
-	if (argc >= 2 && argv[1] != NULL)
-	{
-		// Retrieve a file descriptor for the disk image
-		disk_image = open(argv[1], O_RDWR);
-		if (disk_image == -1)
-		{
-			char* err = strerror(errno);
-			quit(err);
-		}
-
-		// Get the disk image size from the file descriptor
-		struct stat disk_stat;
-		if (fstat(disk_image, &disk_stat) == -1)
-		{
-			char* err = strerror(errno);
-			quit(err);
-		}
-
-		// Cache the disk size for when we unmap
-		disk_size = disk_stat.st_size;
-		
-		// Map the disk image to our address space
-		disk = mmap(NULL, disk_size, PROT_WRITE, MAP_SHARED, disk_image, 0);
-		if (disk == NULL || (int)disk == -1)
-		{
-			char* err = strerror(errno);
-			quit(err);
-		}
-	}
-	else usage(run_prog);
-
-	switch (run_prog)
-	{
-		case DISKINFO:
-			{
-				diskinfo(disk);
-				break;
-			}
-
-		case DISKLIST: 
-			{
-				disklist(disk);
-				break;
-			}
-		case DISKGET: 
-			{
-				if (argc == 3 && argv[2] != NULL)
-				{
-					diskget(disk, argv[2]);
-				}
-				else usage(DISKGET);
-				break;
-			}
-
-		case DISKPUT: 
-			{
-				if (argc == 3 && argv[2] != NULL)
-				{
-					// Isolate the filename itself
-					char* filename = strrchr(argv[2], '/');
-					filename = filename ? ++filename : argv[2];
-
-					FILE* put_file = fopen(argv[2], "rb");
-					if (put_file == NULL)
-					{
-						char* err = strerror(errno);
-						quit(err);
-					}
-					else diskput(disk, put_file, filename);
-					
-					fclose(put_file);
-				}
-				else usage(DISKPUT);
-				break;
-			}
-	
-		default:
-		case DISK_ACTION_NONE:
-		break;
-	}
-
-	if (munmap(disk, disk_size) != 0)
-	{
-		// Failed to unmount the disk
-		char* err = strerror(errno);
-		quit(err);
-	}
-
-	close(disk_image);
-
-	return EXIT_SUCCESS;
-
-}
-
-DISK_ACTION checkProgram(const char* executed_name)
-{
-	char* input = strdup(executed_name);
-	char* prog_name = strrchr(input, '/');
-	DISK_ACTION result = DISK_ACTION_NONE;
-	
-	// strrchr found the last forward slash
-	// we want just the program name;
-	prog_name = prog_name ? ++prog_name : input;
-
-	if (strcasecmp(prog_name, "diskinfo") == 0)
-		result = DISKINFO;
-	else if (strcasecmp(prog_name, "disklist") == 0)
-		result = DISKLIST;
-	else if (strcasecmp(prog_name, "diskget") == 0)
-		result = DISKGET;
-	else if (strcasecmp(prog_name, "diskput") == 0)
-		result = DISKPUT;
-
-	free(input);
-
-	return result;
-}
-
-void quit(const char* reason)
-{
-	if (reason != NULL)
-		fprintf(stderr, "%s\n", reason);
-
-	fprintf(stderr, "Exiting...\n");
-
-	exit(EXIT_FAILURE);
-} 
-
-void usage(DISK_ACTION action)
-{
-	printf("Simple File System (FAT12) Usage:\n");
-	
-	switch (action) 
-	{
-		default:
-		case DISK_ACTION_NONE:
-			{
-				printf("  This program suite must be executed under one of the following names:\n");
-				printf("    [ ./diskinfo | ./disklist | ./diskget | ./diskput ]\n");
-			}
-			break;
-
-		case DISKINFO:
-			{
-				printf(" diskinfo <disk>\n");
-				printf("    Processes the <disk> image and displays some basic information about the image.\n");
-			}
-			break;
-
-		case DISKLIST:
-			{
-				printf(" disklist <disk>\n");
-				printf("    Displays contents of the root directory of the <disk> image.\n");
-			} 
-			break;
-
-		case DISKGET:
-			{
-				printf("  diskget <disk> <filename>\n");
-				printf("    Retrieves <filename> from the <disk> image and places it in the current working directory\n");
-			}
-			break;
-	
-		case DISKPUT:
-			{
-				printf(" diskput <disk> <file>\n");
-				printf("    Writes a copy of <file> to the root of <disk> if enough space is available\n");
-			}
-			break;
-	}
-	printf("\n");
-	exit(EXIT_FAILURE);
-}
-
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "trace.h"
+#include "pack.h"
+
+#include "SFS.h"
+
+// Our processes, defintions required here since they're in seperate C files
+extern void diskinfo(disk_io* disk, const sfs_options* options);
+extern void disklist(disk_io* disk, const sfs_options* options);
+extern void diskget(disk_io* disk, const char* filename, const sfs_options* options);
+extern void diskput(disk_io* disk, FILE* file, const char* input_filename, const sfs_options* options);
+extern void diskdelta(disk_io* old_disk, disk_io* new_disk, FILE* out, const sfs_options* options);
+extern void diskpatch(disk_io* disk, FILE* in, const sfs_options* options);
+extern int diskhash(disk_io* disk, const char** names, int num_names, const sfs_options* options);
+extern void diskcopy(disk_io* src, const char* src_name, disk_io* dst, const char* dst_name, const sfs_options* options);
+extern int diskgrep(disk_io* disk, const char* pattern, const char** names, int num_names, const sfs_options* options);
+extern void diskcommit(disk_io* disk, const char* overlay_path);
+extern int diskscan(const char* source, DISK_ACTION action, const sfs_options* options);
+extern void diskput_tar(disk_io* disk, FILE* in, const sfs_options* options);
+extern int diskget_tar(disk_io* disk, FILE* out, const sfs_options* options);
+extern void diskpack(disk_io* disk, const char* out_path, const sfs_options* options);
+extern void diskunpack(disk_io* disk, const char* out_path, const sfs_options* options);
+
+// Long options shared by every tool, each tool ignores the ones that don't apply to it
+enum
+{
+	OPT_VERIFY = 256,
+	OPT_HASH,
+	OPT_IO,
+	OPT_QUEUE_DEPTH,
+	OPT_READAHEAD,
+	OPT_WINDOW,
+	OPT_LAYOUT,
+	OPT_JSON,
+	OPT_REPLACE,
+	OPT_OFFSET,
+	OPT_LENGTH,
+	OPT_MAX_BW,
+	OPT_MAX_IOPS,
+	OPT_IOPRIO,
+	OPT_PROGRESS,
+	OPT_OVERLAY,
+	OPT_TRACE,
+	OPT_SCAN,
+	OPT_TAR,
+	OPT_CHUNK_SIZE,
+	OPT_IN_MEMORY,
+	OPT_INDEX
+};
+
+static const struct option long_options[] =
+{
+	{ "jobs",        required_argument, NULL, 'j'             },
+	{ "verify",      required_argument, NULL, OPT_VERIFY      },
+	{ "hash",        required_argument, NULL, OPT_HASH        },
+	{ "io",          required_argument, NULL, OPT_IO          },
+	{ "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+	{ "readahead",   required_argument, NULL, OPT_READAHEAD   },
+	{ "window",      required_argument, NULL, OPT_WINDOW      },
+	{ "layout",      no_argument,       NULL, OPT_LAYOUT      },
+	{ "json",        no_argument,       NULL, OPT_JSON        },
+	{ "replace",     no_argument,       NULL, OPT_REPLACE     },
+	{ "offset",      required_argument, NULL, OPT_OFFSET      },
+	{ "length",      required_argument, NULL, OPT_LENGTH      },
+	{ "max-bw",      required_argument, NULL, OPT_MAX_BW      },
+	{ "max-iops",    required_argument, NULL, OPT_MAX_IOPS    },
+	{ "ioprio",      required_argument, NULL, OPT_IOPRIO      },
+	{ "progress",    no_argument,       NULL, OPT_PROGRESS    },
+	{ "overlay",     required_argument, NULL, OPT_OVERLAY     },
+	{ "trace",       required_argument, NULL, OPT_TRACE       },
+	{ "scan",        required_argument, NULL, OPT_SCAN        },
+	{ "tar",         no_argument,       NULL, OPT_TAR         },
+	{ "chunk-size",  required_argument, NULL, OPT_CHUNK_SIZE  },
+	{ "in-memory",   no_argument,       NULL, OPT_IN_MEMORY   },
+	{ "index",       no_argument,       NULL, OPT_INDEX       },
+	{ NULL,          0,                 NULL, 0               }
+};
+
+/* PARSE SIZE
+ * Read a byte count from the command line, optionally with a K, M or G suffix.
+ * @param const char* : text - The argument
+ * @param uint64_t*   : size - Receives the byte count
+ * @returns bool - false when @param(text) isn't a size.
+ */
+static bool parse_size(const char* text, uint64_t* size)
+{
+	char* suffix;
+	errno = 0;
+	unsigned long long value = strtoull(text, &suffix, 10);
+	switch (*suffix)
+	{
+		case 'g': case 'G': value <<= 10; /* fall through */
+		case 'm': case 'M': value <<= 10; /* fall through */
+		case 'k': case 'K': value <<= 10; ++suffix; break;
+	}
+
+	if (suffix == text || *suffix != '\0' || errno != 0 || *text == '-')
+	{
+		return false;
+	}
+
+	*size = value;
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	DISK_ACTION run_prog = checkProgram(argv[0]);
+
+	disk_io* disk = NULL;
+	
+	if (run_prog == DISK_ACTION_NONE)
+	{
+		usage(run_prog);
+	}
+
+	sfs_options options;
+	options.io_backend = IO_MMAP;
+	options.queue_depth = IO_DEFAULT_QUEUE_DEPTH;
+	options.readahead = IO_DEFAULT_READAHEAD;
+	options.window_size = IO_DEFAULT_WINDOW;
+	options.workers = default_workers();
+	options.verify_manifest = NULL;
+	options.hash_algo = HASH_CRC32C;
+	options.layout = false;
+	options.json = false;
+	options.replace = false;
+	options.has_range = false;
+	options.range_offset = 0;
+	options.range_length = UINT64_MAX;
+	options.max_bw = 0;
+	options.max_iops = 0;
+	options.ioprio_class = 0;
+	options.ioprio_level = 0;
+	options.progress = false;
+	options.overlay = NULL;
+	options.in_memory = false;
+	options.index = false;
+	options.scan = NULL;
+	options.tar = false;
+	options.chunk_size = PACK_DEFAULT_CHUNK;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'j':
+				{
+					options.workers = atoi(optarg);
+					if (options.workers < 1) usage(run_prog);
+				}
+				break;
+
+			case OPT_VERIFY:
+				{
+					options.verify_manifest = optarg;
+				}
+				break;
+
+			case OPT_HASH:
+				{
+					if (strcasecmp(optarg, "crc32c") == 0)
+						options.hash_algo = HASH_CRC32C;
+					else if (strcasecmp(optarg, "hash64") == 0)
+						options.hash_algo = HASH_64;
+					else usage(run_prog);
+				}
+				break;
+
+			case OPT_IO:
+				{
+					if (strcasecmp(optarg, "mmap") == 0)
+						options.io_backend = IO_MMAP;
+					else if (strcasecmp(optarg, "pread") == 0)
+						options.io_backend = IO_PREAD;
+					else if (strcasecmp(optarg, "uring") == 0 || strcasecmp(optarg, "io_uring") == 0)
+						options.io_backend = IO_URING;
+					else if (strcasecmp(optarg, "window") == 0)
+						options.io_backend = IO_WINDOW;
+					else usage(run_prog);
+				}
+				break;
+
+			case OPT_QUEUE_DEPTH:
+				{
+					int depth = atoi(optarg);
+					if (depth < 1 || depth > 4096) usage(run_prog);
+					options.queue_depth = depth;
+				}
+				break;
+
+			case OPT_READAHEAD:
+				{
+					if (!parse_size(optarg, &options.readahead)) usage(run_prog);
+				}
+				break;
+
+			case OPT_WINDOW:
+				{
+					if (!parse_size(optarg, &options.window_size) || options.window_size == 0) usage(run_prog);
+				}
+				break;
+
+			case OPT_LAYOUT:
+				{
+					options.layout = true;
+				}
+				break;
+
+			case OPT_JSON:
+				{
+					// JSON output is only offered for the layout reports
+					options.layout = true;
+					options.json = true;
+				}
+				break;
+
+			case OPT_REPLACE:
+				{
+					options.replace = true;
+				}
+				break;
+
+			case OPT_OFFSET:
+				{
+					if (!parse_size(optarg, &options.range_offset)) usage(run_prog);
+					options.has_range = true;
+				}
+				break;
+
+			case OPT_LENGTH:
+				{
+					if (!parse_size(optarg, &options.range_length)) usage(run_prog);
+					options.has_range = true;
+				}
+				break;
+
+			case OPT_MAX_BW:
+				{
+					if (!parse_size(optarg, &options.max_bw)) usage(run_prog);
+				}
+				break;
+
+			case OPT_MAX_IOPS:
+				{
+					if (!parse_size(optarg, &options.max_iops)) usage(run_prog);
+				}
+				break;
+
+			case OPT_IOPRIO:
+				{
+					// A class, optionally followed by a level within it
+					char* level = strchr(optarg, ':');
+					size_t class_length = level ? (size_t)(level - optarg) : strlen(optarg);
+
+					if (strncasecmp(optarg, "idle", class_length) == 0 && class_length == 4)
+						options.ioprio_class = IOPRIO_IDLE;
+					else if ((strncasecmp(optarg, "be", class_length) == 0 && class_length == 2) ||
+							 (strncasecmp(optarg, "best-effort", class_length) == 0 && class_length == 11))
+						options.ioprio_class = IOPRIO_BEST_EFFORT;
+					else
+						usage(run_prog);
+
+					if (level != NULL)
+					{
+						char* end;
+						long value = strtol(level + 1, &end, 10);
+						if (end == level + 1 || *end != '\0' || value < 0 || value > 7) usage(run_prog);
+						options.ioprio_level = value;
+					}
+					else options.ioprio_level = IOPRIO_DEFAULT_LEVEL;
+				}
+				break;
+
+			case OPT_PROGRESS:
+				{
+					options.progress = true;
+				}
+				break;
+
+			case OPT_OVERLAY:
+				{
+					options.overlay = optarg;
+				}
+				break;
+
+			case OPT_IN_MEMORY:
+				{
+					options.in_memory = true;
+				}
+				break;
+
+			case OPT_INDEX:
+				{
+					options.index = true;
+				}
+				break;
+
+			case OPT_TRACE:
+				{
+					// Straight away, so opening the disk is traced too
+					trace_start(optarg);
+				}
+				break;
+
+			case OPT_SCAN:
+				{
+					if (run_prog != DISKINFO && run_prog != DISKLIST) usage(run_prog);
+					options.scan = optarg;
+				}
+				break;
+
+			case OPT_TAR:
+				{
+					if (run_prog != DISKGET && run_prog != DISKPUT) usage(run_prog);
+					options.tar = true;
+				}
+				break;
+
+			case OPT_CHUNK_SIZE:
+				{
+					uint64_t size;
+					if (run_prog != DISKPACK || !parse_size(optarg, &size) ||
+						size < PACK_MIN_CHUNK || size > PACK_MAX_CHUNK || (size & (size - 1)) != 0) usage(run_prog);
+					options.chunk_size = size;
+				}
+				break;
+
+			default:
+				usage(run_prog);
+		}
+	}
+
+	// Whatever getopt didn't consume are the positional arguments
+	char** args = &argv[optind];
+	int nargs = argc - optind;
+
+	int status = EXIT_SUCCESS;
+
+	// Before any worker threads start, so they inherit it
+	throttle_set_ioprio(options.ioprio_class, options.ioprio_level);
+
+	// A scan opens its images itself, each worker one at a time
+	if (options.scan != NULL)
+	{
+		if (nargs != 0) usage(run_prog);
+		return diskscan(options.scan, run_prog, &options);
+	}
+
+	// diskcopy names its source as <disk>:<filename>, split it so the disk can be opened
+	char* copy_name = NULL;
+	if (run_prog == DISKCOPY && nargs >= 1 && args[0] != NULL)
+	{
+		copy_name = strrchr(args[0], ':');
+		if (copy_name == NULL || copy_name[1] == '\0') usage(DISKCOPY);
+		*copy_name++ = '\0';
+	}
+
+	if (nargs >= 1 && args[0] != NULL)
+	{
+		// Only the tools that modify the disk need it opened writable
+		bool writable = run_prog == DISKPUT || run_prog == DISKPATCH || run_prog == DISKCOMMIT;
+
+		// An overlay belongs to the image being changed, diskcopy's is its destination
+		// and diskcommit names the overlay it folds into the image itself
+		sfs_options first = options;
+		if (run_prog == DISKCOPY || run_prog == DISKCOMMIT)
+		{
+			first.overlay = NULL;
+		}
+		disk = disk_open(args[0], writable, &first);
+	}
+	else usage(run_prog);
+
+	switch (run_prog)
+	{
+		case DISKINFO:
+			{
+				diskinfo(disk, &options);
+				break;
+			}
+
+		case DISKLIST: 
+			{
+				disklist(disk, &options);
+				break;
+			}
+		case DISKGET: 
+			{
+				// The archive is binary, don't spray it over a terminal
+				if (options.tar)
+				{
+					if (nargs == 1 && !options.has_range && !isatty(STDOUT_FILENO))
+					{
+						status = diskget_tar(disk, stdout, &options);
+					}
+					else usage(DISKGET);
+				}
+				else if (nargs == 2 && args[1] != NULL)
+				{
+					diskget(disk, args[1], &options);
+				}
+				else usage(DISKGET);
+				break;
+			}
+
+		case DISKPUT: 
+			{
+				if (options.tar)
+				{
+					if (nargs == 1 && !options.replace && !isatty(STDIN_FILENO))
+					{
+						diskput_tar(disk, stdin, &options);
+					}
+					else usage(DISKPUT);
+				}
+				else if (nargs == 2 && args[1] != NULL)
+				{
+					// Isolate the filename itself
+					char* filename = strrchr(args[1], '/');
+					filename = filename ? ++filename : args[1];
+
+					FILE* put_file = fopen(args[1], "rb");
+					if (put_file == NULL)
+					{
+						char* err = strerror(errno);
+						quit(err);
+					}
+					else diskput(disk, put_file, filename, &options);
+					
+					fclose(put_file);
+				}
+				else usage(DISKPUT);
+				break;
+			}
+
+		case DISKDELTA:
+			{
+				// The delta is binary, don't spray it over a terminal
+				if (nargs == 2 && args[1] != NULL && !isatty(STDOUT_FILENO))
+				{
+					sfs_options second = options;
+					second.overlay = NULL;
+					disk_io* new_disk = disk_open(args[1], false, &second);
+
+					diskdelta(disk, new_disk, stdout, &options);
+
+					disk_close(new_disk);
+				}
+				else usage(DISKDELTA);
+				break;
+			}
+
+		case DISKPATCH:
+			{
+				if (nargs == 1 && !isatty(STDIN_FILENO))
+				{
+					diskpatch(disk, stdin, &options);
+				}
+				else usage(DISKPATCH);
+				break;
+			}
+
+		case DISKHASH:
+			{
+				// Any further arguments restrict which files are hashed
+				status = diskhash(disk, (const char**)&args[1], nargs - 1, &options);
+				break;
+			}
+
+		case DISKCOPY:
+			{
+				if (nargs == 2 && args[1] != NULL)
+				{
+					// The copy keeps its name unless the destination gives a new one
+					char* new_name = strrchr(args[1], ':');
+					if (new_name != NULL)
+					{
+						*new_name++ = '\0';
+						if (*new_name == '\0') usage(DISKCOPY);
+					}
+					else new_name = copy_name;
+
+					disk_io* dst_disk = disk_open(args[1], true, &options);
+
+					diskcopy(disk, copy_name, dst_disk, new_name, &options);
+
+					disk_close(dst_disk);
+				}
+				else usage(DISKCOPY);
+				break;
+			}
+
+		case DISKGREP:
+			{
+				// Any further arguments restrict which files are searched
+				if (nargs >= 2 && args[1] != NULL && args[1][0] != '\0')
+				{
+					status = diskgrep(disk, args[1], (const char**)&args[2], nargs - 2, &options);
+				}
+				else usage(DISKGREP);
+				break;
+			}
+
+		case DISKCOMMIT:
+			{
+				if (nargs == 2 && args[1] != NULL)
+				{
+					diskcommit(disk, args[1]);
+				}
+				else usage(DISKCOMMIT);
+				break;
+			}
+
+		case DISKPACK:
+			{
+				if (nargs == 2 && args[1] != NULL)
+				{
+					diskpack(disk, args[1], &options);
+				}
+				else usage(DISKPACK);
+				break;
+			}
+
+		case DISKUNPACK:
+			{
+				if (nargs == 2 && args[1] != NULL)
+				{
+					diskunpack(disk, args[1], &options);
+				}
+				else usage(DISKUNPACK);
+				break;
+			}
+	
+		default:
+		case DISK_ACTION_NONE:
+		break;
+	}
+
+	disk_close(disk);
+
+	return status;
+
+}
+
+int default_workers(void)
+{
+	// One worker per online core, within reason
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1) cores = 1;
+	if (cores > 64) cores = 64;
+	return (int)cores;
+}
+
+DISK_ACTION checkProgram(const char* executed_name)
+{
+	char* input = strdup(executed_name);
+	char* prog_name = strrchr(input, '/');
+	DISK_ACTION result = DISK_ACTION_NONE;
+	
+	// strrchr found the last forward slash
+	// we want just the program name;
+	prog_name = prog_name ? ++prog_name : input;
+
+	if (strcasecmp(prog_name, "diskinfo") == 0)
+		result = DISKINFO;
+	else if (strcasecmp(prog_name, "disklist") == 0)
+		result = DISKLIST;
+	else if (strcasecmp(prog_name, "diskget") == 0)
+		result = DISKGET;
+	else if (strcasecmp(prog_name, "diskput") == 0)
+		result = DISKPUT;
+	else if (strcasecmp(prog_name, "diskdelta") == 0)
+		result = DISKDELTA;
+	else if (strcasecmp(prog_name, "diskpatch") == 0)
+		result = DISKPATCH;
+	else if (strcasecmp(prog_name, "diskhash") == 0)
+		result = DISKHASH;
+	else if (strcasecmp(prog_name, "diskcopy") == 0)
+		result = DISKCOPY;
+	else if (strcasecmp(prog_name, "diskgrep") == 0)
+		result = DISKGREP;
+	else if (strcasecmp(prog_name, "diskcommit") == 0)
+		result = DISKCOMMIT;
+	else if (strcasecmp(prog_name, "diskpack") == 0)
+		result = DISKPACK;
+	else if (strcasecmp(prog_name, "diskunpack") == 0)
+		result = DISKUNPACK;
+
+	free(input);
+
+	return result;
+}
+
+void quit(const char* reason)
+{
+	if (reason != NULL)
+		fprintf(stderr, "%s\n", reason);
+
+	fprintf(stderr, "Exiting...\n");
+
+	exit(EXIT_FAILURE);
+} 
+
+void usage(DISK_ACTION action)
+{
+	printf("Simple File System (FAT12) Usage:\n");
+	
+	switch (action) 
+	{
+		default:
+		case DISK_ACTION_NONE:
+			{
+				printf("  This program suite must be executed under one of the following names:\n");
+				printf("    [ ./diskinfo | ./disklist | ./diskget | ./diskput | ./diskdelta | ./diskpatch | ./diskhash | ./diskcopy | ./diskgrep | ./diskcommit | ./diskpack | ./diskunpack ]\n");
+			}
+			break;
+
+		case DISKINFO:
+			{
+				printf(" diskinfo [--layout] [--json] <disk>\n");
+				printf("    Processes the <disk> image and displays some basic information about the image.\n");
+				printf("    --layout adds free space fragmentation: a histogram of free runs, the largest free\n");
+				printf("    run and the average number of extents per file. --json prints all of it as JSON.\n");
+				printf(" diskinfo --scan <dir|list-file|-> [--layout] [-j <workers>]\n");
+				printf("    Reports on every image in a directory, or listed one per line, as a JSON line each,\n");
+				printf("    with the same fields as --json. Images that can't be read get an \"error\" line and\n");
+				printf("    the scan carries on.\n");
+			}
+			break;
+
+		case DISKLIST:
+			{
+				printf(" disklist [--layout] [--json] <disk>\n");
+				printf("    Displays contents of the root directory of the <disk> image.\n");
+				printf("    --layout lists each file's size, cluster count, extents and fragmentation ratio\n");
+				printf("    instead. --json prints the layout as JSON.\n");
+				printf(" disklist --scan <dir|list-file|-> [--layout] [-j <workers>]\n");
+				printf("    Lists the root directory of every image in a directory, or listed one per line,\n");
+				printf("    as a JSON line each. Images that can't be read get an \"error\" line instead.\n");
+			} 
+			break;
+
+		case DISKGET:
+			{
+				printf("  diskget [-j <workers>] [--readahead <size>] <disk> <filename>\n");
+				printf("    Retrieves <filename> from the <disk> image and places it in the current working directory\n");
+				printf("    --readahead prefetches that far along the file's cluster chain (default 8M, 0 disables)\n");
+				printf("    Files over 1M are copied by <workers> threads at once (default one per core)\n");
+				printf("  diskget [--offset <n>] [--length <n>] <disk> <filename> > <part>\n");
+				printf("    Copies just that range of <filename> to standard output, reading only the clusters it spans\n");
+				printf("  diskget --tar <disk> > <archive>\n");
+				printf("    Writes every file in the root of <disk> to standard output as a ustar archive\n");
+			}
+			break;
+	
+		case DISKPUT:
+			{
+				printf(" diskput [-j <workers>] [--replace] <disk> <file>\n");
+				printf("    Writes a copy of <file> to the root of <disk> if enough space is available\n");
+				printf("    Files over 1M are copied by <workers> threads at once (default one per core)\n");
+				printf("    --replace overwrites a file of the same name in place, reusing its clusters\n");
+				printf("    and only writing the ones whose contents changed. It isn't crash safe: a crash part way\n");
+				printf("    leaves the file part old and part new, and readers copying it meanwhile may see a mix of both\n");
+				printf(" diskput --tar <disk> < <archive>\n");
+				printf("    Writes every regular file in a tar stream read from standard input to the root of <disk>,\n");
+				printf("    under the last part of its name. Nothing is committed unless the whole stream fits\n");
+			}
+			break;
+
+		case DISKDELTA:
+			{
+				printf(" diskdelta <old-disk> <new-disk> > <delta>\n");
+				printf("    Compares two images of the same geometry and writes the changed clusters, FAT and\n");
+				printf("    root directory sectors to standard output as a binary delta\n");
+			}
+			break;
+
+		case DISKPATCH:
+			{
+				printf(" diskpatch <disk> < <delta>\n");
+				printf("    Applies a delta read from standard input to <disk> in place, committing the FAT last\n");
+			}
+			break;
+
+		case DISKHASH:
+			{
+				printf(" diskhash [-j <workers>] [--hash crc32c|hash64] [--readahead <size>] <disk> [<filename> ...]\n");
+				printf("    Checksums files in the root of <disk> without extracting them, printing lines\n");
+				printf("    in the same format as sha256sum\n");
+				printf(" diskhash [-j <workers>] --verify <manifest> <disk>\n");
+				printf("    Checks every file listed in <manifest> against its checksum\n");
+			}
+			break;
+
+		case DISKCOPY:
+			{
+				printf(" diskcopy [--readahead <size>] <src-disk>:<filename> <dst-disk>[:<newname>]\n");
+				printf("    Copies <filename> from the root of <src-disk> to the root of <dst-disk>, keeping its\n");
+				printf("    attributes and timestamps, without going through a file on the host\n");
+			}
+			break;
+
+		case DISKGREP:
+			{
+				printf(" diskgrep [-j <workers>] [--readahead <size>] <disk> <pattern> [<filename> ...]\n");
+				printf("    Searches files in the root of <disk> for the string <pattern> without extracting\n");
+				printf("    them, printing a <filename>:<offset> line for every match\n");
+			}
+			break;
+
+		case DISKCOMMIT:
+			{
+				printf(" diskcommit <disk> <overlay>\n");
+				printf("    Writes the blocks recorded in <overlay> into <disk>, then empties the overlay\n");
+			}
+			break;
+
+		case DISKPACK:
+			{
+				printf(" diskpack [--chunk-size <size>] <disk> <packed>\n");
+				printf("    Writes <disk> to <packed> as independently compressed chunks (default 64K) with an index.\n");
+				printf("    Every tool opens a packed image directly, decoding only the chunks it reads\n");
+			}
+			break;
+
+		case DISKUNPACK:
+			{
+				printf(" diskunpack <packed> <disk>\n");
+				printf("    Writes the packed image <packed> back out as the raw image <disk>\n");
+			}
+			break;
+	}
+	if (action != DISK_ACTION_NONE)
+	{
+		printf("\n Common options:\n");
+		printf("  --io mmap|pread|uring|window\n");
+		printf("                          How the image is accessed (default mmap)\n");
+		printf("  --queue-depth <n>       Requests kept in flight by the uring backend (default " VALOF(IO_DEFAULT_QUEUE_DEPTH) ")\n");
+		printf("  --window <size>         Size of each region mapped by the window backend (default 64M)\n");
+		printf("  --max-bw <size>         Limit data transfers to <size> bytes per second (K, M and G suffixes)\n");
+		printf("  --max-iops <n>          Limit data transfers to <n> operations per second\n");
+		printf("  --ioprio idle|be[:<n>]  Run in the idle or best-effort I/O class, at level 0-7 within it\n");
+		printf("  --progress              Report progress and throughput on stderr every second\n");
+		printf("  --overlay <file>        Leave <disk> untouched and keep changes in <file>, created if needed\n");
+		printf("  --in-memory             Read <disk> into memory, work on it there and write back what changed on exit\n");
+		printf("  --index                 Start from the decoded metadata kept in <disk>.sfsidx, built or refreshed as needed\n");
+		printf("  --trace <file>          Record timed events from every thread, written to <file> as Chrome trace JSON on exit\n");
+	}
+	printf("\n");
+	exit(EXIT_FAILURE);
+}
+
+
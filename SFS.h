@@ -1,18 +1,93 @@
-#pragma once
-
-#define MIN(X, Y) (X > Y ? Y : X)
-
-typedef enum
-{
-	DISKINFO,
-	DISKLIST,
-	DISKGET,
-	DISKPUT,
-	DISK_ACTION_NONE = -1
-} DISK_ACTION;
-
-void usage(DISK_ACTION action);
-
-void quit(const char* reason);
-
-DISK_ACTION checkProgram(const char* executed_name);
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packed_types.h"
+
+#define MIN(X, Y) (X > Y ? Y : X)
+
+typedef enum
+{
+	DISKINFO,
+	DISKLIST,
+	DISKGET,
+	DISKPUT,
+	DISKDELTA,
+	DISKPATCH,
+	DISKHASH,
+	DISKCOPY,
+	DISKGREP,
+	DISKCOMMIT,
+	DISKPACK,
+	DISKUNPACK,
+	DISK_ACTION_NONE = -1
+} DISK_ACTION;
+
+typedef enum
+{
+	HASH_CRC32C,
+	HASH_64
+} HASH_ALGO;
+
+typedef enum
+{
+	IO_MMAP,
+	IO_PREAD,
+	IO_URING,
+	IO_WINDOW
+} IO_BACKEND;
+
+// Settings collected from the command line
+typedef struct
+{
+	IO_BACKEND io_backend;
+	unsigned int queue_depth;
+	uint64_t readahead;
+	uint64_t window_size;
+	int workers;
+	const char* verify_manifest;
+	HASH_ALGO hash_algo;
+	bool layout;
+	bool json;
+	bool replace;
+
+	// A part of a file to retrieve instead of all of it
+	bool has_range;
+	uint64_t range_offset;
+	uint64_t range_length;
+
+	// Limits on data transfers, 0 for none, and the I/O scheduling class
+	uint64_t max_bw;
+	uint64_t max_iops;
+	int ioprio_class;
+	int ioprio_level;
+	bool progress;
+
+	// Copy-on-write file the image's changes go to, leaving the image itself untouched
+	const char* overlay;
+
+	// Work on a copy of the image held in memory, writing back what changed on exit
+	bool in_memory;
+
+	// Keep the decoded metadata in <disk>.sfsidx and start from it when it's current
+	bool index;
+
+	// A directory or list of images for diskinfo and disklist to report on, instead of one disk
+	const char* scan;
+
+	// diskput reads a tar stream from standard input, diskget writes one to standard output
+	bool tar;
+
+	// Size of the chunks diskpack compresses the image in
+	uint64_t chunk_size;
+} sfs_options;
+
+void usage(DISK_ACTION action);
+
+void quit(const char* reason);
+
+DISK_ACTION checkProgram(const char* executed_name);
+
+int default_workers(void);
@@ -1,119 +1,145 @@
-﻿#pragma once
-
-#include "packed_types.h"
-
-#ifndef VALOF
-#define VALOF(X) STR(X)		  
-#endif // !VALOF
-
-#ifndef STR
-#define STR(X) #X			  
-#endif // !STR
-
-#define LEN__JUMP                3
-#define LEN_OEM_name             8
-#define LEN_Volume_Label         11
-#define LEN_File_System_Type     8
-#define LEN_Boot_Sector_Required 62
-
-#pragma pack(push)
-struct boot_sector_portions
-{
-	byte   _JUMP               [LEN__JUMP];
-	byte   OEM_name            [LEN_OEM_name];
-	word   Bytes_Per_Sector;
-	byte   Sectors_Per_Cluster;
-	word   reserved_Sectors;
-	byte   FATs;
-	word   Max_Root_Entries;
-	word   Small_Sectors;
-	byte   Media_Descriptor;
-	word   Sectors_Per_FAT;
-	word   Sectors_Per_Track;
-	word   Heads;
-	dword  Hidden_Sectors;
-	dword  Large_Sectors;
-	word   _IGNORE;
-	byte   Boot_Signature;
-	dword  Volume_ID;
-	byte   Volume_Label        [LEN_Volume_Label];
-	byte   File_System_Type    [LEN_File_System_Type];
-	// The remainder of the boot sector is occupied by BIOS code
-};
-#pragma pack(pop)
-
-typedef struct boot_sector_t
-{
-	union
-	{
-		byte raw[LEN_Boot_Sector_Required];
-		struct boot_sector_portions data;
-	};
-} boot_sector;
-
-typedef struct 
-{
-	unsigned int num_sectors;
-	unsigned int FAT1_offset;
-	unsigned int FAT2_offset;
-	unsigned int root_offset;
-	unsigned int data_offset;
-	unsigned int total_size;
-	unsigned int FAT_size;
-} boot_extra;
-
-static inline boot_extra initialize_boot(boot_sector* boot, const byte* disk)
-{
-	boot_extra extra;
-	
-	// Initialize the boot sector struct by copying in data from the disk.
-	for (int i = 0; i < LEN_Boot_Sector_Required; ++i)
-	{
-		boot->raw[i].value = disk[i].value;
-	}
-
-	// The number of sectors on the disk could be stored in 
-	// two places. Small_Sectors or Large_Sectors iff the
-	// former is equal to zero.
-	extra.num_sectors = boot->data.Small_Sectors.value != 0
-					  ? boot->data.Small_Sectors.value
-			          : boot->data.Large_Sectors.value;
-
-	// Calculate the location of the first FAT table
-	extra.FAT1_offset = boot->data.reserved_Sectors.value
-					* boot->data.Bytes_Per_Sector.value;
-
-	// Calculate the location of the backup, second FAT table
-	extra.FAT2_offset = extra.FAT1_offset
-					+ boot->data.Sectors_Per_FAT.value
-					* boot->data.Bytes_Per_Sector.value;
-
-	// Calculate the location of the root directory sector
-	extra.root_offset = extra.FAT1_offset
-					+ boot->data.FATs.value
-					* boot->data.Sectors_Per_FAT.value
-					* boot->data.Bytes_Per_Sector.value;
-
-	// Calculate the location of the start of the data region
-	extra.data_offset = extra.root_offset
-					+ boot->data.Max_Root_Entries.value
-					* 32; // sizeof(directory_entry)
-	
-	// Total disk size can also be calculated at this point
-	extra.total_size = extra.num_sectors
-					* boot->data.Bytes_Per_Sector.value;
-
-	// Calculate the number of entries in the FAT tables.
-	// Since this is a FAT12 image, every 3 bytes makes up 2 
-	// FAT table entries. The number of FAT entries is thus 
-	// two thirds of the number of bytes per FAT table
-	extra.FAT_size  = 2
-					* (boot->data.Bytes_Per_Sector.value
-					* boot->data.Sectors_Per_FAT.value)
-					/ 3;
-
-	return extra;
-}
-
-
-
+﻿#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "packed_types.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+#ifndef VALOF
+#define VALOF(X) STR(X)		  
+#endif // !VALOF
+
+#ifndef STR
+#define STR(X) #X			  
+#endif // !STR
+
+#define LEN__JUMP                3
+#define LEN_OEM_name             8
+#define LEN_Volume_Label         11
+#define LEN_File_System_Type     8
+#define LEN_Boot_Sector_Required 62
+
+#pragma pack(push)
+struct boot_sector_portions
+{
+	byte   _JUMP               [LEN__JUMP];
+	byte   OEM_name            [LEN_OEM_name];
+	word   Bytes_Per_Sector;
+	byte   Sectors_Per_Cluster;
+	word   reserved_Sectors;
+	byte   FATs;
+	word   Max_Root_Entries;
+	word   Small_Sectors;
+	byte   Media_Descriptor;
+	word   Sectors_Per_FAT;
+	word   Sectors_Per_Track;
+	word   Heads;
+	dword  Hidden_Sectors;
+	dword  Large_Sectors;
+	word   _IGNORE;
+	byte   Boot_Signature;
+	dword  Volume_ID;
+	byte   Volume_Label        [LEN_Volume_Label];
+	byte   File_System_Type    [LEN_File_System_Type];
+	// The remainder of the boot sector is occupied by BIOS code
+};
+#pragma pack(pop)
+
+typedef struct boot_sector_t
+{
+	union
+	{
+		byte raw[LEN_Boot_Sector_Required];
+		struct boot_sector_portions data;
+	};
+} boot_sector;
+
+typedef struct 
+{
+	// Byte offsets and sizes are 64-bit, a large volume's can pass 4 GiB
+	uint32_t num_sectors;
+	uint64_t FAT1_offset;
+	uint64_t FAT2_offset;
+	uint64_t root_offset;
+	uint64_t data_offset;
+	uint64_t total_size;
+	unsigned int FAT_size;
+	unsigned int cluster_size;
+} boot_extra;
+
+static inline boot_extra initialize_boot(boot_sector* boot, const byte* disk)
+{
+	boot_extra extra;
+	TRACE_BEGIN(span);
+	
+	// Initialize the boot sector struct by copying in data from the disk.
+	for (int i = 0; i < LEN_Boot_Sector_Required; ++i)
+	{
+		boot->raw[i].value = disk[i].value;
+	}
+
+	// The number of sectors on the disk could be stored in 
+	// two places. Small_Sectors or Large_Sectors iff the
+	// former is equal to zero.
+	extra.num_sectors = boot->data.Small_Sectors.value != 0
+					  ? boot->data.Small_Sectors.value
+			          : boot->data.Large_Sectors.value;
+
+	// Calculate the location of the first FAT table
+	extra.FAT1_offset = (uint64_t)boot->data.reserved_Sectors.value
+					* boot->data.Bytes_Per_Sector.value;
+
+	// Calculate the location of the backup, second FAT table
+	extra.FAT2_offset = extra.FAT1_offset
+					+ (uint64_t)boot->data.Sectors_Per_FAT.value
+					* boot->data.Bytes_Per_Sector.value;
+
+	// Calculate the location of the root directory sector
+	extra.root_offset = extra.FAT1_offset
+					+ (uint64_t)boot->data.FATs.value
+					* boot->data.Sectors_Per_FAT.value
+					* boot->data.Bytes_Per_Sector.value;
+
+	// Calculate the location of the start of the data region
+	extra.data_offset = extra.root_offset
+					+ (uint64_t)boot->data.Max_Root_Entries.value
+					* 32; // sizeof(directory_entry)
+	
+	// Size in bytes of a single allocation unit in the data region
+	extra.cluster_size = boot->data.Sectors_Per_Cluster.value
+					* boot->data.Bytes_Per_Sector.value;
+
+	// Total disk size can also be calculated at this point
+	extra.total_size = (uint64_t)extra.num_sectors
+					* boot->data.Bytes_Per_Sector.value;
+
+	// Calculate the number of entries in the FAT tables.
+	// Since this is a FAT12 image, every 3 bytes makes up 2 
+	// FAT table entries. The number of FAT entries is thus 
+	// two thirds of the number of bytes per FAT table
+	extra.FAT_size  = 2
+					* ((uint64_t)boot->data.Bytes_Per_Sector.value
+					* boot->data.Sectors_Per_FAT.value)
+					/ 3;
+
+	TRACE_END(span, "initialize_boot", "FAT_size", extra.FAT_size);
+	return extra;
+}
+
+// Quits unless the boot sector lists its file system as FAT12
+static inline void check_FAT12(const boot_sector* boot)
+{
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot->data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it...
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "packed_types.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Most bytes of a file one worker copies per turn, and the most copied in one go
+#define COPY_BATCH_SIZE (1u << 20)
+
+// A piece of a file and where it lives in the image
+typedef struct
+{
+	uint64_t disk_offset;
+	uint64_t file_offset;
+	size_t length;
+} copy_extent;
+
+// A file's pieces, in file order, gathered once its chain is known
+typedef struct
+{
+	copy_extent* extents;
+	size_t count;
+	size_t capacity;
+} copy_list;
+
+// State shared by the workers, batches of pieces are handed out through @next
+typedef struct
+{
+	disk_io* io;
+	int fd;
+	bool to_disk;
+	throttle* limit;
+
+	const copy_extent* extents;
+
+	// Batch b covers extents [batches[b], batches[b + 1])
+	size_t* batches;
+	size_t num_batches;
+	size_t next;
+} copy_pool;
+
+static inline void copy_list_init(copy_list* list)
+{
+	list->extents = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+static inline void copy_list_free(copy_list* list)
+{
+	free(list->extents);
+	list->extents = NULL;
+}
+
+/* COPY LIST PUSH
+ * Add the next piece of a file, merging it into the previous piece when it carries on from it
+ * both in the image and in the file. Pieces are kept to COPY_BATCH_SIZE bytes at most.
+ * @param copy_list* : list - The file's pieces so far
+ * @param uint64_t   : disk_offset - Where the piece is in the image
+ * @param uint64_t   : file_offset - Where the piece is in the file
+ * @param size_t     : length - Size of the piece
+ */
+static inline void copy_list_push(copy_list* list, uint64_t disk_offset, uint64_t file_offset, size_t length)
+{
+	while (length > 0)
+	{
+		copy_extent* last = list->count > 0 ? &list->extents[list->count - 1] : NULL;
+		if (last != NULL &&
+			last->disk_offset + last->length == disk_offset && last->file_offset + last->length == file_offset &&
+			last->length < COPY_BATCH_SIZE)
+		{
+			size_t grow = MIN(length, COPY_BATCH_SIZE - last->length);
+			last->length += grow;
+			disk_offset += grow;
+			file_offset += grow;
+			length -= grow;
+			continue;
+		}
+
+		if (list->count == list->capacity)
+		{
+			list->capacity = list->capacity ? list->capacity * 2 : 64;
+			list->extents = realloc(list->extents, list->capacity * sizeof(copy_extent));
+			if (list->extents == NULL)
+			{
+				quit("Out of memory while planning the copy.");
+			}
+		}
+
+		size_t piece = MIN(length, (size_t)COPY_BATCH_SIZE);
+		copy_extent* extent = &list->extents[list->count++];
+		extent->disk_offset = disk_offset;
+		extent->file_offset = file_offset;
+		extent->length = piece;
+
+		disk_offset += piece;
+		file_offset += piece;
+		length -= piece;
+	}
+}
+
+// Copy one batch of pieces between the image and the file
+static inline void copy_batch(const copy_pool* pool, size_t first, size_t last, byte* buffer)
+{
+	for (size_t i = first; i < last; ++i)
+	{
+		const copy_extent* extent = &pool->extents[i];
+		TRACE_BEGIN(span);
+
+		if (pool->to_disk)
+		{
+			pread_all(pool->fd, buffer, extent->length, extent->file_offset);
+			throttle_io(pool->limit, extent->length);
+			disk_write(pool->io, buffer, extent->length, extent->disk_offset);
+		}
+		else
+		{
+			// Mapped images fault the piece in with one hint rather than a page at a time
+			disk_range range = { extent->disk_offset, extent->length };
+			disk_prefetch(pool->io, &range, 1);
+
+			const byte* data = disk_view(pool->io, extent->disk_offset, extent->length, buffer);
+			pwrite_all(pool->fd, data, extent->length, extent->file_offset);
+			throttle_io(pool->limit, extent->length);
+		}
+
+		TRACE_END(span, "copy extent", "bytes", extent->length);
+	}
+}
+
+static inline void* copy_worker(void* arg)
+{
+	copy_pool* pool = arg;
+	size_t idx;
+
+	byte* buffer = malloc(COPY_BATCH_SIZE);
+	if (buffer == NULL)
+	{
+		quit("Out of memory while copying.");
+	}
+
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_batches)
+	{
+		copy_batch(pool, pool->batches[idx], pool->batches[idx + 1], buffer);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* COPY EXTENTS
+ * Copy a file's pieces between the image and a host file with a pool of workers, each
+ * taking a batch of pieces at a time and moving it with positional reads and writes.
+ * @param disk_io*         : io - The image
+ * @param int              : fd - The host file, read from or written to at each piece's file offset
+ * @param bool             : to_disk - Copy from the file into the image, otherwise the other way
+ * @param const copy_list* : list - The pieces
+ * @param int              : workers - Most threads to copy with, the caller's thread is used for 1
+ * @param throttle*        : limit - Paces the copies, shared by every worker
+ */
+static inline void copy_extents(disk_io* io, int fd, bool to_disk, const copy_list* list, int workers, throttle* limit)
+{
+	copy_pool pool;
+	pool.io = io;
+	pool.fd = fd;
+	pool.to_disk = to_disk;
+	pool.limit = limit;
+	pool.extents = list->extents;
+	pool.next = 0;
+
+	// Gather neighbouring pieces into batches of about COPY_BATCH_SIZE, so a
+	// fragmented file isn't handed out a cluster at a time
+	pool.batches = malloc((list->count + 1) * sizeof(size_t));
+	if (pool.batches == NULL)
+	{
+		quit("Out of memory while planning the copy.");
+	}
+
+	pool.num_batches = 0;
+	size_t batched = 0;
+	for (size_t i = 0; i < list->count; ++i)
+	{
+		if (i == 0 || batched + list->extents[i].length > COPY_BATCH_SIZE)
+		{
+			pool.batches[pool.num_batches++] = i;
+			batched = 0;
+		}
+		batched += list->extents[i].length;
+	}
+	pool.batches[pool.num_batches] = list->count;
+
+	workers = MIN((size_t)workers, pool.num_batches);
+	if (workers <= 1)
+	{
+		copy_worker(&pool);
+		free(pool.batches);
+		return;
+	}
+
+	pthread_t* threads = calloc(workers, sizeof(pthread_t));
+	if (threads == NULL)
+	{
+		quit("Out of memory while copying.");
+	}
+
+	for (int w = 0; w < workers; ++w)
+	{
+		if (pthread_create(&threads[w], NULL, copy_worker, &pool) != 0)
+		{
+			quit("Failed to start a worker thread.");
+		}
+	}
+	for (int w = 0; w < workers; ++w)
+	{
+		pthread_join(threads[w], NULL);
+	}
+
+	free(threads);
+	free(pool.batches);
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// Slicing-by-8 tables for the software fallback, built on first use
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_build_table(void)
+{
+	for (uint32_t n = 0; n < 256; ++n)
+	{
+		uint32_t crc = n;
+		for (int k = 0; k < 8; ++k)
+		{
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+		}
+		crc32c_table[0][n] = crc;
+	}
+
+	// Each further table advances the CRC by another byte of zeros
+	for (uint32_t n = 0; n < 256; ++n)
+	{
+		uint32_t crc = crc32c_table[0][n];
+		for (int k = 1; k < 8; ++k)
+		{
+			crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc32c_table[k][n] = crc;
+		}
+	}
+}
+
+static inline uint32_t crc32c_software(uint32_t crc, const unsigned char* p, size_t len)
+{
+	pthread_once(&crc32c_table_once, crc32c_build_table);
+
+	while (len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		word ^= crc;
+		crc = crc32c_table[7][ word        & 0xFF] ^
+			  crc32c_table[6][(word >>  8) & 0xFF] ^
+			  crc32c_table[5][(word >> 16) & 0xFF] ^
+			  crc32c_table[4][(word >> 24) & 0xFF] ^
+			  crc32c_table[3][(word >> 32) & 0xFF] ^
+			  crc32c_table[2][(word >> 40) & 0xFF] ^
+			  crc32c_table[1][(word >> 48) & 0xFF] ^
+			  crc32c_table[0][ word >> 56        ];
+		p   += 8;
+		len -= 8;
+	}
+
+	while (len--)
+	{
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t len)
+{
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		p   += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+	while (len--)
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+/* CRC32C UPDATE
+ * Extend a running CRC32C (Castagnoli) over another block of bytes. The SSE4.2
+ * crc32 instruction is used when the processor has it, a table driven version otherwise.
+ * @param uint32_t    : crc - The running value, start with crc32c_init() and finish with crc32c_final()
+ * @param const void* : data - The bytes to checksum
+ * @param size_t      : len - The number of bytes at @param(data)
+ * @returns uint32_t - The updated running value
+ */
+static inline uint32_t crc32c_update(uint32_t crc, const void* data, size_t len)
+{
+#ifdef CRC32C_HAVE_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		return crc32c_hardware(crc, data, len);
+	}
+#endif
+	return crc32c_software(crc, data, len);
+}
+
+static inline uint32_t crc32c_init(void)
+{
+	return 0xFFFFFFFFu;
+}
+
+static inline uint32_t crc32c_final(uint32_t crc)
+{
+	return crc ^ 0xFFFFFFFFu;
+}
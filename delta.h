@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DELTA_MAGIC      "SFSDELTA"
+#define LEN_Delta_Magic  8
+#define DELTA_VERSION    1
+
+// Neighbouring changed clusters are merged into a single record
+// until it reaches this many bytes
+#define DELTA_MAX_EXTENT (1u << 20)
+
+// Regions of the image a delta record can belong to. Records are
+// emitted and applied in this order so the FAT is always committed last.
+typedef enum
+{
+	DELTA_DATA = 0,
+	DELTA_BOOT = 1,
+	DELTA_ROOT = 2,
+	DELTA_FAT  = 3,
+	DELTA_REGIONS
+} DELTA_REGION;
+
+#pragma pack(push, 1)
+typedef struct
+{
+	char     magic[LEN_Delta_Magic];
+	uint32_t version;
+	uint32_t cluster_size;
+	uint64_t image_size;
+	uint64_t data_offset;
+	uint64_t num_records;
+} delta_header;
+
+// Every record is immediately followed by @length bytes of new contents
+typedef struct
+{
+	uint8_t  region;
+	uint8_t  _reserved[3];
+	uint32_t length;
+	uint64_t offset;
+	// Hash of the bytes being replaced, so a delta is only applied
+	// onto the image it was generated against
+	uint64_t old_hash;
+	// Hash of the payload, guards against truncated or corrupt deltas
+	uint64_t new_hash;
+} delta_record;
+#pragma pack(pop)
+
+static inline const char* delta_region_name(DELTA_REGION region)
+{
+	switch (region)
+	{
+		case DELTA_DATA: return "data";
+		case DELTA_BOOT: return "boot";
+		case DELTA_ROOT: return "root";
+		case DELTA_FAT:  return "FAT";
+		default:         return "unknown";
+	}
+}
@@ -0,0 +1,911 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "pack.h"
+#include "sfs_index.h"
+
+#include "SFS.h"
+
+/* DISK OPEN FD
+ * Open the image and record its size, shared by every backend.
+ * @param disk_io*    : io - The disk being opened, receives the descriptor and size
+ * @param const char* : path - Location of the disk image
+ * @param int         : flags - Extra open(2) flags, on top of the access mode
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void disk_open_fd(disk_io* io, const char* path, int flags)
+{
+	// Retrieve a file descriptor for the disk image
+	io->fd = open(path, (io->writable ? O_RDWR : O_RDONLY) | flags);
+	if (io->fd == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	// Get the disk image size from the file descriptor
+	struct stat disk_stat;
+	if (fstat(io->fd, &disk_stat) == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	io->size = disk_stat.st_size;
+}
+
+/* COALESCE RANGES
+ * Merge ranges that lie within a page of each other, so hints for a fragmented chain
+ * cost a system call per stretch of the image rather than one per cluster.
+ * @param const disk_range* : ranges - The ranges, in the order they'll be read
+ * @param size_t            : count - The number of @param(ranges)
+ * @param void (*)(...)     : hint - Called once per merged, page aligned span
+ */
+static void coalesce_ranges(disk_io* io, const disk_range* ranges, size_t count, void (*hint)(disk_io* io, uint64_t start, uint64_t end))
+{
+	const uint64_t page = IO_ALIGNMENT;
+	uint64_t start = 0;
+	uint64_t end = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint64_t range_start = ranges[i].offset & ~(page - 1);
+		uint64_t range_end = (ranges[i].offset + ranges[i].length + page - 1) & ~(page - 1);
+		range_end = MIN(range_end, io->size);
+
+		if (end > start && range_start <= end + page && range_end + page >= start)
+		{
+			start = MIN(start, range_start);
+			end = range_end > end ? range_end : end;
+			continue;
+		}
+
+		if (end > start)
+		{
+			hint(io, start, end);
+		}
+		start = range_start;
+		end = range_end;
+	}
+
+	if (end > start)
+	{
+		hint(io, start, end);
+	}
+}
+
+//
+// mmap backend, the whole image is mapped shared into our address space
+//
+
+static void mmap_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	disk_open_fd(io, path, 0);
+
+	if (io->size < LEN_Boot_Sector_Required)
+	{
+		quit("Disk image is too small to hold a boot sector.");
+	}
+
+	// Map the disk image to our address space
+	int protection = io->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	io->map = mmap(NULL, io->size, protection, MAP_SHARED, io->fd, 0);
+	if (io->map == MAP_FAILED)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void mmap_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	memcpy(buffer, &io->map[offset], length);
+}
+
+static void mmap_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	memcpy(&io->map[offset], buffer, length);
+}
+
+static void mmap_sync(disk_io* io)
+{
+	if (msync(io->map, io->size, MS_SYNC) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void mmap_willneed(disk_io* io, uint64_t start, uint64_t end)
+{
+	// Starts reading the pages in without waiting for them, failure only costs speed
+	madvise(&io->map[start], end - start, MADV_WILLNEED);
+}
+
+static void mmap_prefetch(disk_io* io, const disk_range* ranges, size_t count)
+{
+	coalesce_ranges(io, ranges, count, mmap_willneed);
+}
+
+static void mmap_close(disk_io* io)
+{
+	if (munmap(io->map, io->size) != 0)
+	{
+		// Failed to unmount the disk
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	close(io->fd);
+}
+
+const struct disk_io_ops mmap_ops =
+{
+	.name  = "mmap",
+	.open  = mmap_open,
+	.read  = mmap_read,
+	.write = mmap_write,
+	.sync  = mmap_sync,
+	.close = mmap_close,
+
+	.prefetch = mmap_prefetch,
+};
+
+//
+// pread backend, buffered positional reads and writes through the page cache
+//
+
+static void pread_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	disk_open_fd(io, path, 0);
+}
+
+void pread_all(int fd, void* buffer, size_t length, uint64_t offset)
+{
+	char* position = buffer;
+	while (length > 0)
+	{
+		ssize_t got = pread(fd, position, length, offset);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got < 0)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+		if (got == 0)
+		{
+			quit("Unexpected end of the disk image.");
+		}
+
+		position += got;
+		offset   += got;
+		length   -= got;
+	}
+}
+
+void pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset)
+{
+	const char* position = buffer;
+	while (length > 0)
+	{
+		ssize_t put = pwrite(fd, position, length, offset);
+		if (put < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (put <= 0)
+		{
+			char* err = strerror(put < 0 ? errno : EIO);
+			quit(err);
+		}
+
+		position += put;
+		offset   += put;
+		length   -= put;
+	}
+}
+
+static void pread_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	pread_all(io->fd, buffer, length, offset);
+}
+
+static void pread_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	pwrite_all(io->fd, buffer, length, offset);
+}
+
+static void pread_sync(disk_io* io)
+{
+	if (fsync(io->fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void pread_willneed(disk_io* io, uint64_t start, uint64_t end)
+{
+	// Queues asynchronous reads into the page cache, the preads that follow
+	// find them there or already on their way
+	posix_fadvise(io->fd, start, end - start, POSIX_FADV_WILLNEED);
+}
+
+static void pread_prefetch(disk_io* io, const disk_range* ranges, size_t count)
+{
+	coalesce_ranges(io, ranges, count, pread_willneed);
+}
+
+static void pread_close(disk_io* io)
+{
+	close(io->fd);
+}
+
+const struct disk_io_ops pread_ops =
+{
+	.name  = "pread",
+	.open  = pread_open,
+	.read  = pread_read,
+	.write = pread_write,
+	.sync  = pread_sync,
+	.close = pread_close,
+
+	.prefetch = pread_prefetch,
+};
+
+//
+// window backend, regions of the image are mapped as they're used instead of the whole
+// file, so address space and page tables stay bounded however large the image grows
+//
+
+// One mapped region of the image
+typedef struct
+{
+	byte* base;
+	uint64_t start;
+	size_t length;
+
+	// Copies in progress through the window, it's only replaced once they're done
+	unsigned int users;
+	uint64_t last_used;
+} window_slot;
+
+typedef struct
+{
+	uint64_t window_size;
+	window_slot slots[IO_WINDOW_SLOTS];
+	uint64_t clock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+} window_state;
+
+static void window_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	disk_open_fd(io, path, 0);
+
+	window_state* state = calloc(1, sizeof(window_state));
+	if (state == NULL)
+	{
+		quit("Out of memory while opening the disk.");
+	}
+
+	// Windows start on page boundaries, as mmap requires of its offsets
+	uint64_t window = options->window_size > 0 ? options->window_size : IO_DEFAULT_WINDOW;
+	state->window_size = (window + IO_ALIGNMENT - 1) & ~(uint64_t)(IO_ALIGNMENT - 1);
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->released, NULL);
+	io->backend = state;
+}
+
+/* WINDOW ACQUIRE
+ * Find the window holding @param(offset), mapping it in place of the least recently used
+ * idle window when it isn't mapped yet. The window is held until window_release().
+ * @param disk_io* : io - The disk being accessed
+ * @param uint64_t : offset - Position in the image that's wanted
+ * @returns window_slot* - The window, covering at least the byte at @param(offset).
+ *                       - On failure terminates with EXIT_FAILURE.
+ */
+static window_slot* window_acquire(disk_io* io, uint64_t offset)
+{
+	window_state* state = io->backend;
+	uint64_t start = offset - offset % state->window_size;
+
+	pthread_mutex_lock(&state->lock);
+
+	window_slot* slot;
+	for (;;)
+	{
+		slot = NULL;
+		window_slot* victim = NULL;
+
+		for (int i = 0; i < IO_WINDOW_SLOTS; ++i)
+		{
+			window_slot* candidate = &state->slots[i];
+			if (candidate->base != NULL && candidate->start == start)
+			{
+				slot = candidate;
+				break;
+			}
+			if (candidate->users == 0 && (victim == NULL || candidate->base == NULL ||
+				(victim->base != NULL && candidate->last_used < victim->last_used)))
+			{
+				victim = candidate;
+			}
+		}
+
+		if (slot != NULL)
+		{
+			break;
+		}
+
+		// Every window is being copied through, wait for one to come free
+		if (victim == NULL)
+		{
+			pthread_cond_wait(&state->released, &state->lock);
+			continue;
+		}
+
+		if (victim->base != NULL && munmap(victim->base, victim->length) != 0)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+
+		victim->start = start;
+		victim->length = MIN(state->window_size, io->size - start);
+
+		int protection = io->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+		victim->base = mmap(NULL, victim->length, protection, MAP_SHARED, io->fd, start);
+		if (victim->base == MAP_FAILED)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+
+		slot = victim;
+		break;
+	}
+
+	slot->users += 1;
+	slot->last_used = ++state->clock;
+
+	pthread_mutex_unlock(&state->lock);
+	return slot;
+}
+
+static void window_release(disk_io* io, window_slot* slot)
+{
+	window_state* state = io->backend;
+
+	pthread_mutex_lock(&state->lock);
+	slot->users -= 1;
+	if (slot->users == 0)
+	{
+		pthread_cond_signal(&state->released);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+// Copy between the buffer and the image a window at a time, the copies themselves run unlocked
+static void window_copy(disk_io* io, byte* buffer, size_t length, uint64_t offset, bool to_disk)
+{
+	while (length > 0)
+	{
+		window_slot* slot = window_acquire(io, offset);
+		uint64_t within = offset - slot->start;
+		size_t piece = MIN(length, (size_t)(slot->length - within));
+
+		if (to_disk)
+		{
+			memcpy(slot->base + within, buffer, piece);
+		}
+		else
+		{
+			memcpy(buffer, slot->base + within, piece);
+		}
+
+		window_release(io, slot);
+
+		buffer += piece;
+		offset += piece;
+		length -= piece;
+	}
+}
+
+static void window_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	window_copy(io, buffer, length, offset, false);
+}
+
+static void window_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	window_copy(io, (byte*)buffer, length, offset, true);
+}
+
+static void window_sync(disk_io* io)
+{
+	// Writes through windows already unmapped are dirty in the page cache,
+	// so flushing the file covers them as well as the ones still mapped
+	if (fsync(io->fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void window_prefetch(disk_io* io, const disk_range* ranges, size_t count)
+{
+	// The ranges may lie outside every window, so hint the file rather than a mapping
+	coalesce_ranges(io, ranges, count, pread_willneed);
+}
+
+static void window_close(disk_io* io)
+{
+	window_state* state = io->backend;
+
+	for (int i = 0; i < IO_WINDOW_SLOTS; ++i)
+	{
+		if (state->slots[i].base != NULL && munmap(state->slots[i].base, state->slots[i].length) != 0)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+	}
+
+	pthread_cond_destroy(&state->released);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+	io->backend = NULL;
+
+	close(io->fd);
+}
+
+const struct disk_io_ops window_ops =
+{
+	.name  = "window",
+	.open  = window_open,
+	.read  = window_read,
+	.write = window_write,
+	.sync  = window_sync,
+	.close = window_close,
+
+	.prefetch = window_prefetch,
+};
+
+//
+// Backend independent interface used by the tools
+//
+
+/* DISK OPEN
+ * Open a disk image through the I/O backend selected in @param(options), or on top of a copy-on-write
+ * overlay when it names one. Metadata is loaded as it's used.
+ * @param const char*        : path - Location of the disk image
+ * @param bool               : writable - Whether the tool will modify the disk
+ * @param const sfs_options* : options - Selects the backend and its tuning
+ * @returns disk_io* - The opened disk, release with disk_close().
+ *                   - On failure terminates with EXIT_FAILURE.
+ */
+disk_io* disk_open(const char* path, bool writable, const sfs_options* options)
+{
+	disk_io* io = calloc(1, sizeof(disk_io));
+	if (io == NULL)
+	{
+		quit("Out of memory while opening the disk.");
+	}
+
+	io->path = path;
+	io->writable = writable;
+	io->fd = -1;
+	io->use_index = options->index;
+
+	// The index describes the image, not what an overlay makes of it
+	if (options->index && options->overlay != NULL)
+	{
+		quit("An index describes the image itself, --index can't be used with --overlay.");
+	}
+
+	switch (options->io_backend)
+	{
+		default:
+		case IO_MMAP:   io->ops = &mmap_ops;   break;
+		case IO_PREAD:  io->ops = &pread_ops;  break;
+		case IO_URING:  io->ops = &uring_ops;  break;
+		case IO_WINDOW: io->ops = &window_ops; break;
+	}
+
+	// Writes go to the overlay instead of the image, whichever backend was asked for
+	if (options->overlay != NULL)
+	{
+		io->ops = &overlay_ops;
+	}
+
+	// The whole image is worked on in memory and written back on close
+	if (options->in_memory)
+	{
+		if (options->overlay != NULL)
+		{
+			quit("An overlay already keeps the image untouched, --in-memory can't be used with one.");
+		}
+		io->ops = &memory_ops;
+	}
+
+	// Packed images are decoded a chunk at a time, likewise whichever backend was asked for
+	if (pack_detect(path))
+	{
+		if (options->overlay != NULL)
+		{
+			quit("Overlays need a raw image, unpack it with diskunpack first.");
+		}
+		if (options->in_memory)
+		{
+			quit("Packed images are decoded as they're read, --in-memory needs a raw image.");
+		}
+		io->ops = &pack_ops;
+	}
+
+	io->ops->open(io, path, options);
+
+	if (io->size < LEN_Boot_Sector_Required)
+	{
+		quit("Disk image is too small to hold a boot sector.");
+	}
+
+	// The boot sector tells us where the metadata ends and the data region begins
+	byte raw_boot[LEN_Boot_Sector_Required];
+	disk_read(io, raw_boot, LEN_Boot_Sector_Required, 0);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, raw_boot);
+	io->metadata_size = MIN((uint64_t)boot_calc.data_offset, io->size);
+	io->FAT_offset = MIN((uint64_t)boot_calc.FAT1_offset, io->metadata_size);
+
+	if (io->map != NULL)
+	{
+		// Nothing to load, the mapping already is the metadata
+		io->metadata = io->map;
+	}
+	else
+	{
+		size_t blocks = (io->metadata_size + METADATA_BLOCK - 1) / METADATA_BLOCK;
+		io->metadata = malloc(io->metadata_size);
+		io->metadata_loaded = calloc(blocks ? blocks : 1, sizeof(unsigned char));
+		if (io->metadata == NULL || io->metadata_loaded == NULL)
+		{
+			quit("Out of memory while loading the disk metadata.");
+		}
+		pthread_mutex_init(&io->metadata_lock, NULL);
+	}
+
+	return io;
+}
+
+void disk_close(disk_io* io)
+{
+	if (io->metadata != io->map)
+	{
+		pthread_mutex_destroy(&io->metadata_lock);
+		free(io->metadata_loaded);
+		free(io->metadata);
+	}
+
+	io->ops->close(io);
+
+	// Stamped once the backend has written everything back
+	index_close(io);
+	free(io);
+}
+
+void disk_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	if (offset > io->size || length > io->size - offset)
+	{
+		quit("Attempted to read past the end of the disk image.");
+	}
+
+	io->ops->read(io, buffer, length, offset);
+}
+
+void disk_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	if (offset > io->size || length > io->size - offset)
+	{
+		quit("Attempted to write past the end of the disk image.");
+	}
+
+	io->ops->write(io, buffer, length, offset);
+
+	// Keep our copy of the metadata coherent with what was written
+	if (io->metadata != io->map && offset < io->metadata_size)
+	{
+		size_t overlap = MIN((uint64_t)length, io->metadata_size - offset);
+		memcpy(&io->metadata[offset], buffer, overlap);
+	}
+}
+
+/* DISK VIEW
+ * Get at a range of the image for reading, without copying when the backend maps the image.
+ * @param disk_io*  : io - The disk to read
+ * @param uint64_t  : offset - Position of the first byte wanted
+ * @param size_t    : length - Number of bytes wanted
+ * @param byte*     : scratch - At least @param(length) bytes the range is read into when it isn't mapped
+ * @returns const byte* - Pointer to the requested bytes, valid until @param(scratch) is reused.
+ */
+const byte* disk_view(disk_io* io, uint64_t offset, size_t length, byte* scratch)
+{
+	if (io->map != NULL)
+	{
+		if (offset > io->size || length > io->size - offset)
+		{
+			quit("Attempted to read past the end of the disk image.");
+		}
+		return &io->map[offset];
+	}
+
+	disk_read(io, scratch, length, offset);
+	return scratch;
+}
+
+/* DISK COMMIT
+ * Write back a range of the metadata buffer after a tool has modified it.
+ * @param disk_io* : io - The disk whose metadata changed
+ * @param uint64_t : offset - Start of the modified range, relative to the start of the image
+ * @param size_t   : length - Size of the modified range
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void disk_commit(disk_io* io, uint64_t offset, size_t length)
+{
+	if (offset >= io->metadata_size)
+	{
+		return;
+	}
+	length = MIN((uint64_t)length, io->metadata_size - offset);
+
+	// A shared mapping is the disk, changes are already in place
+	if (io->metadata != io->map)
+	{
+		io->ops->write(io, &io->metadata[offset], length, offset);
+	}
+	else
+	{
+		disk_dirty(io, offset, length);
+	}
+}
+
+/* DISK DIRTY
+ * Tell the backend a tool changed a range of the mapping directly, instead of with disk_write().
+ * @param disk_io* : io - The disk whose mapping was changed
+ * @param uint64_t : offset - Start of the changed range
+ * @param size_t   : length - Size of the changed range
+ * @returns void - Does nothing for backends whose mapping is the image itself.
+ */
+void disk_dirty(disk_io* io, uint64_t offset, size_t length)
+{
+	if (io->ops->dirty != NULL)
+	{
+		io->ops->dirty(io, offset, length);
+	}
+}
+
+void disk_sync(disk_io* io)
+{
+	io->ops->sync(io);
+}
+
+/* DISK PREFETCH
+ * Tell the backend which ranges are going to be read next, so it can start on them early.
+ * @param disk_io*          : io - The disk about to be read
+ * @param const disk_range* : ranges - The ranges, in the order they'll be read
+ * @param size_t            : count - The number of @param(ranges)
+ * @returns void - Does nothing for backends that can't make use of the hint.
+ */
+void disk_prefetch(disk_io* io, const disk_range* ranges, size_t count)
+{
+	if (io->ops->prefetch != NULL && count > 0)
+	{
+		io->ops->prefetch(io, ranges, count);
+	}
+}
+
+/* DISK READ RANGES
+ * Read several ranges of the image one after another into @param(buffer).
+ * @param disk_io*          : io - The disk to read
+ * @param const disk_range* : ranges - The ranges to read
+ * @param size_t            : count - The number of @param(ranges)
+ * @param void*             : buffer - Receives the ranges back to back, as large as their total length
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void disk_read_ranges(disk_io* io, const disk_range* ranges, size_t count, void* buffer)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (ranges[i].offset > io->size || ranges[i].length > io->size - ranges[i].offset)
+		{
+			quit("Attempted to read past the end of the disk image.");
+		}
+	}
+
+	if (io->ops->read_ranges != NULL)
+	{
+		io->ops->read_ranges(io, ranges, count, buffer);
+		return;
+	}
+
+	byte* out = buffer;
+	for (size_t i = 0; i < count; ++i)
+	{
+		io->ops->read(io, out, ranges[i].length, ranges[i].offset);
+		out += ranges[i].length;
+	}
+}
+
+/* LOCK RANGE
+ * Take or drop an fcntl lock on part of a file, waiting for it when it's held elsewhere.
+ * Open file description locks are used where the kernel has them, so a lock belongs to this
+ * descriptor rather than the whole process, and closing another descriptor doesn't drop it.
+ * @param int       : fd - The image, or the overlay standing in for it
+ * @param short     : type - F_RDLCK, F_WRLCK or F_UNLCK
+ * @param uint64_t  : offset - Start of the locked range
+ * @param uint64_t  : length - Size of the locked range
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void lock_range(int fd, short type, uint64_t offset, uint64_t length)
+{
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = offset;
+	lock.l_len = length;
+
+	int command = F_SETLKW;
+#ifdef F_OFD_SETLKW
+	command = F_OFD_SETLKW;
+#endif
+
+	while (fcntl(fd, command, &lock) == -1)
+	{
+		if (errno == EINTR)
+		{
+			continue;
+		}
+#ifdef F_OFD_SETLKW
+		// Kernels older than 3.15 only have process wide locks
+		if (errno == EINVAL && command == F_OFD_SETLKW)
+		{
+			command = F_SETLKW;
+			continue;
+		}
+#endif
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+/* DISK LOCK METADATA
+ * Lock the FATs and root directory against other processes. Tools that only read take a shared
+ * lock while they look at the metadata, writers take an exclusive one just to commit their changes.
+ * @param disk_io*  : io - The disk to lock
+ * @param DISK_LOCK : mode - DISK_LOCK_SHARED or DISK_LOCK_EXCLUSIVE
+ * @returns void - Blocks until the lock is granted, on failure terminates with EXIT_FAILURE.
+ */
+void disk_lock_metadata(disk_io* io, DISK_LOCK mode)
+{
+	if (io->metadata_size <= io->FAT_offset)
+	{
+		return;
+	}
+
+	lock_range(io->fd, mode == DISK_LOCK_EXCLUSIVE ? F_WRLCK : F_RDLCK, io->FAT_offset, io->metadata_size - io->FAT_offset);
+
+	// A writer may have committed since our copy of the metadata was loaded, read it afresh.
+	// Exclusive holders are about to write their own changes back, so theirs is kept.
+	if (mode == DISK_LOCK_SHARED && io->metadata != io->map)
+	{
+		size_t blocks = (io->metadata_size + METADATA_BLOCK - 1) / METADATA_BLOCK;
+		pthread_mutex_lock(&io->metadata_lock);
+		memset(io->metadata_loaded, 0, blocks);
+		pthread_mutex_unlock(&io->metadata_lock);
+	}
+}
+
+void disk_unlock_metadata(disk_io* io)
+{
+	if (io->metadata_size <= io->FAT_offset)
+	{
+		return;
+	}
+
+	lock_range(io->fd, F_UNLCK, io->FAT_offset, io->metadata_size - io->FAT_offset);
+}
+
+/* DISK LOCK WRITER
+ * Become the only process allowed to modify the image, until it's closed. Readers aren't
+ * held up by this, it only keeps two writers from allocating the same free clusters.
+ * @param disk_io* : io - The disk about to be modified, opened writable
+ * @returns void - Blocks until every other writer is done, on failure terminates with EXIT_FAILURE.
+ */
+void disk_lock_writer(disk_io* io)
+{
+	// The first byte of the boot sector is never locked by readers, so it stands in for the writer's turn
+	lock_range(io->fd, F_WRLCK, 0, 1);
+}
+
+/* LOCK OVERLAY WRITER
+ * Take the writer's turn on an overlay from outside of it, the same turn tools writing
+ * through it take, so none of them can add blocks while it's being committed.
+ * @param int : fd - The overlay, opened writable
+ * @returns void - Blocks until every writer using the overlay is done, on failure terminates with EXIT_FAILURE.
+ */
+void lock_overlay_writer(int fd)
+{
+	lock_range(fd, F_WRLCK, 0, 1);
+}
+
+/* DISK METADATA RANGE
+ * Get at part of the metadata region, reading in only the blocks it covers if they aren't loaded yet.
+ * Safe to call from several threads at once.
+ * @param disk_io* : io - The disk to read
+ * @param uint64_t : offset - Start of the range, relative to the start of the image
+ * @param size_t   : length - Size of the range
+ * @returns byte* - Pointer to the range within the metadata buffer.
+ *                - On failure terminates with EXIT_FAILURE.
+ */
+byte* disk_metadata_range(disk_io* io, uint64_t offset, size_t length)
+{
+	if (offset > io->metadata_size || length > io->metadata_size - offset)
+	{
+		quit("Attempted to read metadata past the start of the data region.");
+	}
+
+	if (io->metadata != io->map && length > 0)
+	{
+		size_t first = offset / METADATA_BLOCK;
+		size_t last  = (offset + length - 1) / METADATA_BLOCK;
+
+		for (size_t block = first; block <= last; ++block)
+		{
+			if (__atomic_load_n(&io->metadata_loaded[block], __ATOMIC_ACQUIRE))
+			{
+				continue;
+			}
+
+			pthread_mutex_lock(&io->metadata_lock);
+			if (!io->metadata_loaded[block])
+			{
+				uint64_t start = (uint64_t)block * METADATA_BLOCK;
+				size_t span = MIN((uint64_t)METADATA_BLOCK, io->metadata_size - start);
+				io->ops->read(io, &io->metadata[start], span, start);
+				__atomic_store_n(&io->metadata_loaded[block], 1, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&io->metadata_lock);
+		}
+	}
+
+	return &io->metadata[offset];
+}
+
+/* DISK METADATA
+ * Get at the whole metadata region, for tools that scan all of it.
+ * @param disk_io* : io - The disk to read
+ * @returns byte* - Pointer to the start of the image's metadata, indexed by absolute image offset.
+ */
+byte* disk_metadata(disk_io* io)
+{
+	return disk_metadata_range(io, 0, io->metadata_size);
+}
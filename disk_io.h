@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "packed_types.h"
+
+#include "SFS.h"
+
+// Direct I/O needs buffers, offsets and lengths aligned to the device's
+// logical block size. A page is a safe choice on every device we target.
+#define IO_ALIGNMENT 4096
+
+// Largest single request handed to the kernel by the queued backend
+#define IO_CHUNK_SIZE (128u << 10)
+
+#define IO_DEFAULT_QUEUE_DEPTH 32
+
+// Granularity the metadata region is loaded in by backends that don't map the image
+#define METADATA_BLOCK 4096
+
+// Default distance the chain walkers look ahead of the data they're consuming
+#define IO_DEFAULT_READAHEAD (8u << 20)
+
+// Size of each region of the image the window backend maps, and how many it keeps mapped at once
+#define IO_DEFAULT_WINDOW (64u << 20)
+#define IO_WINDOW_SLOTS 8
+
+// Size of the reads the in-memory backend loads the image with, and the huge page size it rounds its copy up to
+#define MEMORY_LOAD_SIZE (8u << 20)
+#define MEMORY_HUGE_PAGE (2u << 20)
+
+typedef struct disk_io disk_io;
+typedef struct sfs_index sfs_index;
+
+// How a tool holds the image's metadata against other processes. Readers share
+// the FATs and root directory, a writer only excludes them while it commits.
+typedef enum
+{
+	DISK_LOCK_SHARED,
+	DISK_LOCK_EXCLUSIVE
+} DISK_LOCK;
+
+// A span of the image, offsets are absolute positions in the image
+typedef struct
+{
+	uint64_t offset;
+	size_t length;
+} disk_range;
+
+// Every backend provides these, offsets are absolute positions in the image
+struct disk_io_ops
+{
+	const char* name;
+	void (*open)(disk_io* io, const char* path, const sfs_options* options);
+	void (*read)(disk_io* io, void* buffer, size_t length, uint64_t offset);
+	void (*write)(disk_io* io, const void* buffer, size_t length, uint64_t offset);
+	void (*sync)(disk_io* io);
+	void (*close)(disk_io* io);
+
+	// Optional. Hint that the ranges will be read soon.
+	void (*prefetch)(disk_io* io, const disk_range* ranges, size_t count);
+	// Optional. Read several ranges back to back into one buffer, with as
+	// many of them in flight at once as the backend can manage.
+	void (*read_ranges)(disk_io* io, const disk_range* ranges, size_t count, void* buffer);
+	// Optional. A tool changed part of the mapping in place rather than through write.
+	void (*dirty)(disk_io* io, uint64_t offset, size_t length);
+};
+
+struct disk_io
+{
+	const struct disk_io_ops* ops;
+	const char* path;
+	int fd;
+	bool writable;
+	uint64_t size;
+
+	// The whole image in our address space, only when the backend maps it
+	byte* map;
+
+	// The reserved, FAT and root directory regions. Tools work on these
+	// through this buffer and write their changes back with disk_commit().
+	// Unless mapped, it's loaded a block at a time as ranges are asked for.
+	byte* metadata;
+	uint64_t metadata_size;
+	unsigned char* metadata_loaded;
+	pthread_mutex_t metadata_lock;
+
+	// Start of the FATs. Locks on the metadata cover from here to the data region.
+	uint64_t FAT_offset;
+
+	// State private to the backend
+	void* backend;
+
+	// Metadata index beside the image, opened the first time disk_index() is asked for it
+	bool use_index;
+	sfs_index* index;
+};
+
+// The available backends
+extern const struct disk_io_ops mmap_ops;
+extern const struct disk_io_ops pread_ops;
+extern const struct disk_io_ops uring_ops;
+extern const struct disk_io_ops window_ops;
+extern const struct disk_io_ops overlay_ops;
+extern const struct disk_io_ops pack_ops;
+extern const struct disk_io_ops memory_ops;
+
+// Helpers for backend implementations
+void disk_open_fd(disk_io* io, const char* path, int flags);
+
+void pread_all(int fd, void* buffer, size_t length, uint64_t offset);
+
+void pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset);
+
+disk_io* disk_open(const char* path, bool writable, const sfs_options* options);
+
+void disk_close(disk_io* io);
+
+void disk_read(disk_io* io, void* buffer, size_t length, uint64_t offset);
+
+void disk_write(disk_io* io, const void* buffer, size_t length, uint64_t offset);
+
+const byte* disk_view(disk_io* io, uint64_t offset, size_t length, byte* scratch);
+
+void disk_commit(disk_io* io, uint64_t offset, size_t length);
+
+void disk_dirty(disk_io* io, uint64_t offset, size_t length);
+
+void disk_sync(disk_io* io);
+
+void disk_prefetch(disk_io* io, const disk_range* ranges, size_t count);
+
+void disk_read_ranges(disk_io* io, const disk_range* ranges, size_t count, void* buffer);
+
+void lock_range(int fd, short type, uint64_t offset, uint64_t length);
+
+void disk_lock_metadata(disk_io* io, DISK_LOCK mode);
+
+void disk_unlock_metadata(disk_io* io);
+
+void disk_lock_writer(disk_io* io);
+
+void lock_overlay_writer(int fd);
+
+byte* disk_metadata_range(disk_io* io, uint64_t offset, size_t length);
+
+byte* disk_metadata(disk_io* io);
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "overlay.h"
+
+#include "SFS.h"
+
+// Largest run of blocks moved from the overlay to the image in one go
+#define COMMIT_EXTENT_SIZE (1u << 20)
+
+/* COMMIT BLOCKS
+ * Copy the overlay's blocks on one side of the metadata boundary into the image,
+ * a run of consecutive blocks in consecutive slots at a time.
+ * @param disk_io*            : disk - The base image, opened writable
+ * @param const overlay_file* : overlay - The overlay being folded in
+ * @param bool                : metadata - Commit the blocks before the data region, otherwise those after it
+ * @param byte*               : buffer - COMMIT_EXTENT_SIZE bytes to stage runs in
+ * @param uint64_t*           : blocks - Counts the blocks written
+ * @param uint64_t*           : bytes - Counts the bytes written
+ */
+static void commit_blocks(disk_io* disk, const overlay_file* overlay, bool metadata, byte* buffer, uint64_t* blocks, uint64_t* bytes)
+{
+	const overlay_header* header = overlay->header;
+	uint32_t block_size = header->block_size;
+
+	uint64_t run_block = 0;
+	uint64_t run_slot = 0;
+	uint64_t run_count = 0;
+
+	for (uint64_t block = 0; block <= header->num_blocks; ++block)
+	{
+		uint32_t entry = block < header->num_blocks ? overlay->index[block] : 0;
+		bool wanted = entry != 0 && (block * block_size < disk->metadata_size) == metadata;
+
+		if (wanted && run_count > 0 &&
+			run_block + run_count == block && run_slot + run_count == entry - 1 &&
+			(run_count + 1) * block_size <= COMMIT_EXTENT_SIZE)
+		{
+			run_count += 1;
+			continue;
+		}
+
+		if (run_count > 0)
+		{
+			uint64_t start = run_block * block_size;
+			size_t length = MIN(run_count * block_size, disk->size - start);
+
+			pread_all(overlay->fd, buffer, length, header->data_offset + run_slot * block_size);
+			disk_write(disk, buffer, length, start);
+
+			*blocks += run_count;
+			*bytes += length;
+			run_count = 0;
+		}
+
+		if (wanted)
+		{
+			run_block = block;
+			run_slot = entry - 1;
+			run_count = 1;
+		}
+	}
+}
+
+/* DISK COMMIT OVERLAY
+ * Fold the blocks recorded in an overlay back into its base image, then empty the overlay.
+ * @param disk_io*    : disk - The base image, opened writable without an overlay
+ * @param const char* : overlay_path - Location of the overlay file
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */
+void diskcommit(disk_io* disk, const char* overlay_path)
+{
+	// Keep other writers out until the overlay is folded in and emptied
+	disk_lock_writer(disk);
+
+	byte raw_boot[LEN_Boot_Sector_Required];
+	disk_read(disk, raw_boot, LEN_Boot_Sector_Required, 0);
+
+	overlay_file overlay;
+	if (!overlay_open(&overlay, overlay_path, false, disk->fd, disk->size, overlay_block_size(raw_boot)))
+	{
+		quit("Overlay doesn't exist.");
+	}
+	overlay_close(&overlay);
+
+	// Now it's known to belong to this image, open it to be emptied afterwards.
+	// Tools writing through it are kept out until it is, so no blocks turn up half way.
+	overlay_open(&overlay, overlay_path, true, disk->fd, disk->size, overlay_block_size(raw_boot));
+	lock_overlay_writer(overlay.fd);
+
+	// Marked before the base is touched, so a commit that stops part way can be run again
+	overlay_begin_commit(&overlay);
+
+	byte* buffer = malloc(COMMIT_EXTENT_SIZE);
+	if (buffer == NULL)
+	{
+		quit("Out of memory while committing the overlay.");
+	}
+
+	uint64_t blocks = 0;
+	uint64_t bytes = 0;
+
+	// Data first, then the metadata that refers to it, like diskpatch
+	commit_blocks(disk, &overlay, false, buffer, &blocks, &bytes);
+	disk_sync(disk);
+
+	disk_lock_metadata(disk, DISK_LOCK_EXCLUSIVE);
+	commit_blocks(disk, &overlay, true, buffer, &blocks, &bytes);
+	disk_sync(disk);
+	disk_unlock_metadata(disk);
+
+	free(buffer);
+
+	// The base has moved on, any other overlay started from it is now refused.
+	// Emptying it also clears the mark, and closing it lets its writers back in.
+	overlay_reset(&overlay, disk->fd);
+	overlay_close(&overlay);
+
+	printf("Overlay committed: %llu blocks, %llu bytes written.\n", (unsigned long long)blocks, (unsigned long long)bytes);
+}
@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+#include "FAT_view.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Largest piece of the file moved between the images in one go
+#define COPY_EXTENT_SIZE (1u << 20)
+
+// A run of clusters allocated back to back on the destination
+typedef struct
+{
+	unsigned int cluster;
+	unsigned int count;
+} copy_run;
+
+// Find a file in the root directory, returns false if there's no such file
+static bool find_entry(const byte* root, const boot_extra* boot_calc, const char* name, directory_entry* found)
+{
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', sizeof(filename));
+
+	for (uint64_t entry_offset = 0; boot_calc->root_offset + entry_offset < boot_calc->data_offset; entry_offset += sizeof(directory_entry))
+	{
+		for (int i = 0; i < sizeof(directory_entry); ++i)
+		{
+			found->raw[i].value = root[entry_offset + i].value;
+		}
+
+		// Same idea of what a file is as diskget
+		if (found->raw[0].value == 0x0 ||
+			found->raw[0].value == 0xE5 ||
+			(found->data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) != 0)
+		{
+			continue;
+		}
+
+		trim_filename(filename, found->data.Filename, found->data.Extension);
+		if (strcasecmp(filename, name) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* DISK COPY
+ * Copy a file from the root directory of one disk to the root directory of another,
+ * moving the data straight between the images without a temporary file.
+ * @param disk_io*           : src - The opened FAT12 disk image holding the file
+ * @param const char*        : src_name - A case-insensitive filename in the root of @param(src)
+ * @param disk_io*           : dst - The opened, writable FAT12 disk image receiving the copy
+ * @param const char*        : dst_name - The name to give the copy
+ * @param const sfs_options* : options - Readahead on the source and limits on the rate data is moved at
+ * @returns void - "File copied." is printed to the console.
+ *               - When the file is missing or its chain can't be read whole, nothing is
+ *                 added to @param(dst) and the program terminates with EXIT_FAILURE.
+ */
+void diskcopy(disk_io* src, const char* src_name, disk_io* dst, const char* dst_name, const sfs_options* options)
+{
+	// Other writers would pick the same free clusters, wait for our turn.
+	// The source may be the same image, its lock covers other bytes.
+	disk_lock_writer(dst);
+
+	boot_sector src_boot;
+	boot_extra src_calc = initialize_boot(&src_boot, disk_metadata_range(src, 0, LEN_Boot_Sector_Required));
+	check_FAT12(&src_boot);
+
+	if (src_calc.data_offset > src->size || src_calc.cluster_size == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	// Find the file and follow its whole chain, then let go of the source's
+	// metadata so the copy doesn't hold up its writers
+	disk_lock_metadata(src, DISK_LOCK_SHARED);
+
+	directory_entry entry;
+	const byte* src_root = disk_metadata_range(src, src_calc.root_offset, src_calc.data_offset - src_calc.root_offset);
+	if (!find_entry(src_root, &src_calc, src_name, &entry))
+	{
+		disk_unlock_metadata(src);
+		quit("File not found.");
+	}
+
+	unsigned int file_size = entry.data.File_Size.value;
+
+	byte* scratch = malloc(COPY_EXTENT_SIZE);
+	if (scratch == NULL)
+	{
+		quit("Out of memory while copying the file.");
+	}
+
+	throttle limit;
+	throttle_init(&limit, options, "diskcopy", file_size);
+
+	FAT_view src_fat;
+	FAT_view_init(&src_fat, src, &src_calc, FAT_CACHED);
+
+	chain_reader reader;
+	chain_reader_init(&reader, &src_fat, &src_calc, entry.data.First_Logical_Cluster.value, file_size, throttle_window(&limit, options->readahead), scratch, COPY_EXTENT_SIZE);
+	chain_reader_resolve(&reader);
+
+	disk_unlock_metadata(src);
+
+	// Now the destination
+	byte* disk = disk_metadata(dst);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+	check_FAT12(&boot);
+
+	if (boot_calc.data_offset > dst->size || boot_calc.cluster_size == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	// The copy keeps the source's attributes and timestamps, only the name and chain are its own
+	directory_entry write_sector = entry;
+	set_short_name(&write_sector, dst_name);
+	write_sector.data.First_Logical_Cluster.value = 0;
+
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', sizeof(filename));
+	trim_filename(filename, write_sector.data.Filename, write_sector.data.Extension);
+
+	directory_entry existing;
+	if (find_entry(&disk[boot_calc.root_offset], &boot_calc, filename, &existing))
+	{
+		quit("A file with this name already exists on the disk");
+	}
+
+	int64_t entry_slot = -1;
+	for (uint64_t entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+	{
+		if (disk[entry_offset].value == 0x00 || disk[entry_offset].value == 0xE5)
+		{
+			entry_slot = entry_offset;
+			break;
+		}
+	}
+
+	if (entry_slot < 0)
+	{
+		quit("Cannot write file to disk, the root directory is full.");
+	}
+
+	// Only clusters that both have a FAT entry and fit in the image can be handed out
+	FAT_entry* table = calloc(boot_calc.FAT_size, sizeof(FAT_entry));
+	if (table == NULL)
+	{
+		quit("Out of memory while copying the file.");
+	}
+
+	TRACE_BEGIN(load);
+	for (unsigned int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
+	{
+		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
+	}
+	TRACE_END(load, "load FAT", "entries", boot_calc.FAT_size);
+
+	unsigned int usable = MIN(boot_calc.FAT_size, 2 + (unsigned int)((dst->size - boot_calc.data_offset) / boot_calc.cluster_size));
+	unsigned int needed = ((uint64_t)file_size + boot_calc.cluster_size - 1) / boot_calc.cluster_size;
+
+	// Take the first free clusters, gathering neighbours into runs
+	copy_run* runs = malloc((needed ? needed : 1) * sizeof(copy_run));
+	unsigned int num_runs = 0;
+	unsigned int allocated = 0;
+	unsigned int previous = 0;
+
+	if (runs == NULL)
+	{
+		quit("Out of memory while copying the file.");
+	}
+
+	for (unsigned int FAT_idx = 2; allocated < needed && FAT_idx < usable; ++FAT_idx)
+	{
+		if (table[FAT_idx].value != 0)
+		{
+			continue;
+		}
+
+		if (allocated == 0)
+			write_sector.data.First_Logical_Cluster.value = FAT_idx;
+		else
+			table[previous].value = FAT_idx;
+
+		if (num_runs > 0 && runs[num_runs - 1].cluster + runs[num_runs - 1].count == FAT_idx)
+		{
+			runs[num_runs - 1].count += 1;
+		}
+		else
+		{
+			runs[num_runs].cluster = FAT_idx;
+			runs[num_runs].count = 1;
+			num_runs += 1;
+		}
+
+		// Marked as the end for now, so the scan doesn't take it twice
+		table[FAT_idx].value = 0xFFF;
+		previous = FAT_idx;
+		allocated += 1;
+	}
+
+	if (allocated < needed)
+	{
+		quit("Cannot write file to disk, insufficient free space.");
+	}
+
+	// Hand each piece of the source chain to the destination runs it lands in.
+	// Under mmap the source piece is the image itself, so the data is only copied once.
+	unsigned int run = 0;
+	uint64_t run_used = 0;
+	uint64_t copied = 0;
+
+	const byte* data;
+	size_t length;
+	while (chain_read(&reader, &data, &length))
+	{
+		while (length > 0)
+		{
+			uint64_t run_bytes = (uint64_t)runs[run].count * boot_calc.cluster_size;
+			size_t piece = MIN((uint64_t)length, run_bytes - run_used);
+			uint64_t location = boot_calc.data_offset + (uint64_t)(runs[run].cluster - 2) * boot_calc.cluster_size + run_used;
+
+			throttle_io(&limit, piece);
+			disk_write(dst, data, piece, location);
+
+			data += piece;
+			length -= piece;
+			copied += piece;
+			run_used += piece;
+
+			if (run_used == run_bytes)
+			{
+				run += 1;
+				run_used = 0;
+			}
+		}
+	}
+
+	bool success = reader.error == NULL && copied == file_size;
+	if (reader.error != NULL)
+	{
+		fprintf(stderr, "diskcopy: %s: %s\n", src_name, reader.error);
+	}
+
+	chain_reader_free(&reader);
+	FAT_view_free(&src_fat);
+	free(scratch);
+	throttle_finish(&limit);
+
+	if (success)
+	{
+		// Readers have to be kept out while the FAT nibbles and directory entry change
+		disk_lock_metadata(dst, DISK_LOCK_EXCLUSIVE);
+
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			disk[entry_slot + j].value = write_sector.raw[j].value;
+		}
+
+		for (unsigned int r = 0; r < num_runs; ++r)
+		{
+			for (unsigned int FAT_idx = runs[r].cluster; FAT_idx < runs[r].cluster + runs[r].count; ++FAT_idx)
+			{
+				update_disk_FAT(table, disk, boot_calc.FAT1_offset, FAT_idx);
+				update_disk_FAT(table, disk, boot_calc.FAT2_offset, FAT_idx);
+			}
+		}
+
+		disk_commit(dst, boot_calc.FAT1_offset, boot_calc.data_offset - boot_calc.FAT1_offset);
+		disk_unlock_metadata(dst);
+	}
+
+	free(runs);
+	free(table);
+
+	if (!success)
+	{
+		// Nothing was committed, the clusters written to are still free on the destination
+		quit("Failed to copy file.");
+	}
+
+	printf("File copied.\n");
+}
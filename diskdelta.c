@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "boot_sector.h"
+#include "delta.h"
+#include "hash.h"
+#include "disk_io.h"
+#include "throttle.h"
+
+#include "SFS.h"
+
+// Don't bother splitting the data region into ranges smaller than this
+#define DELTA_MIN_RANGE (4u << 20)
+
+typedef struct
+{
+	uint64_t offset;
+	uint32_t length;
+} delta_extent;
+
+// One unit of work, a contiguous byte range compared in fixed size steps
+typedef struct
+{
+	disk_io* old_disk;
+	disk_io* new_disk;
+	uint64_t start;
+	uint64_t end;
+	uint32_t unit;
+	throttle* limit;
+
+	delta_extent* extents;
+	size_t num_extents;
+	size_t cap_extents;
+} delta_job;
+
+static void push_extent(delta_job* job, uint64_t offset, uint32_t length)
+{
+	// Coalesce with the previous extent when they touch
+	if (job->num_extents > 0)
+	{
+		delta_extent* last = &job->extents[job->num_extents - 1];
+		if (last->offset + last->length == offset && last->length + length <= DELTA_MAX_EXTENT)
+		{
+			last->length += length;
+			return;
+		}
+	}
+
+	if (job->num_extents == job->cap_extents)
+	{
+		job->cap_extents = job->cap_extents ? job->cap_extents * 2 : 64;
+		job->extents = realloc(job->extents, job->cap_extents * sizeof(delta_extent));
+		if (job->extents == NULL)
+		{
+			quit("Out of memory while building the delta.");
+		}
+	}
+
+	job->extents[job->num_extents].offset = offset;
+	job->extents[job->num_extents].length = length;
+	job->num_extents += 1;
+}
+
+static void* compare_range(void* arg)
+{
+	delta_job* job = arg;
+
+	// Work through the range a window at a time, so backends that
+	// don't map the image only need a bounded amount of memory
+	uint64_t window = (DELTA_MAX_EXTENT / job->unit) * job->unit;
+	byte* old_scratch = malloc(window);
+	byte* new_scratch = malloc(window);
+	if (old_scratch == NULL || new_scratch == NULL)
+	{
+		quit("Out of memory while building the delta.");
+	}
+
+	for (uint64_t base = job->start; base < job->end; base += window)
+	{
+		size_t span = MIN(window, job->end - base);
+		const byte* old_view = disk_view(job->old_disk, base, span, old_scratch);
+		const byte* new_view = disk_view(job->new_disk, base, span, new_scratch);
+		throttle_io(job->limit, span);
+		throttle_io(job->limit, span);
+
+		for (size_t offset = 0; offset < span; offset += job->unit)
+		{
+			uint32_t length = MIN(job->unit, span - offset);
+
+			if (memcmp(&old_view[offset], &new_view[offset], length) != 0)
+			{
+				push_extent(job, base + offset, length);
+			}
+		}
+	}
+
+	free(old_scratch);
+	free(new_scratch);
+	return NULL;
+}
+
+static void write_region(FILE* out, DELTA_REGION region, const delta_job* job, byte* old_scratch, byte* new_scratch)
+{
+	for (size_t i = 0; i < job->num_extents; ++i)
+	{
+		const delta_extent* extent = &job->extents[i];
+		const byte* old_view = disk_view(job->old_disk, extent->offset, extent->length, old_scratch);
+		const byte* new_view = disk_view(job->new_disk, extent->offset, extent->length, new_scratch);
+		throttle_io(job->limit, extent->length);
+		throttle_io(job->limit, extent->length);
+
+		delta_record record;
+		memset(&record, 0, sizeof(record));
+		record.region   = region;
+		record.length   = extent->length;
+		record.offset   = extent->offset;
+		record.old_hash = hash64(old_view, extent->length, 0);
+		record.new_hash = hash64(new_view, extent->length, 0);
+
+		if (fwrite(&record, sizeof(record), 1, out) != 1 ||
+			fwrite(new_view, 1, extent->length, out) != extent->length)
+		{
+			quit("Failed to write the delta to the output stream.");
+		}
+	}
+}
+
+/* DISK DELTA
+ * Compare two images of the same geometry and emit the clusters and metadata sectors that differ.
+ * @param disk_io* : old_disk - The opened base FAT12 disk image
+ * @param disk_io* : new_disk - The opened updated FAT12 disk image
+ * @param FILE*    : out - Stream receiving the binary delta
+ * @param const sfs_options* : options - Limits on the rate the images are read at
+ * @returns void - A summary is printed to stderr, or on failure terminates with EXIT_FAILURE.
+ */
+void diskdelta(disk_io* old_disk, disk_io* new_disk, FILE* out, const sfs_options* options)
+{
+	uint64_t old_size = old_disk->size;
+	uint64_t new_size = new_disk->size;
+
+	// Both images are compared as a whole, so hold off writers' commits
+	// to either of them until the delta is written
+	disk_lock_metadata(old_disk, DISK_LOCK_SHARED);
+	disk_lock_metadata(new_disk, DISK_LOCK_SHARED);
+
+	boot_sector old_boot, new_boot;
+	boot_extra old_calc = initialize_boot(&old_boot, disk_metadata(old_disk));
+	boot_extra new_calc = initialize_boot(&new_boot, disk_metadata(new_disk));
+
+	check_FAT12(&old_boot);
+	check_FAT12(&new_boot);
+
+	// A delta is applied in place, so both images need to share a layout
+	if (old_size != new_size ||
+		old_calc.data_offset != new_calc.data_offset ||
+		old_calc.cluster_size != new_calc.cluster_size ||
+		old_calc.FAT1_offset != new_calc.FAT1_offset ||
+		old_calc.root_offset != new_calc.root_offset)
+	{
+		quit("Disk images have different geometry, a delta can't be generated.");
+	}
+
+	if (old_calc.data_offset > old_size || old_calc.cluster_size == 0 || old_boot.data.Bytes_Per_Sector.value == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	// Both images are read in full, and the changes read again to write them out
+	throttle limit;
+	throttle_init(&limit, options, "diskdelta", 2 * new_size);
+
+	// The metadata regions are small, compare them sector by sector on this thread
+	uint32_t sector_size = old_boot.data.Bytes_Per_Sector.value;
+	delta_job meta[DELTA_REGIONS];
+	memset(&meta, 0, sizeof(meta));
+
+	uint64_t bounds[DELTA_REGIONS][2] =
+	{
+		[DELTA_BOOT] = { 0,                      old_calc.FAT1_offset },
+		[DELTA_FAT]  = { old_calc.FAT1_offset,   old_calc.root_offset },
+		[DELTA_ROOT] = { old_calc.root_offset,   old_calc.data_offset },
+	};
+
+	for (int region = DELTA_BOOT; region < DELTA_REGIONS; ++region)
+	{
+		meta[region].old_disk = old_disk;
+		meta[region].new_disk = new_disk;
+		meta[region].start    = bounds[region][0];
+		meta[region].end      = bounds[region][1];
+		meta[region].unit     = sector_size;
+		meta[region].limit    = &limit;
+		compare_range(&meta[region]);
+	}
+
+	// Split the data region into cluster aligned ranges, one per worker
+	uint64_t data_clusters = (new_size - old_calc.data_offset + old_calc.cluster_size - 1) / old_calc.cluster_size;
+	uint64_t range_clusters = DELTA_MIN_RANGE / old_calc.cluster_size + 1;
+	int workers = default_workers();
+
+	if (data_clusters / workers > range_clusters)
+	{
+		range_clusters = (data_clusters + workers - 1) / workers;
+	}
+	workers = (data_clusters + range_clusters - 1) / range_clusters;
+	if (workers < 1) workers = 1;
+
+	delta_job* jobs = calloc(workers, sizeof(delta_job));
+	pthread_t* threads = calloc(workers, sizeof(pthread_t));
+
+	for (int w = 0; w < workers; ++w)
+	{
+		jobs[w].old_disk = old_disk;
+		jobs[w].new_disk = new_disk;
+		jobs[w].start    = old_calc.data_offset + w * range_clusters * old_calc.cluster_size;
+		jobs[w].end      = MIN(jobs[w].start + range_clusters * old_calc.cluster_size, new_size);
+		jobs[w].unit     = old_calc.cluster_size;
+		jobs[w].limit    = &limit;
+
+		if (pthread_create(&threads[w], NULL, compare_range, &jobs[w]) != 0)
+		{
+			quit("Failed to start a worker thread.");
+		}
+	}
+
+	// Gather the workers' extents into one list, joining across range boundaries
+	delta_job* data = &meta[DELTA_DATA];
+	data->old_disk = old_disk;
+	data->new_disk = new_disk;
+	data->limit    = &limit;
+
+	for (int w = 0; w < workers; ++w)
+	{
+		pthread_join(threads[w], NULL);
+
+		for (size_t i = 0; i < jobs[w].num_extents; ++i)
+		{
+			push_extent(data, jobs[w].extents[i].offset, jobs[w].extents[i].length);
+		}
+		free(jobs[w].extents);
+	}
+
+	free(threads);
+	free(jobs);
+
+	// Write the header, followed by every record in the order they should be applied
+	delta_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DELTA_MAGIC, LEN_Delta_Magic);
+	header.version      = DELTA_VERSION;
+	header.cluster_size = old_calc.cluster_size;
+	header.image_size   = new_size;
+	header.data_offset  = old_calc.data_offset;
+
+	uint64_t changed_bytes = 0;
+	for (int region = 0; region < DELTA_REGIONS; ++region)
+	{
+		header.num_records += meta[region].num_extents;
+		for (size_t i = 0; i < meta[region].num_extents; ++i)
+		{
+			changed_bytes += meta[region].extents[i].length;
+		}
+	}
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+	{
+		quit("Failed to write the delta to the output stream.");
+	}
+
+	byte* old_scratch = malloc(DELTA_MAX_EXTENT);
+	byte* new_scratch = malloc(DELTA_MAX_EXTENT);
+	if (old_scratch == NULL || new_scratch == NULL)
+	{
+		quit("Out of memory while writing the delta.");
+	}
+
+	for (int region = 0; region < DELTA_REGIONS; ++region)
+	{
+		write_region(out, region, &meta[region], old_scratch, new_scratch);
+		free(meta[region].extents);
+	}
+
+	free(old_scratch);
+	free(new_scratch);
+	throttle_finish(&limit);
+
+	disk_unlock_metadata(new_disk);
+	disk_unlock_metadata(old_disk);
+
+	if (fflush(out) != 0)
+	{
+		quit("Failed to write the delta to the output stream.");
+	}
+
+	fprintf(stderr, "Delta generated: %llu records, %llu changed bytes.\n",
+		(unsigned long long)header.num_records, (unsigned long long)changed_bytes);
+}
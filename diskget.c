@@ -1,124 +1,305 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdbool.h>
-
-#include "directory_sector.h"
-#include "FAT_entry.h"
-#include "boot_sector.h"
-
-#include "SFS.h"
-
-/* DISK GET
- * Retrieve a file from the root directory of the disk.
- * @param const byte* : disk - A pointer to a memory mapped array representing a FAT12 disk image
- * @param const char* : get_filename - A case-insensitive string of the filename to retrieve from the root directory of @param(disk)
- * @returns void - Status is printed to the console, or on failure terminates with EXIT_FAILURE.
- */ 
-void diskget(const byte* disk, const char* get_filename)
-{
-	bool success = false;
-	// Boot sector is a properly aligned and packed
-	// unionized structure representing the boot sector of
-	// a FAT12 disk image.
-	boot_sector boot;
-	boot_extra boot_calc = initialize_boot(&boot, disk);
-
-	// Assert that we're working with a FAT12 disk by
-	// looking for the FAT12 label in the File System field
-
-	// Start by copying and null-terminating the string
-	char FS_type[LEN_File_System_Type + 1];
-	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
-	FS_type[LEN_File_System_Type] = '\0';
-	
-	if (strstr(FS_type, "FAT12") == NULL)
-	{
-		// Didn't find it... 
-		quit("Disk doesn't list file system type as \"FAT12\"");
-	}
-	
-	// We'll duplicate the fat table for ease of use
-	FAT_entry* table = calloc(1, boot_calc.FAT_size * sizeof(FAT_entry));
-	
-	// We'll also only be using short filenames for this program
-	// so let's allocate some room for one
-	char filename[LEN_Filename + 1 + LEN_Extension + 1];
-	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
-	
-	// Load the fat table so we can jump around later
-	for (int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
-	}
-
-	// Scan the fat table
-	for (int FAT_idx = 2; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		// Try and interpret the contents of the root directory sector for this FAT
-		// entry if the entry is non-zero
-		if (table[FAT_idx].value != 0)
-		{
-		
-			// Just like for the boot data sector this type
-			// is a properly aligned and packed unionized structure
-			// for interpreting a sector's data
-			directory_entry sector;
-		
-			// Initialize the sector with the disk contents
-			for (int i = 0; i < sizeof(directory_entry); ++i)
-			{
-				sector.raw[i].value = disk[boot_calc.root_offset + (FAT_idx - 2) * sizeof(directory_entry) + i].value;
-			}
-
-			// Inspect the sector for files
-			if (sector.raw[0].value != 0x0 &&
-				sector.raw[0].value != 0xE5 &&
-				(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) == 0)
-			{
-				trim_filename(filename, sector.data.Filename, sector.data.Extension);
-
-				if (strcasecmp(filename, get_filename) == 0)
-				{
-					// Found our file, get something ready for writing
-					FILE* out = fopen(get_filename, "w+");
-					if (out != NULL)
-					{
-						// Allocate a block as a buffer for moving data across files
-						int sector_location;
-						
-						unsigned int file_size_remaining = sector.data.File_Size.value;
-						unsigned int bytes_to_copy; 
-
-						// Follow this FAT chain
-						int chain = sector.data.First_Logical_Cluster.value;
-						do 
-						{
-							if (file_size_remaining == 0) break;
-							sector_location = boot_calc.data_offset + (chain - 2) * boot.data.Bytes_Per_Sector.value;
-							bytes_to_copy = MIN(file_size_remaining, boot.data.Bytes_Per_Sector.value);
-							file_size_remaining -= file_size_remaining >= boot.data.Bytes_Per_Sector.value ? boot.data.Bytes_Per_Sector.value : file_size_remaining;
-							
-							// Write this block to the output stream
-							fwrite(&disk[sector_location], sizeof(byte), bytes_to_copy, out);
-						} while (chain = table[chain].value, chain != 0xFFF);
-						
-						// Done reading
-						fclose(out);
-		
-						// End the program
-						success = true;
-						break;
-					}
-					
-					quit("Failed to open or create a file in the active directory.");
-				}
-			}
-		}
-	}
-
-	// Done examining the FAT table, copied everything needed
-	free(table);
-
-	printf("%s\n", success ? "File retrieved." : "Failed to retrieve file");
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+
+#include "disk_io.h"
+#include "FAT_view.h"
+#include "sfs_index.h"
+#include "copy_pool.h"
+#include "sfs_file.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Largest run of contiguous clusters copied in one go
+#define GET_EXTENT_SIZE (1u << 20)
+
+/* DISK GET RANGE
+ * Copy part of a file from the root directory to standard output, reading only the clusters it spans.
+ * @param disk_io*    : io - An opened FAT12 disk image
+ * @param const char* : get_filename - A case-insensitive string of the filename to read from
+ * @param uint64_t    : offset - Where in the file to start
+ * @param uint64_t    : length - How many bytes to copy, stopping early at the end of the file
+ * @param const sfs_options* : options - Rate limits and progress reporting
+ * @returns void - Status is printed to stderr, or on failure terminates with EXIT_FAILURE.
+ */
+static void diskget_range(disk_io* io, const char* get_filename, uint64_t offset, uint64_t length, const sfs_options* options)
+{
+	sfs_file* file = sfs_open(io, get_filename);
+	if (file == NULL)
+	{
+		quit("Failed to retrieve file.");
+	}
+
+	byte* buffer = malloc(GET_EXTENT_SIZE);
+	if (buffer == NULL)
+	{
+		quit("Out of memory while retrieving the file.");
+	}
+
+	uint64_t end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+	bool success = true;
+
+	throttle limit;
+	throttle_init(&limit, options, "diskget", offset < file->size ? MIN(end, (uint64_t)file->size) - offset : 0);
+
+	while (offset < end)
+	{
+		size_t chunk = MIN((uint64_t)GET_EXTENT_SIZE, end - offset);
+		throttle_io(&limit, chunk);
+
+		TRACE_BEGIN(span);
+		ssize_t got = sfs_pread(file, buffer, chunk, offset);
+		if (got < 0)
+		{
+			success = false;
+			break;
+		}
+		if (got == 0)
+		{
+			break;
+		}
+
+		if (fwrite(buffer, sizeof(byte), got, stdout) != (size_t)got)
+		{
+			success = false;
+			break;
+		}
+		offset += got;
+		TRACE_END(span, "copy range", "bytes", got);
+	}
+
+	// A reader gone from the other end of a pipe shows up here, not as a short fwrite
+	fflush(stdout);
+	if (ferror(stdout))
+	{
+		success = false;
+	}
+
+	throttle_finish(&limit);
+	free(buffer);
+	sfs_close(file);
+
+	if (!success)
+	{
+		quit("Failed to retrieve file.");
+	}
+	fprintf(stderr, "File retrieved.\n");
+}
+
+/* DISK GET
+ * Retrieve a file from the root directory of the disk.
+ * @param disk_io*    : io - An opened FAT12 disk image
+ * @param const char* : get_filename - A case-insensitive string of the filename to retrieve from the root directory of @param(io)
+ * @param const sfs_options* : options - How far to read ahead, how many threads to copy with, rate limits,
+ *                              and optionally a range of the file to retrieve
+ * @returns void - Status is printed to the console, or on failure terminates with EXIT_FAILURE.
+ */ 
+void diskget(disk_io* io, const char* get_filename, const sfs_options* options)
+{
+	if (options->has_range)
+	{
+		diskget_range(io, get_filename, options->range_offset, options->range_length, options);
+		return;
+	}
+
+	uint64_t readahead = options->readahead;
+
+	bool success = false;
+	// Boot sector is a properly aligned and packed
+	// unionized structure representing the boot sector of
+	// a FAT12 disk image.
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk_metadata_range(io, 0, LEN_Boot_Sector_Required));
+
+	// Assert that we're working with a FAT12 disk by
+	// looking for the FAT12 label in the File System field
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+	
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it... 
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+	
+	// Only one chain is followed, so rather than decoding the whole FAT
+	// entries are read from the disk's metadata as the chain reaches them
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_CACHED);
+	
+	// We'll also only be using short filenames for this program
+	// so let's allocate some room for one
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
+	
+	// Hold off writers' commits while we look at the directory and FAT,
+	// the file's data is copied after letting go
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	bool locked = true;
+
+	// Scan the root directory, or with an index just the entry it names
+	uint64_t first_entry = 0;
+	uint64_t end_entry = boot_calc.data_offset - boot_calc.root_offset;
+	sfs_index* index = disk_index(io, &boot_calc);
+	if (index != NULL)
+	{
+		unsigned int slot;
+		first_entry = index_find(index, get_filename, true, &slot) ? (uint64_t)slot * sizeof(directory_entry) : end_entry;
+		end_entry = MIN(first_entry + sizeof(directory_entry), end_entry);
+	}
+
+	const byte* root = disk_metadata_range(io, boot_calc.root_offset, boot_calc.data_offset - boot_calc.root_offset);
+	for (uint64_t entry_offset = first_entry; entry_offset < end_entry; entry_offset += sizeof(directory_entry))
+	{
+		// Just like for the boot data sector this type
+		// is a properly aligned and packed unionized structure
+		// for interpreting a sector's data
+		directory_entry sector;
+	
+		// Initialize the sector with the disk contents
+		for (int i = 0; i < sizeof(directory_entry); ++i)
+		{
+			sector.raw[i].value = root[entry_offset + i].value;
+		}
+
+		// Inspect the sector for files
+		if (sector.raw[0].value != 0x0 &&
+			sector.raw[0].value != 0xE5 &&
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) == 0)
+		{
+			trim_filename(filename, sector.data.Filename, sector.data.Extension);
+
+			if (strcasecmp(filename, get_filename) == 0)
+			{
+				// Found our file, get something ready for writing
+				FILE* out = fopen(get_filename, "w+");
+				if (out != NULL)
+				{
+					// Allocate a buffer for moving data across files, used
+					// when the I/O backend can't hand out the image directly
+					byte* scratch = malloc(GET_EXTENT_SIZE);
+					if (scratch == NULL)
+					{
+						fclose(out);
+						quit("Out of memory while retrieving the file.");
+					}
+
+					// Follow this FAT chain, the reader hands out runs of clusters
+					// that follow each other on disk and prefetches the ones after.
+					// The chain is resolved up front, the FAT isn't needed after that.
+					throttle limit;
+					throttle_init(&limit, options, "diskget", sector.data.File_Size.value);
+
+					bool written = true;
+					chain_reader reader;
+					chain_reader_init(&reader, &fat, &boot_calc, sector.data.First_Logical_Cluster.value, sector.data.File_Size.value, throttle_window(&limit, readahead), scratch, GET_EXTENT_SIZE);
+					TRACE_BEGIN(resolve);
+					chain_reader_resolve(&reader);
+					TRACE_END(resolve, "resolve chain", "extents", reader.count);
+
+					disk_unlock_metadata(io);
+					locked = false;
+
+					// A chain that can't be followed to the end fails here, whichever way it would be copied
+					if (reader.error != NULL)
+					{
+						fprintf(stderr, "diskget: %s: %s\n", get_filename, reader.error);
+						fclose(out);
+						remove(get_filename);
+						quit("Failed to retrieve file.");
+					}
+
+					if (options->workers > 1 && sector.data.File_Size.value > COPY_BATCH_SIZE)
+					{
+						// With the whole chain known, split the file up and have a pool
+						// of workers copy it, each writing its pieces in place
+						copy_list pieces;
+						copy_list_init(&pieces);
+
+						uint64_t file_offset = 0;
+						for (size_t i = 0; i < reader.count; ++i)
+						{
+							disk_range range = reader.queue[(reader.head + i) % reader.capacity];
+							copy_list_push(&pieces, range.offset, file_offset, range.length);
+							file_offset += range.length;
+						}
+
+						if (ftruncate(fileno(out), file_offset) != 0)
+						{
+							quit("Failed to size the retrieved file.");
+						}
+						copy_extents(io, fileno(out), false, &pieces, options->workers, &limit);
+						copy_list_free(&pieces);
+					}
+					else
+					{
+						const byte* data;
+						size_t bytes_to_copy;
+						TRACE_BEGIN(span);
+						while (chain_read(&reader, &data, &bytes_to_copy))
+						{
+							// Write this extent to the output stream, then hold
+							// off the next read if we're over the limit
+							if (fwrite(data, sizeof(byte), bytes_to_copy, out) != bytes_to_copy)
+							{
+								written = false;
+								break;
+							}
+							TRACE_END(span, "copy extent", "bytes", bytes_to_copy);
+
+							throttle_io(&limit, bytes_to_copy);
+							TRACE_RESTART(span);
+						}
+					}
+
+					// A broken chain ends the reads early, what was copied is only part of the file
+					const char* error = reader.error;
+					chain_reader_free(&reader);
+					throttle_finish(&limit);
+					free(scratch);
+					
+					// Done reading
+					if (fclose(out) != 0)
+					{
+						written = false;
+					}
+
+					if (error != NULL || !written)
+					{
+						fprintf(stderr, "diskget: %s: %s\n", get_filename, error != NULL ? error : "failed to write the retrieved file");
+						remove(get_filename);
+						quit("Failed to retrieve file.");
+					}
+	
+					// End the program
+					success = true;
+					break;
+				}
+				
+				quit("Failed to open or create a file in the active directory.");
+			}
+		}
+	}
+
+	if (locked)
+	{
+		disk_unlock_metadata(io);
+	}
+
+	// Done following the chain, copied everything needed
+	FAT_view_free(&fat);
+
+	printf("%s\n", success ? "File retrieved." : "Failed to retrieve file");
+}
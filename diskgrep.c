@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "directory_sector.h"
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "trace.h"
+#include "FAT_view.h"
+
+#include "SFS.h"
+
+#define LEN_Short_Filename (LEN_Filename + 1 + LEN_Extension + 1)
+
+// Largest run of contiguous clusters searched in one go
+#define GREP_EXTENT_SIZE (1u << 20)
+
+// One file to search, and afterwards where the pattern turned up in it
+typedef struct
+{
+	char name[LEN_Short_Filename];
+	bool found;
+	unsigned int first_cluster;
+	unsigned int size;
+
+	uint64_t* matches;
+	size_t num_matches;
+	size_t cap_matches;
+	const char* error;
+} grep_job;
+
+// State shared by every worker, jobs are handed out through @next
+typedef struct
+{
+	const boot_extra* boot_calc;
+	FAT_view* fat;
+	uint64_t readahead;
+	throttle* limit;
+
+	const byte* pattern;
+	size_t pattern_length;
+
+	grep_job* jobs;
+	size_t num_jobs;
+	size_t next;
+} grep_pool;
+
+static void push_match(grep_job* job, uint64_t offset)
+{
+	if (job->num_matches == job->cap_matches)
+	{
+		job->cap_matches = job->cap_matches ? job->cap_matches * 2 : 16;
+		job->matches = realloc(job->matches, job->cap_matches * sizeof(uint64_t));
+		if (job->matches == NULL)
+		{
+			quit("Out of memory while searching.");
+		}
+	}
+
+	job->matches[job->num_matches++] = offset;
+}
+
+// Record every match starting in @text[@from, @starts), @base is the file offset of @text
+static void search(const grep_pool* pool, grep_job* job, const byte* text, size_t length, size_t from, size_t starts, uint64_t base)
+{
+	size_t position = from;
+	while (position < starts && length - position >= pool->pattern_length)
+	{
+		// glibc's memmem is a two-way search with a vectorised scan for the first byte
+		const byte* hit = memmem(&text[position], length - position, pool->pattern, pool->pattern_length);
+		if (hit == NULL || (size_t)(hit - text) >= starts)
+		{
+			break;
+		}
+
+		position = hit - text;
+		push_match(job, base + position);
+		position += 1;
+	}
+}
+
+/* GREP FILE
+ * Search one file's chain for the pattern. The chain reader hands out runs of contiguous
+ * clusters, and the last pattern_length - 1 bytes of each are carried over so matches
+ * spanning two runs are still found.
+ * @param const grep_pool* : pool - The pattern and the disk
+ * @param grep_job*        : job - The file, receives its matches
+ * @param byte*            : scratch - GREP_EXTENT_SIZE bytes for backends that don't map the image
+ * @param byte*            : carry - 2 * pattern_length bytes to stitch runs together in
+ */
+static void grep_file(const grep_pool* pool, grep_job* job, byte* scratch, byte* carry)
+{
+	size_t keep = pool->pattern_length - 1;
+	size_t carried = 0;
+	uint64_t offset = 0;
+
+	// Matches starting before this have already been reported or ruled out
+	uint64_t decided = 0;
+
+	chain_reader reader;
+	chain_reader_init(&reader, pool->fat, pool->boot_calc, job->first_cluster, job->size, pool->readahead, scratch, GREP_EXTENT_SIZE);
+
+	const byte* extent;
+	size_t length;
+	while (chain_read(&reader, &extent, &length))
+	{
+		// Matches that start in the carried tail and finish in this run
+		if (carried > 0)
+		{
+			size_t head = MIN(length, keep);
+			uint64_t base = offset - carried;
+			memcpy(&carry[carried], extent, head);
+			search(pool, job, carry, carried + head, decided > base ? decided - base : 0, carried, base);
+		}
+
+		// Matches wholly inside this run
+		search(pool, job, extent, length, 0, length, offset);
+		if (offset + length >= keep)
+		{
+			decided = offset + length - keep;
+		}
+
+		// Keep the stream's last few bytes for the next run, which may be
+		// shorter than the pattern when clusters are small
+		if (length >= keep)
+		{
+			memcpy(carry, &extent[length - keep], keep);
+			carried = keep;
+		}
+		else
+		{
+			size_t total = carried + length;
+			size_t drop = total > keep ? total - keep : 0;
+			memmove(carry, &carry[drop], carried - drop);
+			memcpy(&carry[carried - drop], extent, length);
+			carried = total - drop;
+		}
+
+		offset += length;
+		throttle_io(pool->limit, length);
+	}
+
+	job->error = reader.error;
+	chain_reader_free(&reader);
+}
+
+static void* grep_worker(void* arg)
+{
+	grep_pool* pool = arg;
+	size_t idx;
+
+	byte* scratch = malloc(GREP_EXTENT_SIZE);
+	byte* carry = malloc(2 * pool->pattern_length);
+	if (scratch == NULL || carry == NULL)
+	{
+		quit("Out of memory while searching.");
+	}
+
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_jobs)
+	{
+		if (pool->jobs[idx].found)
+		{
+			TRACE_BEGIN(span);
+			grep_file(pool, &pool->jobs[idx], scratch, carry);
+			TRACE_END(span, "grep file", "bytes", pool->jobs[idx].size);
+		}
+	}
+
+	free(carry);
+	free(scratch);
+	return NULL;
+}
+
+static void append_job(grep_job** jobs, size_t* num_jobs, size_t* cap_jobs, const char* name)
+{
+	if (*num_jobs == *cap_jobs)
+	{
+		*cap_jobs = *cap_jobs ? *cap_jobs * 2 : 16;
+		*jobs = realloc(*jobs, *cap_jobs * sizeof(grep_job));
+		if (*jobs == NULL)
+		{
+			quit("Out of memory while searching.");
+		}
+	}
+
+	grep_job* job = &(*jobs)[(*num_jobs)++];
+	memset(job, 0, sizeof(grep_job));
+	strncpy(job->name, name, LEN_Short_Filename - 1);
+}
+
+/* DISK GREP
+ * Search the contents of files in the root directory for a string, without extracting them.
+ * @param disk_io*           : io - An opened FAT12 disk image
+ * @param const char*        : pattern - The bytes to look for
+ * @param const char**       : names - Files to search, or NULL to search every file in the root directory
+ * @param int                : num_names - The number of entries in @param(names)
+ * @param const sfs_options* : options - Worker count, readahead and rate limits
+ * @returns int - EXIT_SUCCESS when the pattern was found, EXIT_FAILURE otherwise.
+ */
+int diskgrep(disk_io* io, const char* pattern, const char** names, int num_names, const sfs_options* options)
+{
+	// Hold off writers' commits while the FAT and directory are read, the
+	// files are searched after letting go
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	const byte* disk = disk_metadata(io);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it...
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+
+	if (boot_calc.data_offset > io->size)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	// Shared by the workers, so decode the whole table once up front
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_DECODED);
+
+	grep_job* jobs = NULL;
+	size_t num_jobs = 0;
+	size_t cap_jobs = 0;
+	bool list_all = num_names == 0;
+
+	for (int i = 0; i < num_names; ++i)
+	{
+		append_job(&jobs, &num_jobs, &cap_jobs, names[i]);
+	}
+
+	char filename[LEN_Short_Filename];
+	memset(&filename, '\0', LEN_Short_Filename);
+
+	for (uint64_t entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry sector;
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			sector.raw[j].value = disk[entry_offset + j].value;
+		}
+
+		// Only consider entries diskget would be able to retrieve
+		if (sector.raw[0].value == 0x0 ||
+			sector.raw[0].value == 0xE5 ||
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) != 0)
+		{
+			continue;
+		}
+
+		trim_filename(filename, sector.data.Filename, sector.data.Extension);
+
+		if (list_all)
+		{
+			append_job(&jobs, &num_jobs, &cap_jobs, filename);
+		}
+
+		for (size_t i = 0; i < num_jobs; ++i)
+		{
+			if (!jobs[i].found && strcasecmp(jobs[i].name, filename) == 0)
+			{
+				jobs[i].found = true;
+				jobs[i].first_cluster = sector.data.First_Logical_Cluster.value;
+				jobs[i].size = sector.data.File_Size.value;
+			}
+		}
+	}
+
+	disk_unlock_metadata(io);
+
+	// Every worker draws on the same limits
+	uint64_t total = 0;
+	for (size_t i = 0; i < num_jobs; ++i)
+	{
+		total += jobs[i].found ? jobs[i].size : 0;
+	}
+
+	throttle limit;
+	throttle_init(&limit, options, "diskgrep", total);
+
+	// Hand the files out to a pool of workers
+	grep_pool pool;
+	pool.boot_calc = &boot_calc;
+	pool.fat = &fat;
+	pool.readahead = throttle_window(&limit, options->readahead);
+	pool.limit = &limit;
+	pool.pattern = (const byte*)pattern;
+	pool.pattern_length = strlen(pattern);
+	pool.jobs = jobs;
+	pool.num_jobs = num_jobs;
+	pool.next = 0;
+
+	int workers = MIN((size_t)options->workers, num_jobs);
+	pthread_t* threads = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+
+	for (int w = 0; w < workers; ++w)
+	{
+		if (pthread_create(&threads[w], NULL, grep_worker, &pool) != 0)
+		{
+			quit("Failed to start a worker thread.");
+		}
+	}
+	for (int w = 0; w < workers; ++w)
+	{
+		pthread_join(threads[w], NULL);
+	}
+
+	free(threads);
+	FAT_view_free(&fat);
+	throttle_finish(&limit);
+
+	// Report in the order the files were requested, then by offset
+	size_t matches = 0;
+
+	for (size_t i = 0; i < num_jobs; ++i)
+	{
+		grep_job* job = &jobs[i];
+
+		if (!job->found || job->error != NULL)
+		{
+			fprintf(stderr, "diskgrep: %s: %s\n", job->name, job->found ? job->error : "No such file on the disk");
+		}
+
+		for (size_t m = 0; m < job->num_matches; ++m)
+		{
+			printf("%s:%" PRIu64 "\n", job->name, job->matches[m]);
+		}
+
+		matches += job->num_matches;
+		free(job->matches);
+	}
+
+	free(jobs);
+
+	return matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+#include "crc32c.h"
+#include "hash.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "trace.h"
+#include "FAT_view.h"
+
+#include "SFS.h"
+
+#define LEN_Short_Filename (LEN_Filename + 1 + LEN_Extension + 1)
+
+// Largest run of contiguous clusters checksummed in one go
+#define HASH_EXTENT_SIZE (1u << 20)
+
+// One file to checksum, and afterwards its result
+typedef struct
+{
+	char name[LEN_Short_Filename];
+	bool found;
+	unsigned int first_cluster;
+	unsigned int size;
+
+	bool has_expected;
+	uint64_t expected;
+
+	uint64_t digest;
+	const char* error;
+} hash_job;
+
+// State shared by every worker, jobs are handed out through @next
+typedef struct
+{
+	disk_io* disk;
+	const boot_extra* boot_calc;
+	FAT_view* fat;
+	uint64_t readahead;
+	throttle* limit;
+	HASH_ALGO algo;
+
+	hash_job* jobs;
+	size_t num_jobs;
+	size_t next;
+} hash_pool;
+
+static void hash_file(const hash_pool* pool, hash_job* job, byte* scratch)
+{
+	uint32_t crc = crc32c_init();
+	hash64_state state;
+	hash64_init(&state, 0);
+
+	// The reader coalesces physically contiguous clusters into one extent so
+	// the checksum runs over long stretches of memory
+	chain_reader reader;
+	chain_reader_init(&reader, pool->fat, pool->boot_calc, job->first_cluster, job->size, pool->readahead, scratch, HASH_EXTENT_SIZE);
+
+	const byte* extent;
+	size_t length;
+	while (chain_read(&reader, &extent, &length))
+	{
+		if (pool->algo == HASH_CRC32C)
+			crc = crc32c_update(crc, extent, length);
+		else
+			hash64_update(&state, extent, length);
+
+		throttle_io(pool->limit, length);
+	}
+
+	job->error = reader.error;
+	chain_reader_free(&reader);
+
+	job->digest = pool->algo == HASH_CRC32C ? crc32c_final(crc) : hash64_digest(&state);
+}
+
+static void* hash_worker(void* arg)
+{
+	hash_pool* pool = arg;
+	size_t idx;
+
+	byte* scratch = malloc(HASH_EXTENT_SIZE);
+	if (scratch == NULL)
+	{
+		quit("Out of memory while hashing.");
+	}
+
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_jobs)
+	{
+		if (pool->jobs[idx].found)
+		{
+			TRACE_BEGIN(span);
+			hash_file(pool, &pool->jobs[idx], scratch);
+			TRACE_END(span, "hash file", "bytes", pool->jobs[idx].size);
+		}
+	}
+
+	free(scratch);
+	return NULL;
+}
+
+static void append_job(hash_job** jobs, size_t* num_jobs, size_t* cap_jobs, const char* name)
+{
+	if (*num_jobs == *cap_jobs)
+	{
+		*cap_jobs = *cap_jobs ? *cap_jobs * 2 : 32;
+		*jobs = realloc(*jobs, *cap_jobs * sizeof(hash_job));
+		if (*jobs == NULL)
+		{
+			quit("Out of memory while collecting files to hash.");
+		}
+	}
+
+	hash_job* job = &(*jobs)[(*num_jobs)++];
+	memset(job, 0, sizeof(hash_job));
+	strncpy(job->name, name, LEN_Short_Filename - 1);
+}
+
+static hash_job* read_manifest(const char* path, size_t* num_jobs, HASH_ALGO* algo)
+{
+	FILE* manifest = fopen(path, "r");
+	if (manifest == NULL)
+	{
+		quit("Failed to open the manifest.");
+	}
+
+	hash_job* jobs = NULL;
+	size_t cap_jobs = 0;
+	size_t digits = 0;
+	char line[256];
+
+	*num_jobs = 0;
+	while (fgets(line, sizeof(line), manifest) != NULL)
+	{
+		// Lines look like "<hex digest>  <filename>", sha256sum marks
+		// binary mode with a '*' in front of the name
+		char* name = line + strspn(line, "0123456789abcdefABCDEF");
+		size_t length = name - line;
+		if (length == 0 || (*name != ' ' && *name != '\t'))
+		{
+			continue;
+		}
+
+		*name++ = '\0';
+		name += strspn(name, " \t*");
+		name[strcspn(name, "\r\n")] = '\0';
+
+		if (digits == 0)
+		{
+			digits = length;
+		}
+		if (length != digits || (length != 8 && length != 16) || *name == '\0')
+		{
+			fclose(manifest);
+			free(jobs);
+			quit("Manifest is not in the format produced by diskhash.");
+		}
+
+		append_job(&jobs, num_jobs, &cap_jobs, name);
+		jobs[*num_jobs - 1].has_expected = true;
+		jobs[*num_jobs - 1].expected = strtoull(line, NULL, 16);
+	}
+
+	fclose(manifest);
+
+	// The width of the digests tells us which algorithm produced them
+	*algo = digits == 16 ? HASH_64 : HASH_CRC32C;
+	return jobs;
+}
+
+/* DISK HASH
+ * Checksum files in the root directory by walking their cluster chains in place.
+ * @param disk_io*             : io - An opened FAT12 disk image
+ * @param const char**         : names - Files to checksum, every file in the root directory when empty
+ * @param int                  : num_names - The number of entries in @param(names)
+ * @param const sfs_options*   : options - Worker count, hash algorithm and optional manifest to verify against
+ * @returns int - EXIT_SUCCESS when every file was hashed (and matched the manifest), EXIT_FAILURE otherwise.
+ */
+int diskhash(disk_io* io, const char** names, int num_names, const sfs_options* options)
+{
+	// Hold off writers' commits while the FAT and directory are read. Both
+	// are copied out, so the files are hashed after letting go.
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	const byte* disk = disk_metadata(io);
+
+	// Boot sector is a properly aligned and packed
+	// unionized structure representing the boot sector of
+	// a FAT12 disk image.
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+
+	// Assert that we're working with a FAT12 disk by
+	// looking for the FAT12 label in the File System field
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it...
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+
+	if (boot_calc.data_offset > io->size)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	// Every file is going to be visited, so decode the whole table once up front.
+	// Once decoded it's only read, which lets the workers share it.
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_DECODED);
+
+	// Decide which files we're after, either from the manifest, the
+	// command line or everything in the root directory
+	hash_job* jobs = NULL;
+	size_t num_jobs = 0;
+	size_t cap_jobs = 0;
+	HASH_ALGO algo = options->hash_algo;
+	bool list_all = false;
+
+	if (options->verify_manifest != NULL)
+	{
+		jobs = read_manifest(options->verify_manifest, &num_jobs, &algo);
+	}
+	else if (num_names > 0)
+	{
+		for (int i = 0; i < num_names; ++i)
+		{
+			append_job(&jobs, &num_jobs, &cap_jobs, names[i]);
+		}
+	}
+	else list_all = true;
+
+	char filename[LEN_Short_Filename];
+	memset(&filename, '\0', LEN_Short_Filename);
+
+	for (uint64_t entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry sector;
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			sector.raw[j].value = disk[entry_offset + j].value;
+		}
+
+		// Only consider entries diskget would be able to retrieve
+		if (sector.raw[0].value == 0x0 ||
+			sector.raw[0].value == 0xE5 ||
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) != 0)
+		{
+			continue;
+		}
+
+		trim_filename(filename, sector.data.Filename, sector.data.Extension);
+
+		if (list_all)
+		{
+			append_job(&jobs, &num_jobs, &cap_jobs, filename);
+		}
+
+		for (size_t i = 0; i < num_jobs; ++i)
+		{
+			if (!jobs[i].found && strcasecmp(jobs[i].name, filename) == 0)
+			{
+				jobs[i].found = true;
+				jobs[i].first_cluster = sector.data.First_Logical_Cluster.value;
+				jobs[i].size = sector.data.File_Size.value;
+			}
+		}
+	}
+
+	disk_unlock_metadata(io);
+
+	// Hand the files out to a pool of workers
+	// Every worker draws on the same limits
+	uint64_t total = 0;
+	for (size_t i = 0; i < num_jobs; ++i)
+	{
+		total += jobs[i].found ? jobs[i].size : 0;
+	}
+
+	throttle limit;
+	throttle_init(&limit, options, "diskhash", total);
+
+	hash_pool pool;
+	pool.disk = io;
+	pool.boot_calc = &boot_calc;
+	pool.fat = &fat;
+	pool.readahead = throttle_window(&limit, options->readahead);
+	pool.limit = &limit;
+	pool.algo = algo;
+	pool.jobs = jobs;
+	pool.num_jobs = num_jobs;
+	pool.next = 0;
+
+	int workers = MIN((size_t)options->workers, num_jobs);
+	pthread_t* threads = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+
+	for (int w = 0; w < workers; ++w)
+	{
+		if (pthread_create(&threads[w], NULL, hash_worker, &pool) != 0)
+		{
+			quit("Failed to start a worker thread.");
+		}
+	}
+	for (int w = 0; w < workers; ++w)
+	{
+		pthread_join(threads[w], NULL);
+	}
+
+	free(threads);
+	FAT_view_free(&fat);
+	throttle_finish(&limit);
+
+	// Report in the order the files were requested
+	unsigned int failures = 0;
+	unsigned int mismatches = 0;
+
+	for (size_t i = 0; i < num_jobs; ++i)
+	{
+		hash_job* job = &jobs[i];
+
+		if (!job->found || job->error != NULL)
+		{
+			failures += 1;
+			fprintf(stderr, "diskhash: %s: %s\n", job->name, job->found ? job->error : "No such file on the disk");
+			if (job->has_expected)
+			{
+				printf("%s: FAILED open or read\n", job->name);
+			}
+		}
+		else if (job->has_expected)
+		{
+			bool match = job->digest == job->expected;
+			mismatches += match ? 0 : 1;
+			printf("%s: %s\n", job->name, match ? "OK" : "FAILED");
+		}
+		else if (algo == HASH_CRC32C)
+		{
+			printf("%08" PRIx64 "  %s\n", job->digest, job->name);
+		}
+		else
+		{
+			printf("%016" PRIx64 "  %s\n", job->digest, job->name);
+		}
+	}
+
+	free(jobs);
+
+	if (failures > 0 && options->verify_manifest != NULL)
+	{
+		fprintf(stderr, "diskhash: WARNING: %u listed file%s could not be read\n", failures, failures == 1 ? "" : "s");
+	}
+	if (mismatches > 0)
+	{
+		fprintf(stderr, "diskhash: WARNING: %u computed checksum%s did NOT match\n", mismatches, mismatches == 1 ? "" : "s");
+	}
+
+	return failures + mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
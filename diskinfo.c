@@ -1,126 +1,248 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "boot_sector.h"
-#include "FAT_entry.h"
-#include "directory_sector.h"
-
-#include "SFS.h"
-
-/* DISK INFO 
- * Scan over the boot and root directories and gather some common statistics about the disk.
- * @param const byte* : disk - A pointer to a memory mapped array representing a FAT12 disk image
- * @returns void - Collected information is printed to the console as this routine is completed.
- *               - Otherwise the program prints an error to the console and exits with EXIT_FAILURE.
- */ 
-void diskinfo(const byte* disk)
-{
-	// Boot sector is a properly aligned and packed
-	// unionized structure representing the boot sector of
-	// a FAT12 disk image.
-	boot_sector boot;
-	boot_extra boot_calc = initialize_boot(&boot, disk);
-	
-	// Assert that we're working with a FAT12 disk by
-	// looking for the FAT12 label in the File System field
-
-	// Start by copying and null-terminating the string
-	char FS_type[LEN_File_System_Type + 1];
-	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
-	FS_type[LEN_File_System_Type] = '\0';
-	
-	if (strstr(FS_type, "FAT12") == NULL)
-	{
-		// Didn't find it... 
-		quit("Disk doesn't list file system type as \"FAT12\"");
-	}
-	
-	// Reserve some space for the system label, as it could be
-	// stored in several places
-	char label[LEN_Volume_Label + 1];
-	memcpy(&label, boot.data.Volume_Label, LEN_Volume_Label);
-	label[LEN_Volume_Label] = '\0';
-
-	// We'll duplicate the fat table for ease of use
-	FAT_entry* table = calloc(1, boot_calc.FAT_size* sizeof(FAT_entry));
-	
-	// By scanning through the FAT table and root directory
-	// we'll collect the number of allocated FAT entries - to
-	// calculate the free size by difference from the total, as
-	// well as the number of files in the root directory.
-	unsigned int num_alloced = 0;
-	unsigned int num_files = 0;
-
-	// Scan through the fat table 
-	for (int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
-		
-		// Try and interpret the contents of the root directory sector for this FAT
-		// entry if the entry is non-zero
-		if (table[FAT_idx].value != 0)
-		{
-			// The FAT entry is non-zero, so the corresponding data region is allocated
-			num_alloced += 1;
-		
-			// Just like for the boot data sector this type
-			// is a properly aligned and packed unionized structure
-			// for interpreting a sector's data
-			directory_entry sector;
-		
-			// Initialize the sector with the disk contents
-			for (int i = 0; i < sizeof(directory_entry); ++i)
-			{
-				sector.raw[i].value = disk[boot_calc.root_offset + (FAT_idx - 2) * sizeof(directory_entry) + i].value;
-			}
-			
-			// Inspect the sector for files
-			if (sector.raw[0].value != 0x0 &&
-				sector.raw[0].value != 0xE5 &&
-				(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) == 0)
-			{
-				// This thing is a file
-				num_files += 1;
-			}
-			
-			// Check for volume labels in the root directory,
-			// so long as the boot sector didn't have one
-			if (sector.data.Attributes.value == VOL_LABEL)
-			{
-				// Found a volume label, we'll store in the boot sector's heap memory
-				for (int i = 0; i < LEN_Volume_Label; ++i)
-				{
-					label[i] = sector.data.Filename[i].value;
-				}
-			}
-		}
-	}
-
-	// Done examining the FAT table, copied everything needed
-	free(table);
-
-	// Calculate the remainder (free) space using the number of allocated entries 
-	// from the FAT table
-	const
-	unsigned int free_space = boot_calc.total_size
-							- num_alloced
-							* boot.data.Sectors_Per_Cluster.value
-							* boot.data.Bytes_Per_Sector.value; 
-
-	// Output the data here
-
-	// I could copy these to real char[]'s rather than byte[]'s but it works as is
-#pragma GCC diagnostic ignored "-Wformat"	
-	printf("OS Name : %." VALOF(LEN_OEM_name) "s\n", boot.data.OEM_name);
-#pragma GCC diagnostic warning "-Wformat"
-
-	printf("Label of the disk : %s\n", label);
-	printf("Total size of the disk : %d\n", boot_calc.total_size);
-	printf("Free size of the disk : %d\n", free_space);
-	printf("===  ===  ===  ===  ===\n");
-	printf("The number of files in the root directory(not including subdirectories) : %d\n", num_files);
-	printf("===  ===  ===  ===  ===\n");
-	printf("Number of FAT copies : %d\n", boot.data.FATs.value);
-	printf("Sectors per FAT : %d\n", boot.data.Sectors_Per_FAT.value);
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "boot_sector.h"
+#include "FAT_entry.h"
+#include "directory_sector.h"
+
+#include "disk_io.h"
+#include "FAT_view.h"
+#include "layout.h"
+#include "report.h"
+
+#include "SFS.h"
+
+/* INFO REPORT GATHER
+ * Collect what diskinfo reports about a disk from its metadata.
+ * @param info_report*       : report - Receives the report, release with info_report_free()
+ * @param const byte*        : disk - The disk's metadata, indexed by absolute image offset
+ * @param const boot_sector* : boot - The disk's boot sector
+ * @param const boot_extra*  : boot_calc - Geometry of the disk
+ * @param FAT_view*          : fat - A decoded view of the FAT
+ * @param bool               : layout - Also map free space and every file's extents
+ */
+void info_report_gather(info_report* report, const byte* disk, const boot_sector* boot, const boot_extra* boot_calc, FAT_view* fat, bool layout)
+{
+	report->boot = *boot;
+	report->boot_calc = *boot_calc;
+
+	// Reserve some space for the system label, as it could be
+	// stored in several places
+	memcpy(&report->label, boot->data.Volume_Label, LEN_Volume_Label);
+	report->label[LEN_Volume_Label] = '\0';
+
+	// By scanning through the FAT table and root directory
+	// we'll collect the number of allocated FAT entries - to
+	// calculate the free size by difference from the total, as
+	// well as the number of files in the root directory.
+	unsigned int num_alloced = 0;
+	unsigned int num_files = 0;
+
+	// Scan through the fat table 
+	for (unsigned int FAT_idx = 0; FAT_idx < boot_calc->FAT_size; ++FAT_idx)
+	{
+		unsigned int entry = FAT_next(fat, FAT_idx);
+
+		if (entry != 0)
+		{
+			// The FAT entry is non-zero, so the corresponding data region is allocated
+			num_alloced += 1;
+		}
+
+		// Try and interpret the contents of the root directory sector for this FAT
+		// entry if the entry is non-zero, and the root directory has an entry for it
+		if (entry != 0 && FAT_idx >= 2 &&
+			boot_calc->root_offset + (FAT_idx - 2) * sizeof(directory_entry) < boot_calc->data_offset)
+		{
+			// Just like for the boot data sector this type
+			// is a properly aligned and packed unionized structure
+			// for interpreting a sector's data
+			directory_entry sector;
+		
+			// Initialize the sector with the disk contents
+			for (int i = 0; i < sizeof(directory_entry); ++i)
+			{
+				sector.raw[i].value = disk[boot_calc->root_offset + (FAT_idx - 2) * sizeof(directory_entry) + i].value;
+			}
+			
+			// Inspect the sector for files
+			if (sector.raw[0].value != 0x0 &&
+				sector.raw[0].value != 0xE5 &&
+				(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) == 0)
+			{
+				// This thing is a file
+				num_files += 1;
+			}
+			
+			// Check for volume labels in the root directory,
+			// so long as the boot sector didn't have one
+			if (sector.data.Attributes.value == VOL_LABEL)
+			{
+				// Found a volume label, we'll store in the boot sector's heap memory
+				for (int i = 0; i < LEN_Volume_Label; ++i)
+				{
+					report->label[i] = sector.data.Filename[i].value;
+				}
+			}
+		}
+	}
+
+	report->num_files = num_files;
+
+	// Calculate the remainder (free) space using the number of allocated entries 
+	// from the FAT table
+	report->free_space = boot_calc->total_size
+					   - (uint64_t)num_alloced
+					   * boot->data.Sectors_Per_Cluster.value
+					   * boot->data.Bytes_Per_Sector.value;
+
+	report->has_layout = layout;
+	if (layout)
+	{
+		layout_scan(&report->layout, fat, boot_calc, disk);
+	}
+}
+
+void info_report_free(info_report* report)
+{
+	if (report->has_layout)
+	{
+		layout_free(&report->layout);
+		report->has_layout = false;
+	}
+}
+
+/* INFO REPORT PRINT
+ * Print what diskinfo gathered, as text or as the fields of a JSON object.
+ * @param FILE*              : out - Where the report goes
+ * @param const info_report* : report - The gathered report
+ * @param bool               : json - Print the object's fields, without its braces, so callers can add their own
+ */
+void info_report_print(FILE* out, const info_report* report, bool json)
+{
+	const boot_sector* boot = &report->boot;
+	const boot_extra* boot_calc = &report->boot_calc;
+	const disk_layout* layout = &report->layout;
+
+	char OEM_name[LEN_OEM_name + 1];
+	memcpy(OEM_name, boot->data.OEM_name, LEN_OEM_name);
+	OEM_name[LEN_OEM_name] = '\0';
+
+	if (json)
+	{
+		// With the layout, files are counted from the full map of the root directory
+		fprintf(out, "\"os_name\":");
+		layout_json_fstring(out, OEM_name);
+		fprintf(out, ",\"label\":");
+		layout_json_fstring(out, report->label);
+		fprintf(out, ",\"total_size\":%" PRIu64 ",\"free_size\":%" PRIu64 ",\"files\":%u", boot_calc->total_size, report->free_space,
+				report->has_layout ? layout->num_files : report->num_files);
+		fprintf(out, ",\"fat_copies\":%u,\"sectors_per_fat\":%u", boot->data.FATs.value, boot->data.Sectors_Per_FAT.value);
+
+		if (!report->has_layout)
+		{
+			return;
+		}
+
+		fprintf(out, ",\"cluster_size\":%u,\"clusters\":%u", layout->cluster_size, layout->num_clusters >= 2 ? layout->num_clusters - 2 : 0);
+		fprintf(out, ",\"free_clusters\":%u,\"free_extents\":%u,\"largest_free_run\":%u", layout->free_clusters, layout->free_extents, layout->largest_free);
+		fprintf(out, ",\"average_extents_per_file\":%.4f", layout_average_extents(layout));
+		fprintf(out, ",\"free_histogram\":[");
+		for (int bin = 0; bin < LAYOUT_HISTOGRAM_BINS; ++bin)
+		{
+			fprintf(out, "%s{\"min\":%u,\"max\":%u,\"count\":%u}", bin ? "," : "", 1u << bin, (2u << bin) - 1, layout->free_histogram[bin]);
+		}
+		fprintf(out, "]");
+		return;
+	}
+
+	// Output the data here
+	fprintf(out, "OS Name : %s\n", OEM_name);
+	fprintf(out, "Label of the disk : %s\n", report->label);
+	fprintf(out, "Total size of the disk : %" PRIu64 "\n", boot_calc->total_size);
+	fprintf(out, "Free size of the disk : %" PRIu64 "\n", report->free_space);
+	fprintf(out, "===  ===  ===  ===  ===\n");
+	fprintf(out, "The number of files in the root directory(not including subdirectories) : %d\n", report->num_files);
+	fprintf(out, "===  ===  ===  ===  ===\n");
+	fprintf(out, "Number of FAT copies : %d\n", boot->data.FATs.value);
+	fprintf(out, "Sectors per FAT : %d\n", boot->data.Sectors_Per_FAT.value);
+
+	if (report->has_layout)
+	{
+		fprintf(out, "===  ===  ===  ===  ===\n");
+		fprintf(out, "Free extents : %u\n", layout->free_extents);
+		fprintf(out, "Largest free run : %u clusters (%llu bytes)\n", layout->largest_free, (unsigned long long)layout->largest_free * layout->cluster_size);
+		fprintf(out, "Average extents per file : %.2f\n", layout_average_extents(layout));
+		fprintf(out, "Free extents by length in clusters :\n");
+		for (int bin = 0; bin < LAYOUT_HISTOGRAM_BINS; ++bin)
+		{
+			unsigned int low = 1u << bin;
+			if (low > layout->largest_free)
+			{
+				break;
+			}
+			fprintf(out, "  %5u - %-5u : %u\n", low, (low << 1) - 1, layout->free_histogram[bin]);
+		}
+	}
+}
+
+/* DISK INFO 
+ * Scan over the boot and root directories and gather some common statistics about the disk.
+ * @param disk_io*           : io - An opened FAT12 disk image
+ * @param const sfs_options* : options - Whether to add the layout report, and whether to print JSON
+ * @returns void - Collected information is printed to the console as this routine is completed.
+ *               - Otherwise the program prints an error to the console and exits with EXIT_FAILURE.
+ */ 
+void diskinfo(disk_io* io, const sfs_options* options)
+{
+	// Hold off writers' commits while we look at the metadata
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	const byte* disk = disk_metadata(io);
+
+	// Boot sector is a properly aligned and packed
+	// unionized structure representing the boot sector of
+	// a FAT12 disk image.
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+	
+	// Assert that we're working with a FAT12 disk by
+	// looking for the FAT12 label in the File System field
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+	
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it... 
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+
+	// We'll decode the fat table once, the layout report works from the same copy
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_DECODED);
+
+	info_report report;
+	info_report_gather(&report, disk, &boot, &boot_calc, &fat, options->layout);
+
+	// Done examining the FAT table, copied everything needed
+	FAT_view_free(&fat);
+	disk_unlock_metadata(io);
+
+	if (options->json)
+	{
+		printf("{");
+		info_report_print(stdout, &report, true);
+		printf("}\n");
+	}
+	else
+	{
+		info_report_print(stdout, &report, false);
+	}
+
+	info_report_free(&report);
+}
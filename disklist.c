@@ -1,84 +1,218 @@
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-#include "directory_sector.h"
-#include "FAT_entry.h"
-#include "boot_sector.h"
-
-#include "SFS.h"
-
-/* DISK LIST
- * List the contents of the root directory of the disk.
- * @param const byte* : disk - A pointer to a memory mapped array representing a FAT12 disk image
- * @returns void - The list of files is printed to the console.
- *               - Otherwise the program terminates with EXIT_FAILURE.
- */ 
-void disklist(const byte* disk)
-{
-	// Boot sector is a properly aligned and packed
-	// unionized structure representing the boot sector of
-	// a FAT12 disk image.
-	boot_sector boot;
-	boot_extra boot_calc = initialize_boot(&boot, disk);
-
-	// Assert that we're working with a FAT12 disk by
-	// looking for the FAT12 label in the File System field
-
-	// Start by copying and null-terminating the string
-	char FS_type[LEN_File_System_Type + 1];
-	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
-	FS_type[LEN_File_System_Type] = '\0';
-	
-	if (strstr(FS_type, "FAT12") == NULL)
-	{
-		// Didn't find it... 
-		quit("Disk doesn't list file system type as \"FAT12\"");
-	}
-	
-	// We'll duplicate the fat table for ease of use
-	FAT_entry* table = calloc(1, boot_calc.FAT_size * sizeof(FAT_entry));
-	
-	// We'll also only be using short filenames for this program
-	// so let's allocate some room for one
-	char filename[LEN_Filename + 1 + LEN_Extension + 1];
-	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
-	
-	// Scan through the fat table 
-	for (int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
-		
-		// Try and interpret the contents of the root directory sector for this FAT
-		// entry if the entry is non-zero
-		if (table[FAT_idx].value != 0)
-		{
-			// Just like for the boot data sector this type
-			// is a properly aligned and packed unionized structure
-			// for interpreting a sector's data
-			directory_entry sector;
-		
-			// Initialize the sector with the disk contents
-			for (int j = 0; j < sizeof(directory_entry); ++j)
-			{
-				sector.raw[j].value = disk[boot_calc.root_offset + (FAT_idx - 2) * sizeof(directory_entry) + j].value;
-			}
-			
-			// Inspect the sector for files
-			if (sector.raw[0].value != 0x0 &&
-				sector.raw[0].value != 0xE5 &&
-				(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0)
-			{
-				trim_filename(filename, sector.data.Filename, sector.data.Extension);
-
-				printf("%s ", filename);	
-				printf("%d/%d/%d ", DATE(sector.data.Creation_Date.value));
-				printf("%02d:%02d\n", TIME(sector.data.Creation_Time.value));
-			}
-
-		}
-	}
-
-	// Done examining the FAT table, copied everything needed
-	free(table);
-}
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+
+#include "disk_io.h"
+#include "trace.h"
+#include "FAT_view.h"
+#include "layout.h"
+#include "report.h"
+
+#include "SFS.h"
+
+/* LIST REPORT FILES
+ * List the files in the root directory with their creation times, as disklist shows them.
+ * @param FILE*             : out - Where the list goes
+ * @param const byte*       : disk - The disk's metadata, indexed by absolute image offset
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @param FAT_view*         : fat - A view of the FAT
+ * @param bool              : json - Print a "files" field, without the braces around it, so callers can add their own
+ */
+void list_report_files(FILE* out, const byte* disk, const boot_extra* boot_calc, FAT_view* fat, bool json)
+{
+	// We'll also only be using short filenames for this program
+	// so let's allocate some room for one
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
+	bool first = true;
+
+	if (json)
+	{
+		fprintf(out, "\"files\":[");
+	}
+
+	// Scan through the fat table 
+	TRACE_BEGIN(load);
+	for (unsigned int FAT_idx = 0; FAT_idx < boot_calc->FAT_size; ++FAT_idx)
+	{
+		// Try and interpret the contents of the root directory sector for this FAT
+		// entry if the entry is non-zero, and the root directory has an entry for it
+		if (FAT_next(fat, FAT_idx) != 0 && FAT_idx >= 2 &&
+			boot_calc->root_offset + (FAT_idx - 2) * sizeof(directory_entry) < boot_calc->data_offset)
+		{
+			// Just like for the boot data sector this type
+			// is a properly aligned and packed unionized structure
+			// for interpreting a sector's data
+			directory_entry sector;
+		
+			// Initialize the sector with the disk contents
+			for (int j = 0; j < sizeof(directory_entry); ++j)
+			{
+				sector.raw[j].value = disk[boot_calc->root_offset + (FAT_idx - 2) * sizeof(directory_entry) + j].value;
+			}
+			
+			// Inspect the sector for files
+			if (sector.raw[0].value != 0x0 &&
+				sector.raw[0].value != 0xE5 &&
+				(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0)
+			{
+				trim_filename(filename, sector.data.Filename, sector.data.Extension);
+
+				if (json)
+				{
+					fprintf(out, "%s{\"name\":", first ? "" : ",");
+					layout_json_fstring(out, filename);
+
+					unsigned short date = sector.data.Creation_Date.value;
+					unsigned short time = sector.data.Creation_Time.value;
+					// Seconds are stored halved
+					fprintf(out, ",\"size\":%u,\"created\":\"%04d-%02d-%02dT%02d:%02d:%02d\"}", sector.data.File_Size.value,
+							((date & DATE_YEAR_MASK) >> DATE_YEAR_OFFSET) + DATE_YEAR_BASE,
+							(date & DATE_MONTH_MASK) >> DATE_MONTH_OFFSET,
+							(date & DATE_DAY_MASK) >> DATE_DAY_OFFSET,
+							(time & TIME_HOUR_MASK) >> TIME_HOUR_OFFSET,
+							(time & TIME_MINUTE_MASK) >> TIME_MINUTE_OFFSET,
+							((time & TIME_SECOND_MASK) >> TIME_SECOND_OFFSET) * 2);
+					first = false;
+					continue;
+				}
+
+				fprintf(out, "%s ", filename);	
+				fprintf(out, "%d/%d/%d ", DATE(sector.data.Creation_Date.value));
+				fprintf(out, "%02d:%02d\n", TIME(sector.data.Creation_Time.value));
+			}
+
+		}
+	}
+	TRACE_END(load, "load FAT", "entries", boot_calc->FAT_size);
+
+	if (json)
+	{
+		fprintf(out, "]");
+	}
+}
+
+/* LIST REPORT LAYOUT
+ * Show where every file's clusters lie, and how fragmented it is.
+ * @param FILE*              : out - Where the report goes
+ * @param const disk_layout* : layout - The mapped layout of the disk
+ * @param bool               : json - Print the object's fields, without its braces, so callers can add their own
+ */
+void list_report_layout(FILE* out, const disk_layout* layout, bool json)
+{
+	if (json)
+	{
+		fprintf(out, "\"cluster_size\":%u,\"files\":[", layout->cluster_size);
+	}
+
+	for (unsigned int i = 0; i < layout->num_files; ++i)
+	{
+		const file_layout* file = &layout->files[i];
+
+		if (json)
+		{
+			fprintf(out, "%s{\"name\":", i ? "," : "");
+			layout_json_fstring(out, file->name);
+			fprintf(out, ",\"size\":%u,\"clusters\":%u,\"fragmentation\":%.4f,\"damaged\":%s,\"extents\":[",
+				file->size, file->clusters, layout_fragmentation(file), file->damaged ? "true" : "false");
+			for (unsigned int e = 0; e < file->num_extents; ++e)
+			{
+				fprintf(out, "%s[%u,%u]", e ? "," : "", file->extents[e].cluster, file->extents[e].count);
+			}
+			fprintf(out, "]}");
+			continue;
+		}
+
+		fprintf(out, "%s %u bytes, %u clusters, %u extents, fragmentation %.4f%s\n", file->name, file->size,
+			file->clusters, file->num_extents, layout_fragmentation(file), file->damaged ? " (damaged chain)" : "");
+
+		// Extents as inclusive cluster ranges
+		fprintf(out, "   ");
+		for (unsigned int e = 0; e < file->num_extents; ++e)
+		{
+			const cluster_extent* extent = &file->extents[e];
+			if (extent->count == 1)
+				fprintf(out, " %u", extent->cluster);
+			else
+				fprintf(out, " %u-%u", extent->cluster, extent->cluster + extent->count - 1);
+		}
+		fprintf(out, "\n");
+	}
+
+	if (json)
+	{
+		fprintf(out, "]");
+	}
+}
+
+/* DISK LIST
+ * List the contents of the root directory of the disk.
+ * @param disk_io*           : io - An opened FAT12 disk image
+ * @param const sfs_options* : options - Whether to list each file's layout instead, and whether to print JSON
+ * @returns void - The list of files is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */ 
+void disklist(disk_io* io, const sfs_options* options)
+{
+	// Hold off writers' commits while we look at the metadata
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	const byte* disk = disk_metadata(io);
+
+	// Boot sector is a properly aligned and packed
+	// unionized structure representing the boot sector of
+	// a FAT12 disk image.
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+
+	// Assert that we're working with a FAT12 disk by
+	// looking for the FAT12 label in the File System field
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+	
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it... 
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+
+	// Decoded once, from the index when there is one
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_DECODED);
+
+	if (options->layout)
+	{
+		// Map every file's chain from a single decode of the table
+		disk_layout layout;
+		layout_scan(&layout, &fat, &boot_calc, disk);
+
+		FAT_view_free(&fat);
+		disk_unlock_metadata(io);
+
+		if (options->json)
+		{
+			printf("{");
+			list_report_layout(stdout, &layout, true);
+			printf("}\n");
+		}
+		else
+		{
+			list_report_layout(stdout, &layout, false);
+		}
+		layout_free(&layout);
+		return;
+	}
+
+	list_report_files(stdout, disk, &boot_calc, &fat, false);
+
+	// Done examining the FAT table, copied everything needed
+	FAT_view_free(&fat);
+	disk_unlock_metadata(io);
+}
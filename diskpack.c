@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "disk_io.h"
+#include "pack.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Largest piece of the image written out in one go when unpacking
+#define UNPACK_EXTENT_SIZE (1u << 20)
+
+static bool all_zero(const byte* data, size_t length)
+{
+	// Every byte matches the one before it, and the first is zero
+	return length == 0 || (data[0].value == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+/* OPEN OUTPUT
+ * Create the file a converter writes to, refusing to write over the image being read.
+ * @param disk_io*    : disk - The image being converted
+ * @param const char* : path - Location of the new file
+ * @returns int - Descriptor of the emptied file, on failure terminates with EXIT_FAILURE.
+ */
+static int open_output(disk_io* disk, const char* path)
+{
+	struct stat disk_stat;
+	struct stat out_stat;
+	if (fstat(disk->fd, &disk_stat) == 0 && stat(path, &out_stat) == 0 &&
+		disk_stat.st_dev == out_stat.st_dev && disk_stat.st_ino == out_stat.st_ino)
+	{
+		quit("The converted image can't replace the one it's made from.");
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+	return fd;
+}
+
+static void sync_output(int fd)
+{
+	if (fsync(fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+/* DISK PACK
+ * Write an image out as a packed image, a chunk at a time. Empty chunks take no room,
+ * the rest are compressed or, when that doesn't make them smaller, stored as they are.
+ * @param disk_io*           : disk - The image to pack, raw or already packed
+ * @param const char*        : out_path - Where to write the packed image
+ * @param const sfs_options* : options - Chunk size and limits on the rate the image is read at
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */
+void diskpack(disk_io* disk, const char* out_path, const sfs_options* options)
+{
+	uint32_t chunk_size = options->chunk_size;
+	uint64_t num_chunks = (disk->size + chunk_size - 1) / chunk_size;
+
+	int fd = open_output(disk, out_path);
+
+	pack_chunk* index = calloc(num_chunks ? num_chunks : 1, sizeof(pack_chunk));
+	byte* scratch = malloc(chunk_size);
+	byte* packed = malloc(chunk_size);
+	if (index == NULL || scratch == NULL || packed == NULL)
+	{
+		quit("Out of memory while packing the disk.");
+	}
+
+	// The header is left blank until the end, a pack cut short is never taken for a whole one
+	pack_header header;
+	memset(&header, 0, sizeof(pack_header));
+	pwrite_all(fd, &header, sizeof(pack_header), 0);
+
+	throttle limit;
+	throttle_init(&limit, options, "diskpack", disk->size);
+
+	// Hold off writers' commits, so the pack holds one consistent state of the image
+	disk_lock_metadata(disk, DISK_LOCK_SHARED);
+
+	uint64_t offset = sizeof(pack_header);
+	uint64_t empty = 0;
+
+	for (uint64_t chunk = 0; chunk < num_chunks; ++chunk)
+	{
+		size_t length = MIN((uint64_t)chunk_size, disk->size - chunk * chunk_size);
+		const byte* data = disk_view(disk, chunk * chunk_size, length, scratch);
+		pack_chunk* entry = &index[chunk];
+
+		throttle_io(&limit, length);
+		TRACE_BEGIN(span);
+
+		if (all_zero(data, length))
+		{
+			entry->encoding = PACK_ZERO;
+			empty += 1;
+			TRACE_END(span, "pack chunk", "bytes", 0);
+			continue;
+		}
+
+		entry->crc = crc32c_final(crc32c_update(crc32c_init(), data, length));
+		entry->offset = offset;
+
+		// Only kept when it's smaller than the chunk itself
+		size_t compressed = lz_compress(data, length, packed, length - 1);
+		if (compressed > 0)
+		{
+			entry->encoding = PACK_LZ;
+			entry->length = compressed;
+			pwrite_all(fd, packed, compressed, offset);
+		}
+		else
+		{
+			entry->encoding = PACK_RAW;
+			entry->length = length;
+			pwrite_all(fd, data, length, offset);
+		}
+		offset += entry->length;
+
+		TRACE_END(span, "pack chunk", "bytes", entry->length);
+	}
+
+	disk_unlock_metadata(disk);
+	throttle_finish(&limit);
+
+	header.version = PACK_VERSION;
+	header.chunk_size = chunk_size;
+	header.image_size = disk->size;
+	header.num_chunks = num_chunks;
+	header.index_offset = offset;
+	pwrite_all(fd, index, num_chunks * sizeof(pack_chunk), offset);
+	sync_output(fd);
+
+	memcpy(header.magic, PACK_MAGIC, LEN_Pack_Magic);
+	pwrite_all(fd, &header, sizeof(pack_header), 0);
+	sync_output(fd);
+	close(fd);
+
+	uint64_t packed_size = offset + num_chunks * sizeof(pack_chunk);
+	printf("Packed %llu bytes into %llu (%.1f%%), %llu of %llu chunks empty.\n",
+		   (unsigned long long)disk->size, (unsigned long long)packed_size,
+		   disk->size ? 100.0 * packed_size / disk->size : 0.0,
+		   (unsigned long long)empty, (unsigned long long)num_chunks);
+
+	free(packed);
+	free(scratch);
+	free(index);
+}
+
+/* DISK UNPACK
+ * Write a packed image back out as a raw image. Empty stretches aren't written,
+ * so they're left as holes in the new file.
+ * @param disk_io*           : disk - The packed image, or a raw one to copy
+ * @param const char*        : out_path - Where to write the raw image
+ * @param const sfs_options* : options - Limits on the rate the image is written at
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */
+void diskunpack(disk_io* disk, const char* out_path, const sfs_options* options)
+{
+	int fd = open_output(disk, out_path);
+	if (ftruncate(fd, disk->size) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	byte* scratch = malloc(UNPACK_EXTENT_SIZE);
+	if (scratch == NULL)
+	{
+		quit("Out of memory while unpacking the disk.");
+	}
+
+	throttle limit;
+	throttle_init(&limit, options, "diskunpack", disk->size);
+
+	disk_lock_metadata(disk, DISK_LOCK_SHARED);
+
+	uint64_t written = 0;
+	for (uint64_t offset = 0; offset < disk->size; offset += UNPACK_EXTENT_SIZE)
+	{
+		size_t length = MIN((uint64_t)UNPACK_EXTENT_SIZE, disk->size - offset);
+		const byte* data = disk_view(disk, offset, length, scratch);
+
+		throttle_io(&limit, length);
+		if (!all_zero(data, length))
+		{
+			pwrite_all(fd, data, length, offset);
+			written += length;
+		}
+	}
+
+	disk_unlock_metadata(disk);
+	throttle_finish(&limit);
+
+	sync_output(fd);
+	close(fd);
+	free(scratch);
+
+	printf("Unpacked %llu bytes, %llu of them written.\n", (unsigned long long)disk->size, (unsigned long long)written);
+}
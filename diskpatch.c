@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "boot_sector.h"
+#include "delta.h"
+#include "hash.h"
+#include "disk_io.h"
+#include "throttle.h"
+
+#include "SFS.h"
+
+static byte* read_stream(FILE* in, size_t* length)
+{
+	size_t cap = 1u << 16;
+	size_t len = 0;
+	byte* buffer = malloc(cap);
+
+	while (buffer != NULL)
+	{
+		len += fread(&buffer[len], 1, cap - len, in);
+		if (len < cap)
+		{
+			break;
+		}
+
+		cap *= 2;
+		byte* grown = realloc(buffer, cap);
+		if (grown == NULL)
+		{
+			free(buffer);
+		}
+		buffer = grown;
+	}
+
+	if (buffer == NULL)
+	{
+		quit("Out of memory while reading the delta.");
+	}
+	if (ferror(in))
+	{
+		free(buffer);
+		quit("Failed to read the delta from the input stream.");
+	}
+
+	*length = len;
+	return buffer;
+}
+
+/* DISK PATCH
+ * Apply a delta produced by diskdelta to the disk in place. Every record is validated before
+ * any byte of the disk is touched. Data is written first, then the boot sector and root
+ * directory, and the FAT tables are committed last.
+ * @param disk_io* : disk - An opened FAT12 disk image
+ * @param FILE*    : in - Stream containing the binary delta
+ * @param const sfs_options* : options - Limits on the rate the disk is read and written at
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */
+void diskpatch(disk_io* disk, FILE* in, const sfs_options* options)
+{
+	uint64_t disk_size = disk->size;
+
+	// Keep other writers out from validation through to the last record
+	disk_lock_writer(disk);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk_metadata(disk));
+
+	size_t delta_size;
+	byte* delta = read_stream(in, &delta_size);
+
+	if (delta_size < sizeof(delta_header))
+	{
+		free(delta);
+		quit("Delta is truncated.");
+	}
+
+	delta_header header;
+	memcpy(&header, delta, sizeof(header));
+
+	if (memcmp(header.magic, DELTA_MAGIC, LEN_Delta_Magic) != 0 || header.version != DELTA_VERSION)
+	{
+		free(delta);
+		quit("Input is not a disk delta, or was made by an incompatible version.");
+	}
+
+	if (header.image_size != disk_size ||
+		header.cluster_size != boot_calc.cluster_size ||
+		header.data_offset != boot_calc.data_offset)
+	{
+		free(delta);
+		quit("Delta was generated for a disk with different geometry.");
+	}
+
+	// Records are read back to validate them, then written
+	throttle limit;
+	throttle_init(&limit, options, "diskpatch", 2 * (delta_size - sizeof(header)));
+
+	// Every record takes up at least its own header, so a count beyond what the
+	// delta could hold is a corrupt header rather than a reason to allocate for it
+	if (header.num_records > (delta_size - sizeof(header)) / sizeof(delta_record))
+	{
+		free(delta);
+		quit("Delta is truncated.");
+	}
+
+	// Validate every record before anything is written, collecting where each one starts
+	size_t* positions = calloc(header.num_records ? header.num_records : 1, sizeof(size_t));
+	if (positions == NULL)
+	{
+		free(delta);
+		quit("Out of memory while checking the delta.");
+	}
+	size_t position = sizeof(header);
+	unsigned int already_applied = 0;
+
+	// Room to read back the current contents of the largest record
+	byte* scratch = NULL;
+	uint32_t scratch_size = 0;
+
+	for (uint64_t r = 0; r < header.num_records; ++r)
+	{
+		delta_record record;
+		if (position + sizeof(record) > delta_size)
+		{
+			free(positions);
+			free(delta);
+			quit("Delta is truncated.");
+		}
+		memcpy(&record, &delta[position], sizeof(record));
+		positions[r] = position;
+		position += sizeof(record);
+
+		if (record.length > delta_size - position)
+		{
+			free(positions);
+			free(delta);
+			quit("Delta is truncated.");
+		}
+
+		if (record.region >= DELTA_REGIONS ||
+			record.offset > disk_size ||
+			record.length > disk_size - record.offset)
+		{
+			free(positions);
+			free(delta);
+			quit("Delta contains a record that lies outside of the disk.");
+		}
+
+		if (hash64(&delta[position], record.length, 0) != record.new_hash)
+		{
+			free(positions);
+			free(delta);
+			quit("Delta is corrupt, a record doesn't match its checksum.");
+		}
+
+		if (record.length > scratch_size)
+		{
+			scratch_size = record.length;
+			free(scratch);
+			scratch = malloc(scratch_size);
+			if (scratch == NULL)
+			{
+				free(positions);
+				free(delta);
+				quit("Out of memory while checking the delta.");
+			}
+		}
+
+		// The disk either has to hold the base contents, or already hold
+		// the new contents if this delta was partially applied before
+		const byte* current_view = disk_view(disk, record.offset, record.length, scratch);
+		throttle_io(&limit, record.length);
+		uint64_t current = hash64(current_view, record.length, 0);
+		if (current == record.new_hash)
+		{
+			// Nothing to write, rewriting it would only dirty its pages. Positions start
+			// past the header, so 0 marks the record to be skipped.
+			already_applied += 1;
+			positions[r] = 0;
+		}
+		else if (current != record.old_hash)
+		{
+			fprintf(stderr, "Contents of the %s region at offset %llu don't match the delta's base image.\n",
+				delta_region_name(record.region), (unsigned long long)record.offset);
+			free(scratch);
+			free(positions);
+			free(delta);
+			quit("Disk is not the image this delta was generated against.");
+		}
+
+		position += record.length;
+	}
+
+	free(scratch);
+
+	// Apply the records region by region, the FAT last so that a crash
+	// part way through never exposes chains pointing at unwritten data
+	uint64_t written = 0;
+	for (int region = 0; region < DELTA_REGIONS; ++region)
+	{
+		if (region == DELTA_BOOT)
+		{
+			// The data region is done, readers only need to be kept
+			// out while the metadata changes underneath them
+			disk_lock_metadata(disk, DISK_LOCK_EXCLUSIVE);
+		}
+
+		if (region == DELTA_FAT)
+		{
+			// Make sure everything the FAT will reference is on disk first
+			disk_sync(disk);
+		}
+
+		for (uint64_t r = 0; r < header.num_records; ++r)
+		{
+			if (positions[r] == 0)
+			{
+				continue;
+			}
+
+			delta_record record;
+			memcpy(&record, &delta[positions[r]], sizeof(record));
+
+			if (record.region == region)
+			{
+				// Metadata records go out under the exclusive lock, don't keep readers waiting on the limit
+				if (region == DELTA_DATA)
+				{
+					throttle_io(&limit, record.length);
+				}
+				disk_write(disk, &delta[positions[r] + sizeof(record)], record.length, record.offset);
+				written += record.length;
+			}
+		}
+	}
+
+	free(positions);
+	free(delta);
+
+	disk_sync(disk);
+	disk_unlock_metadata(disk);
+	throttle_finish(&limit);
+
+	printf("Patch applied: %llu records, %llu bytes written", (unsigned long long)header.num_records, (unsigned long long)written);
+	if (already_applied > 0)
+	{
+		printf(" (%u records were already up to date)", already_applied);
+	}
+	printf(".\n");
+}
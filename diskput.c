@@ -1,194 +1,561 @@
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdbool.h>
-
-#include "directory_sector.h"
-#include "FAT_entry.h"
-#include "boot_sector.h"
-
-#include "SFS.h"
-
-/* DISK PUT
- * Add a file to the root directory of the disk.
- * @param const byte* : disk - A pointer to a memory mapped array representing a FAT12 disk image
- * @param FILE*       : file - An already opened file stream to be copied to the @param(disk)
- * @param const char* : input_filename - A string representing the filename to use on the @param(disk) image.
- * @returns void - Operation status is printed to the console.
- *               - Otherwise the program terminates with EXIT_FAILURE.
- */ 
-void diskput(byte* disk, FILE* file, const char* input_filename)
-{
-	// Used for logging a status message at completion
-	bool success = false;
-
-	// Boot sector is a properly aligned and packed
-	// unionized structure representing the boot sector of
-	// a FAT12 disk image.
-	boot_sector boot;
-	boot_extra boot_calc = initialize_boot(&boot, disk);
-
-	// Assert that we're working with a FAT12 disk by
-	// looking for the FAT12 label in the File System field
-
-	// Start by copying and null-terminating the string
-	char FS_type[LEN_File_System_Type + 1];
-	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
-	FS_type[LEN_File_System_Type] = '\0';
-	
-	if (strstr(FS_type, "FAT12") == NULL)
-	{
-		// Didn't find it...
-		fclose(file);
-		quit("Disk doesn't list file system type as \"FAT12\"");
-	}
-	
-	// We'll duplicate the fat table for ease of use
-	FAT_entry* table = calloc(1, boot_calc.FAT_size* sizeof(FAT_entry));
-	
-	// We'll also only be using short filenames for this program
-	// so let's allocate some room for one
-	char filename[LEN_Filename + 1 + LEN_Extension + 1];
-	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
-	
-	unsigned int num_alloced = 0; 
-	// Load the fat table so we can jump around later
-	for (int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
-
-		// The FAT entry is non-zero, so the corresponding data region is allocated
-		num_alloced += (table[FAT_idx].value != 0) ? 1 : 0;
-	}
-	
-	// Calculate the remainder (free) space using the number of allocated entries 
-	// from the FAT table
-	const
-	unsigned int free_space = boot_calc.total_size
-							- num_alloced
-							* boot.data.Sectors_Per_Cluster.value
-							* boot.data.Bytes_Per_Sector.value;
-
-	directory_entry write_sector = initialize_write_sector(file, input_filename);
-
-	// If the file size we're trying to place exceeds the free space, warn and halt
-	if (write_sector.data.File_Size.value > free_space)
-	{
-		fclose(file);
-		free(table);
-		quit("Cannot write file to disk, insufficient free space.");
-	}
-	
-	directory_entry existing_entry;
-	char* filename_compare = calloc(1, LEN_Filename + 1 + LEN_Extension + 1);
-
-	// Check if a file with this name already exists
-	for (int entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
-	{
-		for (int j = 0; j < sizeof(directory_entry); ++j)
-		{
-			existing_entry.raw[j].value = disk[entry_offset + j].value;		
-		}
-		
-		if (existing_entry.raw[0].value != 0x0 &&
-			existing_entry.raw[0].value != 0xE5 &&
-			(existing_entry.data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0)
-		{
-			// This entry represents a file
-			trim_filename(filename_compare, existing_entry.data.Filename, existing_entry.data.Extension);
-
-			if (strcasecmp(filename_compare, input_filename) == 0)
-			{
-				// A file with this name already exists on the disk
-				free(filename_compare);
-				free(table);
-				fclose(file);
-				quit("A file with this name already exists on the disk");
-			}
-		}
-	}
-	
-	free(filename_compare);
-
-	unsigned int file_size_remaining = write_sector.data.File_Size.value;
-	unsigned int sector_location;
-	unsigned int bytes_to_copy;
-	bool found_first = false;
-
-	char block[boot.data.Bytes_Per_Sector.value];
-	
-	// Scan the fat table
-	for (int FAT_idx = 2; file_size_remaining > 0 && FAT_idx < boot_calc.FAT_size; ++FAT_idx)
-	{
-		// Check each entry for an empty identifier, meaning we can write here
-		if (table[FAT_idx].value == 0)
-		{
-			// Cache the value of the first logical cluster
-			if (found_first == false)
-			{
-				write_sector.data.First_Logical_Cluster.value = FAT_idx;
-				found_first = true;
-				
-				// Find a free directory entry
-				for (int entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
-				{
-					byte first_byte = disk[entry_offset];
-					if (first_byte.value == 0x00 || first_byte.value == 0xE5)
-					{
-						// Overwrite the a free directory entry with our directory info.
-						for (int j = 0; j < sizeof(directory_entry); ++j)
-						{
-							disk[entry_offset + j].value = write_sector.raw[j].value;
-						}
-						break;
-					}
-				}
-			}
-
-			// Calculate location and size of the block write
-			sector_location = boot_calc.data_offset + (FAT_idx - 2) * boot.data.Bytes_Per_Sector.value;
-			bytes_to_copy = MIN(file_size_remaining, boot.data.Bytes_Per_Sector.value);
-			file_size_remaining -= file_size_remaining > boot.data.Bytes_Per_Sector.value ? boot.data.Bytes_Per_Sector.value : file_size_remaining;
-
-			// Location of the next FAT entry
-			int next = 0xFFF;
-			int update_idx = FAT_idx;
-			// Do we need another sector to complete the write?
-			if (file_size_remaining > 0)
-			{
-				// Seek to the next free FAT entry
-				for (next = FAT_idx + 1; table[next].value != 0 && next < boot_calc.FAT_size; ++next)
-					;
-
-				// Continue the next round from next, use -1 here because loop will auto-increment i
-				FAT_idx = next - 1;
-			}
-
-			// Point this FAT entry to the next one
-			table[update_idx].value = next;
-
-			// Propigate the changes to the two tables on the disk			
-			update_disk_FAT(table, disk, boot_calc.FAT1_offset, update_idx);
-			update_disk_FAT(table, disk, boot_calc.FAT2_offset, update_idx);
-
-			// With FAT tables updated, write the corresponding block of data to the data region
-			memset(&block, '\0', boot.data.Bytes_Per_Sector.value);
-			fread(&block, sizeof(char), bytes_to_copy, file);
-			
-			// Write this block to the disk
-			memcpy(&disk[sector_location], block, bytes_to_copy);
-
-			// There's no more data, next is 0xFFF
-			if (next == 0xFFF)
-			{
-				success = true;
-				break;				
-			}
-		}
-	}
-
-	printf("%s\n", success ? "File written." : "Failed to write file to disk.");
-
-	// Done examining the FAT, copied everything needed
-	free(table);
-}
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+
+#include "disk_io.h"
+#include "sfs_index.h"
+#include "throttle.h"
+#include "copy_pool.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Largest run of contiguous clusters written in one go
+#define PUT_EXTENT_SIZE (1u << 20)
+
+// Mark a FAT entry's bytes as part of the range that needs committing
+static void dirty_range(uint64_t* low, uint64_t* high, uint64_t offset, uint64_t length)
+{
+	if (offset < *low) *low = offset;
+	if (offset + length > *high) *high = offset + length;
+}
+
+// Write a changed FAT entry to both tables, leaving unchanged ones untouched so their pages stay clean
+static void commit_FAT_entry(FAT_entry* table, byte* disk, const boot_extra* boot_calc, unsigned int entry, uint64_t* low, uint64_t* high)
+{
+	if (read_FAT_entry(disk, boot_calc->FAT1_offset, entry) == table[entry].value &&
+		read_FAT_entry(disk, boot_calc->FAT2_offset, entry) == table[entry].value)
+	{
+		return;
+	}
+
+	update_disk_FAT(table, disk, boot_calc->FAT1_offset, entry);
+	update_disk_FAT(table, disk, boot_calc->FAT2_offset, entry);
+	dirty_range(low, high, boot_calc->FAT1_offset + 3 * (uint64_t)entry / 2, 2);
+	dirty_range(low, high, boot_calc->FAT2_offset + 3 * (uint64_t)entry / 2, 2);
+}
+
+/* REPLACE FILE
+ * Overwrite an existing file in place. Its chain is reused, grown from free clusters or cut short
+ * as the new size requires, and only clusters whose contents differ are written.
+ * @param disk_io*               : io - The disk being written, holding the writer lock
+ * @param byte*                  : disk - The disk's metadata
+ * @param const boot_extra*      : boot_calc - Geometry of the disk
+ * @param FAT_entry*             : table - Decoded copy of the FAT, updated with the new chain
+ * @param uint64_t               : entry_offset - Location of the file's directory entry
+ * @param FILE*                  : file - The new contents
+ * @param const directory_entry* : write_sector - Directory entry describing the new contents
+ * @param throttle*              : limit - Paces the reads and writes of cluster data
+ * @returns bool - Whether the file was replaced, on failure terminates with EXIT_FAILURE.
+ */
+static bool replace_file(disk_io* io, byte* disk, const boot_extra* boot_calc, FAT_entry* table, uint64_t entry_offset, FILE* file, const directory_entry* write_sector, throttle* limit)
+{
+	unsigned int cluster_size = boot_calc->cluster_size;
+	unsigned int file_size = write_sector->data.File_Size.value;
+	unsigned int needed = ((uint64_t)file_size + cluster_size - 1) / cluster_size;
+
+	directory_entry entry;
+	for (int j = 0; j < sizeof(directory_entry); ++j)
+	{
+		entry.raw[j].value = disk[entry_offset + j].value;
+	}
+
+	// Collect the existing chain, a chain longer than the table is going round in circles
+	unsigned int* chain = malloc((boot_calc->FAT_size + needed + 1) * sizeof(unsigned int));
+	unsigned int old_count = 0;
+	if (chain == NULL)
+	{
+		quit("Out of memory while replacing the file.");
+	}
+
+	for (unsigned int cluster = entry.data.First_Logical_Cluster.value;
+		 cluster >= 2 && cluster < boot_calc->FAT_size && cluster < 0xFF8 && old_count < boot_calc->FAT_size;
+		 cluster = table[cluster].value)
+	{
+		chain[old_count++] = cluster;
+	}
+
+	// Grow the chain from free clusters, looking just past its end first to keep it contiguous.
+	// Only clusters that have both a FAT entry and room in the image can be used.
+	if (needed > old_count)
+	{
+		unsigned int last_cluster = MIN(boot_calc->FAT_size, 2 + (boot_calc->total_size - boot_calc->data_offset) / cluster_size);
+		unsigned int start = old_count > 0 ? chain[old_count - 1] + 1 : 2;
+		unsigned int count = old_count;
+		for (unsigned int step = 0; count < needed && step < last_cluster; ++step)
+		{
+			unsigned int FAT_idx = start + step;
+			if (FAT_idx >= last_cluster)
+			{
+				FAT_idx = 2 + (FAT_idx - last_cluster);
+			}
+
+			if (FAT_idx >= 2 && FAT_idx < last_cluster && table[FAT_idx].value == 0)
+			{
+				// Claim it so it isn't picked twice
+				table[FAT_idx].value = 0xFFF;
+				chain[count++] = FAT_idx;
+			}
+		}
+
+		if (count < needed)
+		{
+			// The table is only our copy, nothing has been written yet
+			free(chain);
+			quit("Cannot write file to disk, insufficient free space.");
+		}
+	}
+
+	// Copy the new contents over the chain, leaving clusters that already hold the right bytes alone
+	byte* cluster_data = malloc(cluster_size);
+	byte* scratch = malloc(cluster_size);
+	byte* extent = malloc(PUT_EXTENT_SIZE);
+	uint64_t extent_location = 0;
+	unsigned int extent_length = 0;
+	unsigned int rewritten = 0;
+
+	if (cluster_data == NULL || scratch == NULL || extent == NULL)
+	{
+		quit("Out of memory while replacing the file.");
+	}
+
+	unsigned int file_size_remaining = file_size;
+	for (unsigned int i = 0; i < needed; ++i)
+	{
+		uint64_t sector_location = boot_calc->data_offset + (uint64_t)(chain[i] - 2) * cluster_size;
+		unsigned int bytes_to_copy = MIN(file_size_remaining, cluster_size);
+		file_size_remaining -= bytes_to_copy;
+
+		// A host file that came up short would have zeros written over live clusters
+		if (fread(cluster_data, sizeof(char), bytes_to_copy, file) != bytes_to_copy)
+		{
+			quit("Failed to read the file being written.");
+		}
+
+		if (i < old_count)
+		{
+			throttle_io(limit, bytes_to_copy);
+		}
+
+		bool changed = i >= old_count ||
+					   memcmp(disk_view(io, sector_location, bytes_to_copy, scratch), cluster_data, bytes_to_copy) != 0;
+
+		// Write out the pending extent if this block doesn't continue it
+		if (extent_length > 0 &&
+			(!changed || extent_location + extent_length != sector_location || extent_length + cluster_size > PUT_EXTENT_SIZE))
+		{
+			throttle_io(limit, extent_length);
+			TRACE_BEGIN(span);
+			disk_write(io, extent, extent_length, extent_location);
+			TRACE_END(span, "write extent", "bytes", extent_length);
+			extent_length = 0;
+		}
+
+		if (changed)
+		{
+			if (extent_length == 0)
+			{
+				extent_location = sector_location;
+			}
+			memcpy(&extent[extent_length], cluster_data, bytes_to_copy);
+			extent_length += bytes_to_copy;
+			rewritten += 1;
+		}
+	}
+
+	if (extent_length > 0)
+	{
+		throttle_io(limit, extent_length);
+		TRACE_BEGIN(span);
+		disk_write(io, extent, extent_length, extent_location);
+		TRACE_END(span, "write extent", "bytes", extent_length);
+	}
+
+	free(extent);
+	free(scratch);
+	free(cluster_data);
+
+	// Link the new chain and release whatever is left of the old one
+	for (unsigned int i = 0; i < needed; ++i)
+	{
+		table[chain[i]].value = i + 1 < needed ? chain[i + 1] : 0xFFF;
+	}
+	for (unsigned int i = needed; i < old_count; ++i)
+	{
+		table[chain[i]].value = 0;
+	}
+
+	// The entry keeps its name, attributes and creation time
+	entry.data.First_Logical_Cluster.value = needed > 0 ? chain[0] : 0;
+	entry.data.File_Size.value = file_size;
+	entry.data.Last_Access_Date.value = write_sector->data.Last_Access_Date.value;
+	entry.data.Last_Write_Time.value = write_sector->data.Last_Write_Time.value;
+	entry.data.Last_Write_Date.value = write_sector->data.Last_Write_Date.value;
+
+	// Readers have to be kept out while the FAT nibbles and directory entry change
+	TRACE_BEGIN(commit);
+	disk_lock_metadata(io, DISK_LOCK_EXCLUSIVE);
+
+	uint64_t low = boot_calc->data_offset;
+	uint64_t high = 0;
+
+	for (int j = 0; j < sizeof(directory_entry); ++j)
+	{
+		disk[entry_offset + j].value = entry.raw[j].value;
+	}
+	dirty_range(&low, &high, entry_offset, sizeof(directory_entry));
+
+	unsigned int touched = needed > old_count ? needed : old_count;
+	for (unsigned int i = 0; i < touched; ++i)
+	{
+		commit_FAT_entry(table, disk, boot_calc, chain[i], &low, &high);
+	}
+
+	disk_commit(io, low, high - low);
+	disk_unlock_metadata(io);
+	TRACE_END(commit, "commit metadata", "bytes", high - low);
+
+	printf("Rewrote %u of %u clusters.\n", rewritten, needed);
+
+	free(chain);
+	return true;
+}
+
+/* DISK PUT
+ * Add a file to the root directory of the disk.
+ * @param disk_io*    : io - An opened FAT12 disk image
+ * @param FILE*       : file - An already opened file stream to be copied to the @param(io)
+ * @param const char* : input_filename - A string representing the filename to use on the @param(io) image.
+ * @param const sfs_options* : options - Whether to replace a file of the same name in place rather
+ *                              than refusing to, how many threads to copy with, and limits on the
+ *                              rate data is written at
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */ 
+void diskput(disk_io* io, FILE* file, const char* input_filename, const sfs_options* options)
+{
+	// Other writers would pick the same free clusters, wait for our turn.
+	// Readers carry on until the FAT and directory are committed.
+	TRACE_BEGIN(wait);
+	disk_lock_writer(io);
+	byte* disk = disk_metadata(io);
+	TRACE_END(wait, "lock writer", NULL, 0);
+
+	// Used for logging a status message at completion
+	bool success = false;
+
+	// Boot sector is a properly aligned and packed
+	// unionized structure representing the boot sector of
+	// a FAT12 disk image.
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+
+	// Assert that we're working with a FAT12 disk by
+	// looking for the FAT12 label in the File System field
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+	
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it...
+		fclose(file);
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+	
+	// We'll duplicate the fat table for ease of use
+	FAT_entry* table = calloc(1, boot_calc.FAT_size* sizeof(FAT_entry));
+	
+	// We'll also only be using short filenames for this program
+	// so let's allocate some room for one
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', LEN_Filename + 1 + LEN_Extension + 1);
+	
+	// With an index the table comes decoded, and the name check and the search
+	// for free clusters start from what it knows
+	sfs_index* index = disk_index(io, &boot_calc);
+
+	unsigned int num_alloced = 0; 
+	// Load the fat table so we can jump around later
+	TRACE_BEGIN(load);
+	for (unsigned int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
+	{
+		if (index != NULL)
+		{
+			table[FAT_idx].value = index->table[FAT_idx];
+		}
+		else
+		{
+			load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
+		}
+
+		// The FAT entry is non-zero, so the corresponding data region is allocated
+		num_alloced += (table[FAT_idx].value != 0) ? 1 : 0;
+	}
+	TRACE_END(load, "load FAT", "entries", boot_calc.FAT_size);
+	
+	// Calculate the remainder (free) space using the number of allocated entries 
+	// from the FAT table
+	const
+	uint64_t free_space = boot_calc.total_size
+						- (uint64_t)num_alloced
+						* boot.data.Sectors_Per_Cluster.value
+						* boot.data.Bytes_Per_Sector.value;
+
+	directory_entry write_sector = initialize_write_sector(file, input_filename);
+
+	throttle limit;
+	throttle_init(&limit, options, "diskput", write_sector.data.File_Size.value);
+
+	directory_entry existing_entry;
+	char* filename_compare = calloc(1, LEN_Filename + 1 + LEN_Extension + 1);
+	bool name_taken = false;
+
+	// Check if a file with this name already exists, with an index only the entry it names
+	uint64_t first_entry = boot_calc.root_offset;
+	uint64_t end_entry = boot_calc.data_offset;
+	if (index != NULL)
+	{
+		unsigned int slot;
+		// --replace is after a file of that name, anything else of that name is a clash
+		bool found = (options->replace && index_find(index, input_filename, true, &slot)) ||
+					 index_find(index, input_filename, false, &slot);
+		first_entry = found ? boot_calc.root_offset + (uint64_t)slot * sizeof(directory_entry) : end_entry;
+		end_entry = MIN(first_entry + sizeof(directory_entry), end_entry);
+	}
+
+	for (uint64_t entry_offset = first_entry; entry_offset < end_entry; entry_offset += sizeof(directory_entry))
+	{
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			existing_entry.raw[j].value = disk[entry_offset + j].value;		
+		}
+		
+		if (existing_entry.raw[0].value != 0x0 &&
+			existing_entry.raw[0].value != 0xE5 &&
+			(existing_entry.data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0)
+		{
+			// This entry represents a file
+			trim_filename(filename_compare, existing_entry.data.Filename, existing_entry.data.Extension);
+
+			// A subdirectory is never replaced, a file of the same name further on still may be
+			if (strcasecmp(filename_compare, input_filename) == 0 && (existing_entry.data.Attributes.value & SUBDIR) != 0)
+			{
+				name_taken = true;
+				continue;
+			}
+
+			if (strcasecmp(filename_compare, input_filename) == 0 && options->replace)
+			{
+				free(filename_compare);
+
+				success = replace_file(io, disk, &boot_calc, table, entry_offset, file, &write_sector, &limit);
+				throttle_finish(&limit);
+				printf("%s\n", success ? "File written." : "Failed to write file to disk.");
+
+				free(table);
+				return;
+			}
+
+			if (strcasecmp(filename_compare, input_filename) == 0)
+			{
+				// A file with this name already exists on the disk
+				free(filename_compare);
+				free(table);
+				fclose(file);
+				quit("A file with this name already exists on the disk");
+			}
+		}
+	}
+	
+	free(filename_compare);
+
+	if (name_taken)
+	{
+		free(table);
+		fclose(file);
+		quit("A file with this name already exists on the disk");
+	}
+
+	// If the file size we're trying to place exceeds the free space, warn and halt
+	if (write_sector.data.File_Size.value > free_space)
+	{
+		fclose(file);
+		free(table);
+		quit("Cannot write file to disk, insufficient free space.");
+	}
+
+	unsigned int file_size_remaining = write_sector.data.File_Size.value;
+	int64_t entry_slot = -1;
+	uint64_t sector_location;
+	unsigned int bytes_to_copy;
+	bool found_first = false;
+
+	unsigned int cluster_size = boot_calc.cluster_size;
+
+	// A large file read from a regular file is copied by a pool of workers once
+	// every cluster has been picked, the pieces are gathered here until then
+	struct stat file_stat;
+	bool parallel = options->workers > 1 && write_sector.data.File_Size.value > COPY_BATCH_SIZE &&
+					fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+	copy_list pieces;
+	copy_list_init(&pieces);
+	uint64_t file_offset = 0;
+
+	// Clusters allocated back to back are gathered here and written as one extent
+	byte* extent = malloc(PUT_EXTENT_SIZE);
+	uint64_t extent_location = 0;
+	unsigned int extent_length = 0;
+
+	if (extent == NULL)
+	{
+		fclose(file);
+		free(table);
+		quit("Out of memory while writing the file.");
+	}
+	
+	// Scan the fat table, every cluster below the index's hint is in use
+	for (unsigned int FAT_idx = index != NULL ? index->header->next_free : 2; file_size_remaining > 0 && FAT_idx < boot_calc.FAT_size; ++FAT_idx)
+	{
+		// Check each entry for an empty identifier, meaning we can write here
+		if (table[FAT_idx].value == 0)
+		{
+			// Cache the value of the first logical cluster
+			if (found_first == false)
+			{
+				write_sector.data.First_Logical_Cluster.value = FAT_idx;
+				found_first = true;
+				
+				// Find a free directory entry, it's filled in when committing
+				for (uint64_t entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+				{
+					byte first_byte = disk[entry_offset];
+					if (first_byte.value == 0x00 || first_byte.value == 0xE5)
+					{
+						entry_slot = entry_offset;
+						break;
+					}
+				}
+			}
+
+			// Calculate location and size of the block write
+			sector_location = boot_calc.data_offset + (uint64_t)(FAT_idx - 2) * cluster_size;
+			bytes_to_copy = MIN(file_size_remaining, cluster_size);
+			file_size_remaining -= bytes_to_copy;
+
+			// Location of the next FAT entry
+			int next = 0xFFF;
+			int update_idx = FAT_idx;
+			// Do we need another sector to complete the write?
+			if (file_size_remaining > 0)
+			{
+				// Seek to the next free FAT entry
+				for (next = FAT_idx + 1; next < boot_calc.FAT_size && table[next].value != 0; ++next)
+					;
+
+				// Continue the next round from next, use -1 here because loop will auto-increment i
+				FAT_idx = next - 1;
+			}
+
+			// Point this FAT entry to the next one, the tables on the disk
+			// are only updated once all of the data is in place
+			table[update_idx].value = next;
+
+			if (parallel)
+			{
+				copy_list_push(&pieces, sector_location, file_offset, bytes_to_copy);
+				file_offset += bytes_to_copy;
+			}
+			else
+			{
+				// Write out the pending extent if this block doesn't continue it
+				if (extent_length > 0 &&
+					(extent_location + extent_length != sector_location || extent_length + cluster_size > PUT_EXTENT_SIZE))
+				{
+					throttle_io(&limit, extent_length);
+					TRACE_BEGIN(span);
+					disk_write(io, extent, extent_length, extent_location);
+					TRACE_END(span, "write extent", "bytes", extent_length);
+					extent_length = 0;
+				}
+				if (extent_length == 0)
+				{
+					extent_location = sector_location;
+				}
+
+				// With FAT tables updated, read the corresponding block of data for the data region
+				memset(&extent[extent_length], '\0', bytes_to_copy);
+				fread(&extent[extent_length], sizeof(char), bytes_to_copy, file);
+				extent_length += bytes_to_copy;
+			}
+
+			// There's no more data, next is 0xFFF
+			if (next == 0xFFF)
+			{
+				success = true;
+				break;				
+			}
+		}
+	}
+
+	// Write the last extent of data
+	if (extent_length > 0)
+	{
+		throttle_io(&limit, extent_length);
+		TRACE_BEGIN(span);
+		disk_write(io, extent, extent_length, extent_location);
+		TRACE_END(span, "write extent", "bytes", extent_length);
+	}
+
+	// Data goes in before the FAT and directory point at it, as it does when written in turn
+	if (parallel && success)
+	{
+		copy_extents(io, fileno(file), true, &pieces, options->workers, &limit);
+	}
+	copy_list_free(&pieces);
+	throttle_finish(&limit);
+
+	if (success && entry_slot >= 0)
+	{
+		// Readers have to be kept out while the FAT nibbles and directory entry change
+		TRACE_BEGIN(commit);
+		disk_lock_metadata(io, DISK_LOCK_EXCLUSIVE);
+
+		// Overwrite the free directory entry with our directory info.
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			disk[entry_slot + j].value = write_sector.raw[j].value;
+		}
+
+		// Propigate our chain to the two tables on the disk
+		for (unsigned int FAT_idx = write_sector.data.First_Logical_Cluster.value; FAT_idx >= 2 && FAT_idx < boot_calc.FAT_size; FAT_idx = table[FAT_idx].value)
+		{
+			update_disk_FAT(table, disk, boot_calc.FAT1_offset, FAT_idx);
+			update_disk_FAT(table, disk, boot_calc.FAT2_offset, FAT_idx);
+		}
+
+		disk_commit(io, boot_calc.FAT1_offset, boot_calc.data_offset - boot_calc.FAT1_offset);
+		if (index != NULL)
+		{
+			index_add_file(io, index, &boot_calc, &write_sector, (entry_slot - boot_calc.root_offset) / sizeof(directory_entry));
+		}
+		disk_unlock_metadata(io);
+		TRACE_END(commit, "commit metadata", "bytes", boot_calc.data_offset - boot_calc.FAT1_offset);
+	}
+	else success = false;
+
+	printf("%s\n", success ? "File written." : "Failed to write file to disk.");
+
+	// Done examining the FAT, copied everything needed
+	free(extent);
+	free(table);
+}
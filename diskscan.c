@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "FAT_view.h"
+#include "layout.h"
+#include "report.h"
+#include "pack.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Room for an error message about one image
+#define SCAN_ERROR_SIZE 256
+
+// State shared by every worker, images are handed out through @next
+typedef struct
+{
+	DISK_ACTION action;
+	bool layout;
+
+	char** paths;
+	size_t num_paths;
+	size_t next;
+
+	// Keeps each image's line whole on the way out
+	pthread_mutex_t output;
+	size_t failed;
+} scan_pool;
+
+// Everything one image needs while it's scanned, released by scan_image_close()
+typedef struct
+{
+	int fd;
+	const byte* disk;
+	size_t mapped;
+
+	boot_sector boot;
+	boot_extra boot_calc;
+} scan_image;
+
+static void scan_append(char*** paths, size_t* num_paths, size_t* cap_paths, char* path)
+{
+	if (*num_paths == *cap_paths)
+	{
+		*cap_paths = *cap_paths ? *cap_paths * 2 : 256;
+		*paths = realloc(*paths, *cap_paths * sizeof(char*));
+		if (*paths == NULL)
+		{
+			quit("Out of memory while collecting images.");
+		}
+	}
+
+	(*paths)[(*num_paths)++] = path;
+}
+
+static int scan_compare(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* SCAN SOURCES
+ * Collect the images to scan: every regular file in a directory, or every line of a list file.
+ * @param const char* : source - A directory, a file listing one image per line, or - for standard input
+ * @param size_t*     : count - Receives the number of images
+ * @returns char** - The image paths, each one allocated.
+ *                 - When @param(source) can't be read the program terminates with EXIT_FAILURE.
+ */
+static char** scan_sources(const char* source, size_t* count)
+{
+	char** paths = NULL;
+	size_t num_paths = 0;
+	size_t cap_paths = 0;
+
+	DIR* dir = strcmp(source, "-") == 0 ? NULL : opendir(source);
+	if (dir != NULL)
+	{
+		// Directories aren't descended into, and dotfiles are left alone
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (entry->d_name[0] == '.')
+			{
+				continue;
+			}
+
+			char* path;
+			if (asprintf(&path, "%s/%s", source, entry->d_name) == -1)
+			{
+				quit("Out of memory while collecting images.");
+			}
+
+			struct stat path_stat;
+			bool regular = entry->d_type == DT_REG ||
+						   (entry->d_type == DT_UNKNOWN && stat(path, &path_stat) == 0 && S_ISREG(path_stat.st_mode));
+			if (!regular)
+			{
+				free(path);
+				continue;
+			}
+
+			scan_append(&paths, &num_paths, &cap_paths, path);
+		}
+		closedir(dir);
+
+		// Directory order is arbitrary, visit the images in name order instead
+		if (num_paths > 1)
+		{
+			qsort(paths, num_paths, sizeof(char*), scan_compare);
+		}
+	}
+	else if (strcmp(source, "-") == 0 || errno == ENOTDIR)
+	{
+		FILE* list = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+		if (list == NULL)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+
+		char* line = NULL;
+		size_t line_size = 0;
+		ssize_t length;
+		while ((length = getline(&line, &line_size, list)) != -1)
+		{
+			while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			{
+				line[--length] = '\0';
+			}
+			if (length == 0)
+			{
+				continue;
+			}
+
+			char* path = strdup(line);
+			if (path == NULL)
+			{
+				quit("Out of memory while collecting images.");
+			}
+			scan_append(&paths, &num_paths, &cap_paths, path);
+		}
+
+		free(line);
+		if (list != stdin)
+		{
+			fclose(list);
+		}
+	}
+	else
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	*count = num_paths;
+	return paths;
+}
+
+static void scan_image_close(scan_image* image)
+{
+	if (image->disk != NULL)
+	{
+		munmap((void*)image->disk, image->mapped);
+	}
+	if (image->fd != -1)
+	{
+		close(image->fd);
+	}
+}
+
+static void scan_error(char* error, int errnum)
+{
+	char buffer[SCAN_ERROR_SIZE];
+	snprintf(error, SCAN_ERROR_SIZE, "%s", strerror_r(errnum, buffer, SCAN_ERROR_SIZE));
+}
+
+/* SCAN IMAGE OPEN
+ * Open one image and map its metadata, checking everything a tool would quit over.
+ * @param scan_image* : image - Receives the descriptor, mapping and geometry
+ * @param const char* : path - Location of the image
+ * @param char*       : error - SCAN_ERROR_SIZE bytes, receives what went wrong
+ * @returns bool - false when the image can't be scanned, @param(error) says why. Either
+ *                 way @param(image) is released with scan_image_close().
+ */
+static bool scan_image_open(scan_image* image, const char* path, char* error)
+{
+	image->fd = -1;
+	image->disk = NULL;
+	image->mapped = 0;
+
+	image->fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat disk_stat;
+	if (image->fd == -1 || fstat(image->fd, &disk_stat) == -1)
+	{
+		scan_error(error, errno);
+		return false;
+	}
+
+	if (!S_ISREG(disk_stat.st_mode))
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Not a regular file.");
+		return false;
+	}
+
+	byte raw_boot[LEN_Boot_Sector_Required];
+	if (disk_stat.st_size < LEN_Boot_Sector_Required ||
+		pread(image->fd, raw_boot, LEN_Boot_Sector_Required, 0) != LEN_Boot_Sector_Required)
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Disk image is too small to hold a boot sector.");
+		return false;
+	}
+
+	// Decoding one would quit on a corrupt chunk, taking the rest of the scan with it
+	if (memcmp(raw_boot, PACK_MAGIC, LEN_Pack_Magic) == 0)
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Packed images aren't scanned, open it directly or unpack it with diskunpack.");
+		return false;
+	}
+
+	image->boot_calc = initialize_boot(&image->boot, raw_boot);
+	const boot_sector* boot = &image->boot;
+	const boot_extra* boot_calc = &image->boot_calc;
+
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot->data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Disk doesn't list file system type as \"FAT12\"");
+		return false;
+	}
+
+	// The tools trust the geometry, a scan of strangers' images can't
+	if (boot->data.Bytes_Per_Sector.value == 0 || boot->data.Sectors_Per_Cluster.value == 0 || boot->data.FATs.value == 0 ||
+		boot_calc->FAT1_offset > boot_calc->root_offset || boot_calc->root_offset > boot_calc->data_offset)
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Disk geometry is invalid.");
+		return false;
+	}
+
+	if (boot_calc->data_offset > (uint64_t)disk_stat.st_size)
+	{
+		snprintf(error, SCAN_ERROR_SIZE, "Disk geometry lies outside of the image.");
+		return false;
+	}
+
+	// Only the metadata is looked at, so only it is mapped
+	image->mapped = boot_calc->data_offset;
+	void* map = mmap(NULL, image->mapped, PROT_READ, MAP_SHARED, image->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		scan_error(error, errno);
+		return false;
+	}
+	image->disk = map;
+
+	return true;
+}
+
+/* SCAN ONE
+ * Report on one image as a single JSON line, or the reason it couldn't be read.
+ * @param scan_pool*  : pool - Which report to give, and where failures are counted
+ * @param const char* : path - Location of the image
+ */
+static void scan_one(scan_pool* pool, const char* path)
+{
+	TRACE_BEGIN(span);
+
+	char* line = NULL;
+	size_t length = 0;
+	FILE* out = open_memstream(&line, &length);
+	if (out == NULL)
+	{
+		quit("Out of memory while scanning.");
+	}
+
+	fprintf(out, "{\"image\":");
+	layout_json_fstring(out, path);
+
+	char error[SCAN_ERROR_SIZE];
+	scan_image image;
+	bool opened = scan_image_open(&image, path, error);
+
+	if (opened)
+	{
+		const byte* disk = image.disk;
+		const boot_extra* boot_calc = &image.boot_calc;
+
+		// Hold off writers' commits while the metadata is read, like the tools do
+		uint64_t locked = boot_calc->data_offset - boot_calc->FAT1_offset;
+		if (locked > 0)
+		{
+			lock_range(image.fd, F_RDLCK, boot_calc->FAT1_offset, locked);
+		}
+
+		FAT_view fat;
+		FAT_view_init_metadata(&fat, disk, boot_calc);
+
+		// Same reports the tools give, each one's fields after the image's. The plain
+		// list goes straight into the line, the others are gathered and printed unlocked.
+		fprintf(out, ",");
+		info_report report;
+		disk_layout layout;
+		if (pool->action == DISKINFO)
+			info_report_gather(&report, disk, &image.boot, boot_calc, &fat, pool->layout);
+		else if (pool->layout)
+			layout_scan(&layout, &fat, boot_calc, disk);
+		else
+			list_report_files(out, disk, boot_calc, &fat, true);
+
+		FAT_view_free(&fat);
+		if (locked > 0)
+		{
+			lock_range(image.fd, F_UNLCK, boot_calc->FAT1_offset, locked);
+		}
+
+		if (pool->action == DISKINFO)
+		{
+			info_report_print(out, &report, true);
+			info_report_free(&report);
+		}
+		else if (pool->layout)
+		{
+			list_report_layout(out, &layout, true);
+			layout_free(&layout);
+		}
+	}
+	else
+	{
+		fprintf(out, ",\"error\":");
+		layout_json_fstring(out, error);
+	}
+
+	fprintf(out, "}\n");
+	fclose(out);
+	scan_image_close(&image);
+
+	pthread_mutex_lock(&pool->output);
+	fwrite(line, sizeof(char), length, stdout);
+	pool->failed += opened ? 0 : 1;
+	pthread_mutex_unlock(&pool->output);
+
+	free(line);
+	TRACE_END(span, "scan image", "metadata_bytes", image.mapped);
+}
+
+static void* scan_worker(void* arg)
+{
+	scan_pool* pool = arg;
+	size_t idx;
+
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_paths)
+	{
+		scan_one(pool, pool->paths[idx]);
+	}
+
+	return NULL;
+}
+
+/* DISK SCAN
+ * Run diskinfo or disklist over many images at once, printing one JSON line per image
+ * as each finishes. An image that can't be read gets an "error" line, and the scan goes on.
+ * @param const char*        : source - A directory of images, a file listing them one per line, or - for standard input
+ * @param DISK_ACTION        : action - DISKINFO or DISKLIST
+ * @param const sfs_options* : options - How many images to work on at once, and whether to add the layout
+ * @returns int - EXIT_SUCCESS when every image was read, EXIT_FAILURE otherwise.
+ */
+int diskscan(const char* source, DISK_ACTION action, const sfs_options* options)
+{
+	scan_pool pool;
+	pool.action = action;
+	pool.layout = options->layout;
+	pool.paths = scan_sources(source, &pool.num_paths);
+	pool.next = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.output, NULL);
+
+	// Each worker has one image open at a time
+	int workers = MIN((size_t)options->workers, pool.num_paths);
+	pthread_t* threads = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+
+	for (int w = 0; w < workers; ++w)
+	{
+		if (pthread_create(&threads[w], NULL, scan_worker, &pool) != 0)
+		{
+			quit("Failed to start a worker thread.");
+		}
+	}
+	for (int w = 0; w < workers; ++w)
+	{
+		pthread_join(threads[w], NULL);
+	}
+
+	fflush(stdout);
+	if (pool.failed > 0)
+	{
+		fprintf(stderr, "%zu of %zu images could not be read.\n", pool.failed, pool.num_paths);
+	}
+
+	free(threads);
+	for (size_t i = 0; i < pool.num_paths; ++i)
+	{
+		free(pool.paths[i]);
+	}
+	free(pool.paths);
+	pthread_mutex_destroy(&pool.output);
+
+	return pool.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,591 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "boot_sector.h"
+#include "FAT_view.h"
+#include "disk_io.h"
+#include "throttle.h"
+#include "tar.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Largest run of contiguous clusters moved between the stream and the image in one go
+#define TAR_EXTENT_SIZE (1u << 20)
+
+// Longest name taken from a GNU long name or pax extended header
+#define TAR_LONG_NAME 4096
+
+// A member written to the image, its directory entry is filled in when committing
+typedef struct
+{
+	uint64_t slot;
+	directory_entry entry;
+} tar_member;
+
+// Read exactly @length bytes of the stream
+static void stream_read(FILE* in, void* buffer, size_t length)
+{
+	if (fread(buffer, 1, length, in) != length)
+	{
+		quit("Unexpected end of the tar stream.");
+	}
+}
+
+// Pass over @length bytes of the stream, it may be a pipe so they're read rather than seeked past
+static void stream_skip(FILE* in, uint64_t length, byte* buffer)
+{
+	while (length > 0)
+	{
+		size_t piece = MIN(length, (uint64_t)TAR_EXTENT_SIZE);
+		stream_read(in, buffer, piece);
+		length -= piece;
+	}
+}
+
+// Take the path out of a pax extended header's "<length> path=<value>\n" records
+static void pax_path(const char* records, size_t length, char* name)
+{
+	size_t at = 0;
+	while (at < length)
+	{
+		char* end;
+		unsigned long record = strtoul(&records[at], &end, 10);
+		if (record == 0 || at + record > length || *end != ' ')
+		{
+			return;
+		}
+
+		const char* key = end + 1;
+		const char* last = &records[at + record - 1];
+		if (last > key + 5 && strncmp(key, "path=", 5) == 0)
+		{
+			size_t value = MIN((size_t)(last - (key + 5)), (size_t)TAR_LONG_NAME - 1);
+			memcpy(name, key + 5, value);
+			name[value] = '\0';
+		}
+		at += record;
+	}
+}
+
+// Whether a file called @name is already in the root directory or earlier in the stream
+static bool name_taken(const byte* disk, const boot_extra* boot_calc, const tar_member* members, size_t count, const char* name)
+{
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', sizeof(filename));
+
+	for (uint64_t entry_offset = boot_calc->root_offset; entry_offset < boot_calc->data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry existing;
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			existing.raw[j].value = disk[entry_offset + j].value;
+		}
+
+		if (existing.raw[0].value != 0x0 &&
+			existing.raw[0].value != 0xE5 &&
+			(existing.data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0)
+		{
+			trim_filename(filename, existing.data.Filename, existing.data.Extension);
+			if (strcasecmp(filename, name) == 0)
+			{
+				return true;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		directory_entry existing = members[i].entry;
+		trim_filename(filename, existing.data.Filename, existing.data.Extension);
+		if (strcasecmp(filename, name) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* FILL EXTENT
+ * Move the next @param(length) bytes of the stream into a run of clusters. A mapped image
+ * is read into directly, otherwise the bytes are staged in @param(buffer) and written.
+ * @param disk_io*  : io - The disk being written, holding the writer lock
+ * @param FILE*     : in - The tar stream, positioned in a member's data
+ * @param uint64_t  : location - Where the run starts in the image
+ * @param size_t    : length - Bytes to move, at most TAR_EXTENT_SIZE
+ * @param byte*     : buffer - TAR_EXTENT_SIZE bytes to stage data in
+ * @param throttle* : limit - Paces the writes
+ */
+static void fill_extent(disk_io* io, FILE* in, uint64_t location, size_t length, byte* buffer, throttle* limit)
+{
+	throttle_io(limit, length);
+	TRACE_BEGIN(span);
+
+	if (io->map != NULL)
+	{
+		stream_read(in, &io->map[location], length);
+		disk_dirty(io, location, length);
+	}
+	else
+	{
+		stream_read(in, buffer, length);
+		disk_write(io, buffer, length, location);
+	}
+
+	TRACE_END(span, "write extent", "bytes", length);
+}
+
+/* DISK PUT TAR
+ * Add every regular file of a ustar stream to the root directory of the disk. Clusters are
+ * picked as each header arrives and the member's data is read straight into them. The FAT
+ * and directory entries are only committed once the whole stream has been read, so a
+ * stream that fails part way leaves the file system as it was, only free clusters are touched.
+ * @param disk_io*           : io - An opened, writable FAT12 disk image
+ * @param FILE*              : in - The tar stream
+ * @param const sfs_options* : options - Limits on the rate data is written at
+ * @returns void - Operation status is printed to the console.
+ *               - Otherwise the program terminates with EXIT_FAILURE.
+ */
+void diskput_tar(disk_io* io, FILE* in, const sfs_options* options)
+{
+	// Other writers would pick the same free clusters, wait for our turn.
+	// Readers carry on until the FAT and directory are committed.
+	TRACE_BEGIN(wait);
+	disk_lock_writer(io);
+	byte* disk = disk_metadata(io);
+	TRACE_END(wait, "lock writer", NULL, 0);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+	check_FAT12(&boot);
+
+	if (boot_calc.data_offset > io->size || boot_calc.cluster_size == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	FAT_entry* table = calloc(boot_calc.FAT_size, sizeof(FAT_entry));
+	byte* buffer = malloc(TAR_EXTENT_SIZE);
+	char* long_name = calloc(1, TAR_LONG_NAME);
+	if (table == NULL || buffer == NULL || long_name == NULL)
+	{
+		quit("Out of memory while writing the files.");
+	}
+
+	TRACE_BEGIN(load);
+	for (unsigned int FAT_idx = 0; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
+	{
+		load_FAT_entry(table, disk, boot_calc.FAT1_offset, FAT_idx);
+	}
+	TRACE_END(load, "load FAT", "entries", boot_calc.FAT_size);
+
+	// Only clusters that both have a FAT entry and fit in the image can be handed out
+	unsigned int cluster_size = boot_calc.cluster_size;
+	unsigned int usable = MIN(boot_calc.FAT_size, 2 + (unsigned int)((io->size - boot_calc.data_offset) / cluster_size));
+
+	// Clusters and directory slots are taken in order, so the search for the next
+	// free one carries on from where the last one was found
+	unsigned int next_free = 2;
+	uint64_t next_slot = boot_calc.root_offset;
+
+	tar_member* members = NULL;
+	size_t num_members = 0;
+	size_t cap_members = 0;
+	uint64_t total_bytes = 0;
+
+	throttle limit;
+	throttle_init(&limit, options, "diskput", 0);
+
+	tar_header header;
+	for (;;)
+	{
+		// Streams cut off right after a member, without the end blocks, are accepted
+		size_t got = fread(&header, 1, sizeof(tar_header), in);
+		if (got == 0 || (got == sizeof(tar_header) && tar_is_end(&header)))
+		{
+			break;
+		}
+		if (got != sizeof(tar_header))
+		{
+			quit("Unexpected end of the tar stream.");
+		}
+
+		uint64_t checksum;
+		uint64_t size;
+		uint64_t mtime;
+		if (!tar_parse_number(header.checksum, sizeof(header.checksum), &checksum) || checksum != tar_checksum(&header) ||
+			!tar_parse_number(header.size, sizeof(header.size), &size) ||
+			!tar_parse_number(header.mtime, sizeof(header.mtime), &mtime))
+		{
+			quit("Corrupt tar header.");
+		}
+
+		uint64_t padded = size + tar_padding(size);
+
+		// A long name applies to the member that follows it
+		if (header.typeflag == 'L' || header.typeflag == 'x')
+		{
+			if (size >= TAR_LONG_NAME)
+			{
+				stream_skip(in, padded, buffer);
+				continue;
+			}
+
+			stream_read(in, buffer, padded);
+			if (header.typeflag == 'L')
+			{
+				memcpy(long_name, buffer, size);
+				long_name[size] = '\0';
+			}
+			else pax_path((const char*)buffer, size, long_name);
+			continue;
+		}
+
+		// Only files have anywhere to go, the root directory holds no subdirectories
+		if (header.typeflag != TAR_REGULAR && header.typeflag != TAR_REGULAR_OLD)
+		{
+			if (header.typeflag != TAR_DIRECTORY && header.typeflag != 'g' && header.typeflag != 'K')
+			{
+				fprintf(stderr, "diskput: skipping %.100s, not a regular file\n", long_name[0] ? long_name : header.name);
+			}
+			stream_skip(in, padded, buffer);
+			long_name[0] = '\0';
+			continue;
+		}
+
+		// The member's own name, without the directories above it
+		char path[TAR_LONG_NAME];
+		if (long_name[0] != '\0')
+		{
+			snprintf(path, sizeof(path), "%s", long_name);
+		}
+		else if (header.prefix[0] != '\0' && memcmp(header.magic, TAR_MAGIC, 5) == 0)
+		{
+			snprintf(path, sizeof(path), "%.155s/%.100s", header.prefix, header.name);
+		}
+		else snprintf(path, sizeof(path), "%.100s", header.name);
+		long_name[0] = '\0';
+
+		char* input_filename = strrchr(path, '/');
+		input_filename = input_filename ? input_filename + 1 : path;
+
+		if (input_filename[0] == '\0')
+		{
+			stream_skip(in, padded, buffer);
+			continue;
+		}
+		if (size > UINT32_MAX)
+		{
+			quit("A tar member is too large for a FAT12 file.");
+		}
+
+		if (num_members == cap_members)
+		{
+			cap_members = cap_members ? cap_members * 2 : 64;
+			members = realloc(members, cap_members * sizeof(tar_member));
+			if (members == NULL)
+			{
+				quit("Out of memory while writing the files.");
+			}
+		}
+
+		tar_member* member = &members[num_members];
+		memset(&member->entry, 0, sizeof(directory_entry));
+		set_short_name(&member->entry, input_filename);
+		set_entry_times(&member->entry, (time_t)mtime);
+		member->entry.data.File_Size.value = size;
+
+		char filename[LEN_Filename + 1 + LEN_Extension + 1];
+		memset(&filename, '\0', sizeof(filename));
+		trim_filename(filename, member->entry.data.Filename, member->entry.data.Extension);
+
+		if (name_taken(disk, &boot_calc, members, num_members, filename))
+		{
+			fprintf(stderr, "diskput: %s\n", path);
+			quit("A file with this name already exists on the disk");
+		}
+
+		for (; next_slot < boot_calc.data_offset; next_slot += sizeof(directory_entry))
+		{
+			if (disk[next_slot].value == 0x00 || disk[next_slot].value == 0xE5)
+			{
+				break;
+			}
+		}
+		if (next_slot >= boot_calc.data_offset)
+		{
+			quit("Cannot write file to disk, the root directory is full.");
+		}
+		member->slot = next_slot;
+		next_slot += sizeof(directory_entry);
+
+		// Claim clusters as the data arrives, writing each run of neighbours as one extent
+		uint64_t remaining = size;
+		unsigned int previous = 0;
+		uint64_t extent_location = 0;
+		size_t extent_length = 0;
+
+		while (remaining > 0)
+		{
+			while (next_free < usable && table[next_free].value != 0)
+			{
+				++next_free;
+			}
+			if (next_free >= usable)
+			{
+				// Nothing has been committed, only free clusters were written to
+				fprintf(stderr, "diskput: %s\n", path);
+				quit("Cannot write file to disk, insufficient free space.");
+			}
+
+			unsigned int cluster = next_free;
+			if (previous == 0)
+				member->entry.data.First_Logical_Cluster.value = cluster;
+			else
+				table[previous].value = cluster;
+
+			// Marked as the end for now, so it isn't picked twice
+			table[cluster].value = 0xFFF;
+			previous = cluster;
+
+			uint64_t location = boot_calc.data_offset + (uint64_t)(cluster - 2) * cluster_size;
+			size_t bytes = MIN(remaining, (uint64_t)cluster_size);
+
+			if (extent_length > 0 &&
+				(extent_location + extent_length != location || extent_length + bytes > TAR_EXTENT_SIZE))
+			{
+				fill_extent(io, in, extent_location, extent_length, buffer, &limit);
+				extent_length = 0;
+			}
+			if (extent_length == 0)
+			{
+				extent_location = location;
+			}
+
+			extent_length += bytes;
+			remaining -= bytes;
+		}
+
+		if (extent_length > 0)
+		{
+			fill_extent(io, in, extent_location, extent_length, buffer, &limit);
+		}
+		stream_skip(in, tar_padding(size), buffer);
+
+		num_members += 1;
+		total_bytes += size;
+	}
+
+	throttle_finish(&limit);
+
+	if (num_members > 0)
+	{
+		// Readers have to be kept out while the FAT nibbles and directory entries change
+		TRACE_BEGIN(commit);
+		disk_lock_metadata(io, DISK_LOCK_EXCLUSIVE);
+
+		for (size_t i = 0; i < num_members; ++i)
+		{
+			for (int j = 0; j < sizeof(directory_entry); ++j)
+			{
+				disk[members[i].slot + j].value = members[i].entry.raw[j].value;
+			}
+		}
+
+		// Every entry that changed belongs to one of the new chains
+		for (unsigned int FAT_idx = 2; FAT_idx < boot_calc.FAT_size; ++FAT_idx)
+		{
+			if (read_FAT_entry(disk, boot_calc.FAT1_offset, FAT_idx) != table[FAT_idx].value)
+			{
+				update_disk_FAT(table, disk, boot_calc.FAT1_offset, FAT_idx);
+				update_disk_FAT(table, disk, boot_calc.FAT2_offset, FAT_idx);
+			}
+		}
+
+		disk_commit(io, boot_calc.FAT1_offset, boot_calc.data_offset - boot_calc.FAT1_offset);
+		disk_unlock_metadata(io);
+		TRACE_END(commit, "commit metadata", "bytes", boot_calc.data_offset - boot_calc.FAT1_offset);
+	}
+
+	printf("%zu files written, %llu bytes.\n", num_members, (unsigned long long)total_bytes);
+
+	free(members);
+	free(long_name);
+	free(buffer);
+	free(table);
+}
+
+// Fill in a ustar header for a file in the root directory
+static void tar_header_for(tar_header* header, const directory_entry* entry, const char* filename)
+{
+	memset(header, 0, sizeof(tar_header));
+
+	snprintf(header->name, sizeof(header->name), "%s", filename);
+	tar_format_number(header->mode, sizeof(header->mode), (entry->data.Attributes.value & READ_ONLY) ? 0444 : 0644);
+	tar_format_number(header->uid, sizeof(header->uid), 0);
+	tar_format_number(header->gid, sizeof(header->gid), 0);
+	tar_format_number(header->size, sizeof(header->size), entry->data.File_Size.value);
+	tar_format_number(header->mtime, sizeof(header->mtime), entry_write_time(entry));
+	header->typeflag = TAR_REGULAR;
+	memcpy(header->magic, TAR_MAGIC, sizeof(header->magic));
+	memcpy(header->version, TAR_VERSION, sizeof(header->version));
+
+	// Six digits, a NUL and a space, as tar itself writes it
+	tar_format_number(header->checksum, 7, tar_checksum(header));
+	header->checksum[7] = ' ';
+}
+
+/* DISK GET TAR
+ * Write every file in the root directory to a ustar stream, each header followed by
+ * the file's data read along its cluster chain.
+ * @param disk_io*           : io - An opened FAT12 disk image
+ * @param FILE*              : out - Receives the tar stream
+ * @param const sfs_options* : options - How far to read ahead and limits on the rate data is read at
+ * @returns int - EXIT_SUCCESS when every file was written whole, EXIT_FAILURE otherwise.
+ *                Status is printed to stderr, the stream has standard output to itself.
+ */
+int diskget_tar(disk_io* io, FILE* out, const sfs_options* options)
+{
+	// Hold off writers' commits while the FAT and directory are read. Both
+	// are copied out, so the files are streamed after letting go.
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+	const byte* disk = disk_metadata(io);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk);
+	check_FAT12(&boot);
+
+	if (boot_calc.data_offset > io->size || boot_calc.cluster_size == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	FAT_view fat;
+	FAT_view_init(&fat, io, &boot_calc, FAT_DECODED);
+
+	directory_entry* files = NULL;
+	size_t num_files = 0;
+	size_t cap_files = 0;
+	uint64_t total = 0;
+
+	for (uint64_t entry_offset = boot_calc.root_offset; entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry sector;
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			sector.raw[j].value = disk[entry_offset + j].value;
+		}
+
+		// Only consider entries diskget would be able to retrieve
+		if (sector.raw[0].value == 0x0 ||
+			sector.raw[0].value == 0xE5 ||
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) != 0)
+		{
+			continue;
+		}
+
+		if (num_files == cap_files)
+		{
+			cap_files = cap_files ? cap_files * 2 : 64;
+			files = realloc(files, cap_files * sizeof(directory_entry));
+			if (files == NULL)
+			{
+				quit("Out of memory while retrieving the files.");
+			}
+		}
+		files[num_files++] = sector;
+		total += sector.data.File_Size.value;
+	}
+
+	disk_unlock_metadata(io);
+
+	byte* scratch = malloc(TAR_EXTENT_SIZE);
+	byte* zeros = calloc(1, TAR_BLOCK_SIZE * 2);
+	if (scratch == NULL || zeros == NULL)
+	{
+		quit("Out of memory while retrieving the files.");
+	}
+
+	throttle limit;
+	throttle_init(&limit, options, "diskget", total);
+
+	size_t failed = 0;
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', sizeof(filename));
+
+	for (size_t i = 0; i < num_files; ++i)
+	{
+		unsigned int size = files[i].data.File_Size.value;
+		trim_filename(filename, files[i].data.Filename, files[i].data.Extension);
+
+		tar_header header;
+		tar_header_for(&header, &files[i], filename);
+		fwrite(&header, sizeof(tar_header), 1, out);
+
+		// Stream the chain out a run of clusters at a time
+		chain_reader reader;
+		chain_reader_init(&reader, &fat, &boot_calc, files[i].data.First_Logical_Cluster.value, size, throttle_window(&limit, options->readahead), scratch, TAR_EXTENT_SIZE);
+
+		uint64_t written = 0;
+		const byte* data;
+		size_t length;
+		TRACE_BEGIN(span);
+		while (chain_read(&reader, &data, &length))
+		{
+			fwrite(data, sizeof(byte), length, out);
+			written += length;
+			TRACE_END(span, "copy extent", "bytes", length);
+
+			throttle_io(&limit, length);
+			TRACE_RESTART(span);
+		}
+
+		// The header promised the full size, so a damaged chain is made up with zeros
+		// to keep the rest of the stream readable
+		if (reader.error != NULL || written < size)
+		{
+			fprintf(stderr, "diskget: %s: %s\n", filename, reader.error != NULL ? reader.error : "chain ends early");
+			failed += 1;
+
+			for (uint64_t missing = size - written; missing > 0; )
+			{
+				size_t piece = MIN(missing, (uint64_t)TAR_BLOCK_SIZE);
+				fwrite(zeros, 1, piece, out);
+				missing -= piece;
+			}
+		}
+
+		fwrite(zeros, 1, tar_padding(size), out);
+		chain_reader_free(&reader);
+	}
+
+	// Two zero blocks end the archive
+	fwrite(zeros, 1, TAR_BLOCK_SIZE * 2, out);
+	fflush(out);
+
+	if (ferror(out))
+	{
+		quit("Failed to write the tar stream.");
+	}
+
+	throttle_finish(&limit);
+	FAT_view_free(&fat);
+	free(zeros);
+	free(scratch);
+	free(files);
+
+	if (failed > 0)
+	{
+		fprintf(stderr, "Failed to retrieve %zu of %zu files\n", failed, num_files);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "%zu files retrieved.\n", num_files);
+	return EXIT_SUCCESS;
+}
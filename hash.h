@@ -0,0 +1,217 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Constants for the 64-bit hash, these are large odd primes with
+// well-mixed bits so that every multiply diffuses the input
+#define HASH64_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_PRIME_3 0x165667B19E3779F9ULL
+#define HASH64_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH64_PRIME_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t hash64_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash64_read(const unsigned char* p)
+{
+	// Unaligned safe load, the compiler turns this into a single mov
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH64_PRIME_2;
+	acc  = hash64_rotl(acc, 31);
+	acc *= HASH64_PRIME_1;
+	return acc;
+}
+
+static inline uint64_t hash64_merge(uint64_t acc, uint64_t lane)
+{
+	acc ^= hash64_round(0, lane);
+	return acc * HASH64_PRIME_1 + HASH64_PRIME_4;
+}
+
+/* HASH64
+ * A fast non-cryptographic 64-bit hash of a block of memory. Four independent
+ * lanes are used for blocks of 32 bytes or more so the multiplies pipeline and
+ * hashing is bound by memory bandwidth rather than latency.
+ * @param const void* : data - The bytes to hash
+ * @param size_t      : len - The number of bytes at @param(data)
+ * @param uint64_t    : seed - Starting value, use 0 unless hashes should be distinct per use
+ * @returns uint64_t - The hash value
+ */
+static inline uint64_t hash64(const void* data, size_t len, uint64_t seed)
+{
+	const unsigned char* p = data;
+	const unsigned char* end = p + len;
+	uint64_t h;
+
+	if (len >= 32)
+	{
+		uint64_t v1 = seed + HASH64_PRIME_1 + HASH64_PRIME_2;
+		uint64_t v2 = seed + HASH64_PRIME_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - HASH64_PRIME_1;
+
+		// Consume 32 byte stripes, one word per lane
+		do
+		{
+			v1 = hash64_round(v1, hash64_read(p));
+			v2 = hash64_round(v2, hash64_read(p + 8));
+			v3 = hash64_round(v3, hash64_read(p + 16));
+			v4 = hash64_round(v4, hash64_read(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = hash64_rotl(v1, 1) + hash64_rotl(v2, 7) + hash64_rotl(v3, 12) + hash64_rotl(v4, 18);
+		h = hash64_merge(h, v1);
+		h = hash64_merge(h, v2);
+		h = hash64_merge(h, v3);
+		h = hash64_merge(h, v4);
+	}
+	else
+	{
+		h = seed + HASH64_PRIME_5;
+	}
+
+	h += (uint64_t)len;
+
+	// Fold in whatever is left that didn't fill a stripe
+	while (p + 8 <= end)
+	{
+		h ^= hash64_round(0, hash64_read(p));
+		h  = hash64_rotl(h, 27) * HASH64_PRIME_1 + HASH64_PRIME_4;
+		p += 8;
+	}
+
+	while (p < end)
+	{
+		h ^= (*p++) * HASH64_PRIME_5;
+		h  = hash64_rotl(h, 11) * HASH64_PRIME_1;
+	}
+
+	// Final avalanche so every input bit affects every output bit
+	h ^= h >> 33;
+	h *= HASH64_PRIME_2;
+	h ^= h >> 29;
+	h *= HASH64_PRIME_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+// Streaming form of hash64() for data that arrives in pieces, such as a file
+// spread over several extents. The result is identical to hashing the whole
+// buffer at once, regardless of how it was split.
+typedef struct
+{
+	uint64_t v1, v2, v3, v4;
+	uint64_t seed;
+	uint64_t total_len;
+	unsigned char stripe[32];
+	size_t buffered;
+} hash64_state;
+
+static inline void hash64_init(hash64_state* state, uint64_t seed)
+{
+	state->v1 = seed + HASH64_PRIME_1 + HASH64_PRIME_2;
+	state->v2 = seed + HASH64_PRIME_2;
+	state->v3 = seed;
+	state->v4 = seed - HASH64_PRIME_1;
+	state->seed = seed;
+	state->total_len = 0;
+	state->buffered = 0;
+}
+
+static inline void hash64_stripe(hash64_state* state, const unsigned char* p)
+{
+	state->v1 = hash64_round(state->v1, hash64_read(p));
+	state->v2 = hash64_round(state->v2, hash64_read(p + 8));
+	state->v3 = hash64_round(state->v3, hash64_read(p + 16));
+	state->v4 = hash64_round(state->v4, hash64_read(p + 24));
+}
+
+static inline void hash64_update(hash64_state* state, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	const unsigned char* end = p + len;
+
+	state->total_len += len;
+
+	// Top up a partially filled stripe from the last update first
+	if (state->buffered > 0)
+	{
+		size_t fill = 32 - state->buffered;
+		if (fill > len) fill = len;
+		memcpy(&state->stripe[state->buffered], p, fill);
+		state->buffered += fill;
+		p += fill;
+
+		if (state->buffered < 32)
+		{
+			return;
+		}
+		hash64_stripe(state, state->stripe);
+		state->buffered = 0;
+	}
+
+	while (p + 32 <= end)
+	{
+		hash64_stripe(state, p);
+		p += 32;
+	}
+
+	memcpy(state->stripe, p, end - p);
+	state->buffered = end - p;
+}
+
+static inline uint64_t hash64_digest(const hash64_state* state)
+{
+	const unsigned char* p = state->stripe;
+	const unsigned char* end = p + state->buffered;
+	uint64_t h;
+
+	if (state->total_len >= 32)
+	{
+		h = hash64_rotl(state->v1, 1) + hash64_rotl(state->v2, 7) + hash64_rotl(state->v3, 12) + hash64_rotl(state->v4, 18);
+		h = hash64_merge(h, state->v1);
+		h = hash64_merge(h, state->v2);
+		h = hash64_merge(h, state->v3);
+		h = hash64_merge(h, state->v4);
+	}
+	else
+	{
+		h = state->seed + HASH64_PRIME_5;
+	}
+
+	h += state->total_len;
+
+	while (p + 8 <= end)
+	{
+		h ^= hash64_round(0, hash64_read(p));
+		h  = hash64_rotl(h, 27) * HASH64_PRIME_1 + HASH64_PRIME_4;
+		p += 8;
+	}
+
+	while (p < end)
+	{
+		h ^= (*p++) * HASH64_PRIME_5;
+		h  = hash64_rotl(h, 11) * HASH64_PRIME_1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH64_PRIME_2;
+	h ^= h >> 29;
+	h *= HASH64_PRIME_3;
+	h ^= h >> 32;
+
+	return h;
+}
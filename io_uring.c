@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+
+#include "disk_io.h"
+
+#include "SFS.h"
+
+// io_uring backend. Aligned transfers are split into IO_CHUNK_SIZE requests
+// and kept queue_depth deep in flight on an O_DIRECT descriptor, bypassing
+// the page cache. The few unaligned bytes at either end of a write go through
+// a regular descriptor instead, which the kernel keeps coherent for us.
+
+// An aligned span of the image and where it's transferred to or from
+typedef struct
+{
+	byte* buffer;
+	size_t length;
+	uint64_t offset;
+} uring_segment;
+
+// The part of a staged segment a read actually asked for
+typedef struct
+{
+	const byte* from;
+	byte* to;
+	size_t length;
+} uring_copy;
+
+typedef struct
+{
+	int ring_fd;
+	int direct_fd;
+	unsigned int depth;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	byte* bounce;
+	size_t bounce_size;
+
+	// Room to stage one bounce buffer's worth of segments, and where each
+	// segment's wanted bytes end up
+	uring_segment* segments;
+	uring_copy* copies;
+	size_t max_segments;
+
+	// The rings are single producer, workers take turns
+	pthread_mutex_t lock;
+} uring_state;
+
+static int uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static bool uring_map_rings(uring_state* state, const struct io_uring_params* params)
+{
+	state->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+	state->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels share one mapping between the two rings
+	if (params->features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (state->cq_ring_size > state->sq_ring_size)
+		{
+			state->sq_ring_size = state->cq_ring_size;
+		}
+		state->cq_ring_size = state->sq_ring_size;
+	}
+
+	state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+	if (state->sq_ring == MAP_FAILED)
+	{
+		return false;
+	}
+
+	if (params->features & IORING_FEAT_SINGLE_MMAP)
+	{
+		state->cq_ring = state->sq_ring;
+	}
+	else
+	{
+		state->cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_CQ_RING);
+		if (state->cq_ring == MAP_FAILED)
+		{
+			return false;
+		}
+	}
+
+	state->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQES);
+	if (state->sqes == MAP_FAILED)
+	{
+		return false;
+	}
+
+	char* sq = state->sq_ring;
+	state->sq_head  = (unsigned int*)(sq + params->sq_off.head);
+	state->sq_tail  = (unsigned int*)(sq + params->sq_off.tail);
+	state->sq_mask  = (unsigned int*)(sq + params->sq_off.ring_mask);
+	state->sq_array = (unsigned int*)(sq + params->sq_off.array);
+
+	char* cq = state->cq_ring;
+	state->cq_head  = (unsigned int*)(cq + params->cq_off.head);
+	state->cq_tail  = (unsigned int*)(cq + params->cq_off.tail);
+	state->cq_mask  = (unsigned int*)(cq + params->cq_off.ring_mask);
+	state->cqes     = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+
+	return true;
+}
+
+/* URING TRANSFER
+ * Move aligned segments between memory and the O_DIRECT descriptor, keeping up to
+ * queue depth requests in flight at a time across all of them.
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+static void uring_transfer(disk_io* io, uring_state* state, int opcode, const uring_segment* segments, size_t count)
+{
+	size_t segment = 0;
+	size_t queued = 0;
+
+	while (segment < count)
+	{
+		// Fill the submission queue as far as the depth allows
+		unsigned int tail = *state->sq_tail;
+		unsigned int batch = 0;
+
+		while (segment < count && batch < state->depth)
+		{
+			const uring_segment* current = &segments[segment];
+			size_t chunk = MIN((size_t)IO_CHUNK_SIZE, current->length - queued);
+			unsigned int idx = tail & *state->sq_mask;
+
+			struct io_uring_sqe* sqe = &state->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode    = opcode;
+			sqe->fd        = state->direct_fd;
+			sqe->addr      = (uint64_t)(uintptr_t)&current->buffer[queued];
+			sqe->len       = chunk;
+			sqe->off       = current->offset + queued;
+			sqe->user_data = (uint64_t)segment << 32 | queued;
+
+			state->sq_array[idx] = idx;
+			tail   += 1;
+			batch  += 1;
+			queued += chunk;
+
+			if (queued == current->length)
+			{
+				segment += 1;
+				queued = 0;
+			}
+		}
+
+		__atomic_store_n(state->sq_tail, tail, __ATOMIC_RELEASE);
+
+		// Submit the batch and wait for all of it to complete
+		unsigned int submitted = 0;
+		while (submitted < batch)
+		{
+			int ret = uring_enter(state->ring_fd, batch - submitted, 0, 0);
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ret < 0)
+			{
+				char* err = strerror(errno);
+				quit(err);
+			}
+			submitted += ret;
+		}
+
+		unsigned int reaped = 0;
+		while (reaped < batch)
+		{
+			unsigned int head = *state->cq_head;
+			if (head == __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE))
+			{
+				if (uring_enter(state->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				{
+					char* err = strerror(errno);
+					quit(err);
+				}
+				continue;
+			}
+
+			struct io_uring_cqe* cqe = &state->cqes[head & *state->cq_mask];
+			if (cqe->res < 0)
+			{
+				char* err = strerror(-cqe->res);
+				quit(err);
+			}
+
+			// Reads may legitimately come up short at the end of the image,
+			// anything else is an error
+			const uring_segment* done = &segments[cqe->user_data >> 32];
+			size_t within = cqe->user_data & 0xFFFFFFFFu;
+			uint64_t position = done->offset + within;
+			size_t chunk = MIN((size_t)IO_CHUNK_SIZE, done->length - within);
+			size_t required = chunk;
+			if (opcode == IORING_OP_READ)
+			{
+				required = position >= io->size ? 0 : MIN((uint64_t)chunk, io->size - position);
+			}
+			if ((size_t)cqe->res < required)
+			{
+				quit("Short transfer to or from the disk image.");
+			}
+
+			__atomic_store_n(state->cq_head, head + 1, __ATOMIC_RELEASE);
+			reaped += 1;
+		}
+	}
+}
+
+static void uring_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	// A regular descriptor is kept for unaligned edges and fsync
+	disk_open_fd(io, path, 0);
+
+	uring_state* state = calloc(1, sizeof(uring_state));
+	if (state == NULL)
+	{
+		quit("Out of memory while setting up io_uring.");
+	}
+
+	state->depth = options->queue_depth > 0 ? options->queue_depth : IO_DEFAULT_QUEUE_DEPTH;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	state->ring_fd = uring_setup(state->depth, &params);
+
+	if (state->ring_fd < 0 || !uring_map_rings(state, &params))
+	{
+		// Kernels without io_uring, or with it disabled, still get a working tool
+		fprintf(stderr, "io_uring is unavailable (%s), falling back to pread.\n", strerror(errno));
+		if (state->ring_fd >= 0)
+		{
+			close(state->ring_fd);
+		}
+		free(state);
+		io->ops = &pread_ops;
+		return;
+	}
+
+	state->depth = MIN(state->depth, params.sq_entries);
+
+	// Not every file system supports O_DIRECT, go through the page cache on those
+	state->direct_fd = open(path, (io->writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (state->direct_fd == -1)
+	{
+		state->direct_fd = dup(io->fd);
+	}
+
+	state->bounce_size = (size_t)state->depth * IO_CHUNK_SIZE;
+	if (posix_memalign((void**)&state->bounce, IO_ALIGNMENT, state->bounce_size) != 0)
+	{
+		quit("Out of memory while setting up io_uring.");
+	}
+
+	state->max_segments = state->bounce_size / IO_ALIGNMENT;
+	state->segments = calloc(state->max_segments, sizeof(uring_segment));
+	state->copies = calloc(state->max_segments, sizeof(uring_copy));
+	if (state->segments == NULL || state->copies == NULL)
+	{
+		quit("Out of memory while setting up io_uring.");
+	}
+
+	pthread_mutex_init(&state->lock, NULL);
+	io->backend = state;
+}
+
+/* URING READ RANGES
+ * Read ranges back to back into @param(buffer). As many ranges as fit in the bounce
+ * buffer are submitted together, so a fragmented chain still keeps the queue full.
+ */
+static void uring_read_ranges(disk_io* io, const disk_range* ranges, size_t count, void* buffer)
+{
+	uring_state* state = io->backend;
+	byte* out = buffer;
+	size_t range = 0;
+	size_t range_done = 0;
+
+	pthread_mutex_lock(&state->lock);
+
+	while (range < count)
+	{
+		// Stage whole aligned blocks around each range in the bounce buffer
+		size_t used = 0;
+		size_t staged = 0;
+
+		while (range < count && staged < state->max_segments && used < state->bounce_size)
+		{
+			uint64_t offset = ranges[range].offset + range_done;
+			size_t length = ranges[range].length - range_done;
+			if (length == 0)
+			{
+				range += 1;
+				range_done = 0;
+				continue;
+			}
+
+			uint64_t aligned_start = offset & ~(uint64_t)(IO_ALIGNMENT - 1);
+			uint64_t aligned_end   = (offset + length + IO_ALIGNMENT - 1) & ~(uint64_t)(IO_ALIGNMENT - 1);
+			size_t span = MIN((uint64_t)(state->bounce_size - used), aligned_end - aligned_start);
+			size_t take = MIN((uint64_t)length, aligned_start + span - offset);
+
+			uring_segment* segment = &state->segments[staged];
+			segment->buffer = &state->bounce[used];
+			segment->length = span;
+			segment->offset = aligned_start;
+
+			uring_copy* copy = &state->copies[staged];
+			copy->from   = &state->bounce[used + (offset - aligned_start)];
+			copy->to     = out;
+			copy->length = take;
+			staged += 1;
+
+			used       += span;
+			out        += take;
+			range_done += take;
+			if (range_done == ranges[range].length)
+			{
+				range += 1;
+				range_done = 0;
+			}
+		}
+
+		uring_transfer(io, state, IORING_OP_READ, state->segments, staged);
+
+		// Copy out the part of each segment that was asked for
+		for (size_t i = 0; i < staged; ++i)
+		{
+			memcpy(state->copies[i].to, state->copies[i].from, state->copies[i].length);
+		}
+	}
+
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void uring_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	disk_range range = { offset, length };
+	uring_read_ranges(io, &range, 1, buffer);
+}
+
+static void uring_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	uring_state* state = io->backend;
+	const byte* in = buffer;
+
+	pthread_mutex_lock(&state->lock);
+
+	// Unaligned head
+	if (offset % IO_ALIGNMENT != 0)
+	{
+		size_t head = MIN(length, IO_ALIGNMENT - offset % IO_ALIGNMENT);
+		pwrite_all(io->fd, in, head, offset);
+		in     += head;
+		offset += head;
+		length -= head;
+	}
+
+	// Aligned body, staged through the aligned bounce buffer
+	size_t body = length & ~(size_t)(IO_ALIGNMENT - 1);
+	while (body > 0)
+	{
+		size_t span = MIN(state->bounce_size, body);
+		memcpy(state->bounce, in, span);
+		uring_segment segment = { state->bounce, span, offset };
+		uring_transfer(io, state, IORING_OP_WRITE, &segment, 1);
+		in     += span;
+		offset += span;
+		length -= span;
+		body   -= span;
+	}
+
+	// Unaligned tail
+	if (length > 0)
+	{
+		pwrite_all(io->fd, in, length, offset);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void uring_sync(disk_io* io)
+{
+	if (fsync(io->fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void uring_close(disk_io* io)
+{
+	uring_state* state = io->backend;
+
+	munmap(state->sqes, state->sqes_size);
+	if (state->cq_ring != state->sq_ring)
+	{
+		munmap(state->cq_ring, state->cq_ring_size);
+	}
+	munmap(state->sq_ring, state->sq_ring_size);
+	close(state->ring_fd);
+	close(state->direct_fd);
+
+	pthread_mutex_destroy(&state->lock);
+	free(state->copies);
+	free(state->segments);
+	free(state->bounce);
+	free(state);
+
+	close(io->fd);
+}
+
+const struct disk_io_ops uring_ops =
+{
+	.name  = "io_uring",
+	.open  = uring_open,
+	.read  = uring_read,
+	.write = uring_write,
+	.sync  = uring_sync,
+	.close = uring_close,
+
+	.read_ranges = uring_read_ranges,
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "directory_sector.h"
+#include "FAT_view.h"
+#include "disk_io.h"
+
+#include "SFS.h"
+
+// Free runs are binned by powers of two, FAT12 can't address more than 4084 clusters
+#define LAYOUT_HISTOGRAM_BINS 13
+
+// Where one file lives on the disk
+typedef struct
+{
+	char name[LEN_Filename + 1 + LEN_Extension + 1];
+	unsigned int size;
+	unsigned int clusters;
+
+	cluster_extent* extents;
+	unsigned int num_extents;
+
+	// Set when the chain ends early, loops or leaves the FAT
+	bool damaged;
+} file_layout;
+
+// Where everything lives on the disk, gathered from one decode of the FAT
+typedef struct
+{
+	unsigned int cluster_size;
+	unsigned int num_clusters;
+
+	file_layout* files;
+	unsigned int num_files;
+
+	unsigned int free_clusters;
+	unsigned int free_extents;
+	unsigned int largest_free;
+	unsigned int free_histogram[LAYOUT_HISTOGRAM_BINS];
+} disk_layout;
+
+/* LAYOUT FRAGMENTATION
+ * How broken up a file is, 0 when it's in one piece and 1 when no two of its clusters are adjacent.
+ * @param const file_layout* : file - The file to rate
+ * @returns double - (extents - 1) / (clusters - 1), or 0 for files of a cluster or less.
+ */
+static inline double layout_fragmentation(const file_layout* file)
+{
+	if (file->clusters < 2 || file->num_extents < 2)
+	{
+		return 0.0;
+	}
+
+	return (double)(file->num_extents - 1) / (double)(file->clusters - 1);
+}
+
+static inline unsigned int layout_histogram_bin(unsigned int run)
+{
+	unsigned int bin = 0;
+	while (run > 1 && bin < LAYOUT_HISTOGRAM_BINS - 1)
+	{
+		run >>= 1;
+		bin += 1;
+	}
+	return bin;
+}
+
+static inline void layout_add_file(disk_layout* layout, FAT_view* fat, directory_entry* sector, unsigned int* capacity)
+{
+	if (layout->num_files == *capacity)
+	{
+		*capacity = *capacity ? *capacity * 2 : 16;
+		layout->files = realloc(layout->files, *capacity * sizeof(file_layout));
+		if (layout->files == NULL)
+		{
+			quit("Out of memory while mapping the disk layout.");
+		}
+	}
+
+	file_layout* file = &layout->files[layout->num_files++];
+	memset(file, 0, sizeof(file_layout));
+	trim_filename(file->name, sector->data.Filename, sector->data.Extension);
+	file->size = sector->data.File_Size.value;
+
+	// The clusters the directory entry says the file needs
+	unsigned int wanted = (file->size + layout->cluster_size - 1) / layout->cluster_size;
+	unsigned int extents_capacity = 0;
+
+	unsigned int chain = sector->data.First_Logical_Cluster.value;
+	cluster_extent extent;
+	while (file->clusters < wanted && FAT_next_extent(fat, &chain, wanted - file->clusters, &extent))
+	{
+		if (file->num_extents == extents_capacity)
+		{
+			extents_capacity = extents_capacity ? extents_capacity * 2 : 4;
+			file->extents = realloc(file->extents, extents_capacity * sizeof(cluster_extent));
+			if (file->extents == NULL)
+			{
+				quit("Out of memory while mapping the disk layout.");
+			}
+		}
+
+		file->extents[file->num_extents++] = extent;
+		file->clusters += extent.count;
+	}
+
+	file->damaged = file->clusters < wanted;
+}
+
+/* LAYOUT SCAN
+ * Map every file in the root directory and every free run in the data region.
+ * @param disk_layout*      : layout - Receives the map, release with layout_free()
+ * @param FAT_view*         : fat - A decoded view of the FAT
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @param const byte*       : disk - The disk's metadata, indexed by absolute image offset
+ */
+static inline void layout_scan(disk_layout* layout, FAT_view* fat, const boot_extra* boot_calc, const byte* disk)
+{
+	memset(layout, 0, sizeof(disk_layout));
+	layout->cluster_size = boot_calc->cluster_size;
+
+	// Only clusters that both have a FAT entry and fit in the image exist
+	uint64_t data_clusters = boot_calc->total_size > boot_calc->data_offset && boot_calc->cluster_size > 0
+						   ? (boot_calc->total_size - boot_calc->data_offset) / boot_calc->cluster_size
+						   : 0;
+	layout->num_clusters = MIN(data_clusters + 2, (uint64_t)fat->FAT_size);
+
+	// Same idea of what a file is as diskget
+	unsigned int capacity = 0;
+	for (uint64_t entry_offset = boot_calc->root_offset; entry_offset < boot_calc->data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry sector;
+		for (int j = 0; j < sizeof(directory_entry); ++j)
+		{
+			sector.raw[j].value = disk[entry_offset + j].value;
+		}
+
+		if (sector.raw[0].value != 0x0 &&
+			sector.raw[0].value != 0xE5 &&
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) == 0)
+		{
+			layout_add_file(layout, fat, &sector, &capacity);
+		}
+	}
+
+	// Runs of free clusters
+	unsigned int run = 0;
+	for (unsigned int cluster = 2; cluster <= layout->num_clusters; ++cluster)
+	{
+		if (cluster < layout->num_clusters && FAT_next(fat, cluster) == 0)
+		{
+			run += 1;
+			continue;
+		}
+
+		if (run > 0)
+		{
+			layout->free_clusters += run;
+			layout->free_extents += 1;
+			layout->free_histogram[layout_histogram_bin(run)] += 1;
+			if (run > layout->largest_free)
+			{
+				layout->largest_free = run;
+			}
+		}
+		run = 0;
+	}
+}
+
+static inline void layout_free(disk_layout* layout)
+{
+	for (unsigned int i = 0; i < layout->num_files; ++i)
+	{
+		free(layout->files[i].extents);
+	}
+	free(layout->files);
+	layout->files = NULL;
+}
+
+static inline double layout_average_extents(const disk_layout* layout)
+{
+	unsigned int extents = 0;
+	for (unsigned int i = 0; i < layout->num_files; ++i)
+	{
+		extents += layout->files[i].num_extents;
+	}
+
+	return layout->num_files ? (double)extents / layout->num_files : 0.0;
+}
+
+// Write a string to @out as a JSON string literal
+static inline void layout_json_fstring(FILE* out, const char* text)
+{
+	fputc('"', out);
+	for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if (*c < 0x20 || *c >= 0x7F)
+			fprintf(out, "\\u%04x", *c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+// Print a string as a JSON string literal
+static inline void layout_json_string(const char* text)
+{
+	layout_json_fstring(stdout, text);
+}
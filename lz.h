@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "SFS.h"
+
+// A small LZ77 coder for packed images, laid out like LZ4's block format. Each
+// sequence is a token byte holding a literal count and a match length in its two
+// nibbles, a count of 15 carrying on in further bytes until one is below 255, the
+// literals, then a two byte little-endian distance back to the match. A block's
+// last sequence stops after its literals. Empty stretches of an image come out
+// as a handful of bytes, and decoding is little more than a string of memcpys.
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  14
+
+static inline uint32_t lz_hash(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Append the bytes a count of 15 or more carries on in, NULL when out of room
+static inline uint8_t* lz_put_length(uint8_t* op, const uint8_t* end, size_t length)
+{
+	while (length >= 255)
+	{
+		if (op >= end) return NULL;
+		*op++ = 255;
+		length -= 255;
+	}
+	if (op >= end) return NULL;
+	*op++ = length;
+	return op;
+}
+
+static inline bool lz_get_length(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+	uint8_t next;
+	do
+	{
+		if (*ip >= end) return false;
+		next = *(*ip)++;
+		*length += next;
+	} while (next == 255);
+	return true;
+}
+
+// Append one sequence, a @match of 0 ends the block. NULL when out of room.
+static inline uint8_t* lz_emit(uint8_t* op, const uint8_t* end, const uint8_t* literals, size_t num_literals, size_t offset, size_t match)
+{
+	if (op >= end) return NULL;
+	uint8_t* token = op++;
+	*token = (num_literals >= 15 ? 15 : num_literals) << 4;
+
+	if (num_literals >= 15 && (op = lz_put_length(op, end, num_literals - 15)) == NULL) return NULL;
+	if ((size_t)(end - op) < num_literals) return NULL;
+	memcpy(op, literals, num_literals);
+	op += num_literals;
+
+	if (match == 0)
+	{
+		return op;
+	}
+
+	if (end - op < 2) return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	size_t extra = match - LZ_MIN_MATCH;
+	*token |= extra >= 15 ? 15 : extra;
+	if (extra >= 15 && (op = lz_put_length(op, end, extra - 15)) == NULL) return NULL;
+	return op;
+}
+
+/* LZ COMPRESS
+ * Compress a block greedily, taking the last place each 4 byte sequence was seen as the match.
+ * @param const void* : input - The block
+ * @param size_t      : length - Its size
+ * @param void*       : output - Receives the compressed block
+ * @param size_t      : capacity - Room in @param(output)
+ * @returns size_t - Size of the compressed block, 0 when it doesn't fit in @param(capacity).
+ */
+static inline size_t lz_compress(const void* input, size_t length, void* output, size_t capacity)
+{
+	const uint8_t* in = input;
+	const uint8_t* in_end = in + length;
+	const uint8_t* ip = in;
+	const uint8_t* anchor = in;
+	uint8_t* op = output;
+	const uint8_t* out_end = op + capacity;
+
+	// Positions are stored one up, so 0 means nothing has hashed here yet
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= in_end)
+	{
+		uint32_t hash = lz_hash(ip);
+		uint32_t candidate = table[hash];
+		table[hash] = ip - in + 1;
+
+		const uint8_t* ref = candidate != 0 ? in + candidate - 1 : NULL;
+		if (ref == NULL || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0)
+		{
+			++ip;
+			continue;
+		}
+
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < in_end && ref[match] == ip[match])
+		{
+			++match;
+		}
+
+		op = lz_emit(op, out_end, anchor, ip - anchor, ip - ref, match);
+		if (op == NULL)
+		{
+			return 0;
+		}
+
+		ip += match;
+		anchor = ip;
+	}
+
+	op = lz_emit(op, out_end, anchor, in_end - anchor, 0, 0);
+	return op != NULL ? (size_t)(op - (uint8_t*)output) : 0;
+}
+
+/* LZ DECOMPRESS
+ * Decode a block, checking every count and distance against both buffers.
+ * @param const void* : input - The compressed block
+ * @param size_t      : length - Its size
+ * @param void*       : output - Receives the block
+ * @param size_t      : expected - Size the block decodes to
+ * @returns bool - false when the block is corrupt or doesn't decode to @param(expected) bytes.
+ */
+static inline bool lz_decompress(const void* input, size_t length, void* output, size_t expected)
+{
+	const uint8_t* ip = input;
+	const uint8_t* in_end = ip + length;
+	uint8_t* out = output;
+	uint8_t* op = out;
+	const uint8_t* out_end = out + expected;
+
+	while (ip < in_end)
+	{
+		uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15 && !lz_get_length(&ip, in_end, &literals)) return false;
+		if (literals > (size_t)(in_end - ip) || literals > (size_t)(out_end - op)) return false;
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+
+		if (ip == in_end)
+		{
+			break;
+		}
+
+		if (in_end - ip < 2) return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match = token & 15;
+		if (match == 15 && !lz_get_length(&ip, in_end, &match)) return false;
+		match += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - out) || match > (size_t)(out_end - op)) return false;
+
+		// A match may overlap what it's copying, runs of one byte repeat it. Each copy
+		// doubles the stretch that's already in place, so a long run takes a few memcpys.
+		const uint8_t* ref = op - offset;
+		while (match > 0)
+		{
+			size_t piece = MIN(match, (size_t)(op - ref));
+			memcpy(op, ref, piece);
+			op += piece;
+			match -= piece;
+		}
+	}
+
+	return op == out_end;
+}
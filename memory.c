@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// In-memory backend. The whole image is read into anonymous memory when it's opened
+// and the tool works on that, so the page cache never tracks dirty pages or throttles
+// writeback for it. Writes mark the clusters they touch, and those clusters alone are
+// written back in runs of adjacent ones on sync and close. A tool that fails part way
+// exits without closing the disk, leaving the image as it was.
+
+#define DIRTY_BITS 64
+
+typedef struct
+{
+	// Bytes backing the image, rounded up to whole huge pages, and the mapping they're
+	// carved from, which is a huge page larger so they can start on a boundary of one
+	size_t allocated;
+	void* reserved;
+
+	// One bit per unit of the image, units line up with the clusters of the data region
+	uint64_t* dirty;
+	uint64_t unit;
+	uint64_t shift;
+
+	// Units in the whole image, and in the metadata region ahead of the first cluster
+	uint64_t units;
+	uint64_t metadata_units;
+} memory_state;
+
+static void memory_load(disk_io* io)
+{
+	// Large sequential reads, and the kernel told to read well ahead of them
+	posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	TRACE_BEGIN(span);
+	uint64_t loaded = 0;
+	uint64_t offset = 0;
+	while (offset < io->size)
+	{
+		// Holes are already zero in fresh anonymous memory, only what's stored is read.
+		// Where the file system can't say, the whole image counts as stored.
+		off_t data = lseek(io->fd, offset, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+		{
+			break;
+		}
+		off_t hole = data == -1 ? -1 : lseek(io->fd, data, SEEK_HOLE);
+		uint64_t start = data == -1 ? offset : (uint64_t)data;
+		uint64_t end = hole == -1 ? io->size : MIN((uint64_t)hole, io->size);
+
+		for (uint64_t piece = start; piece < end; piece += MEMORY_LOAD_SIZE)
+		{
+			size_t length = MIN((uint64_t)MEMORY_LOAD_SIZE, end - piece);
+			pread_all(io->fd, &io->map[piece], length, piece);
+			loaded += length;
+		}
+		offset = end;
+	}
+	TRACE_END(span, "load image", "bytes", loaded);
+}
+
+static void memory_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	disk_open_fd(io, path, 0);
+
+	if (io->size < LEN_Boot_Sector_Required)
+	{
+		quit("Disk image is too small to hold a boot sector.");
+	}
+
+	memory_state* state = calloc(1, sizeof(memory_state));
+	if (state == NULL)
+	{
+		quit("Out of memory while opening the disk.");
+	}
+	io->backend = state;
+
+	byte raw_boot[LEN_Boot_Sector_Required];
+	pread_all(io->fd, raw_boot, LEN_Boot_Sector_Required, 0);
+
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, raw_boot);
+	io->metadata_size = MIN((uint64_t)boot_calc.data_offset, io->size);
+	io->FAT_offset = MIN((uint64_t)boot_calc.FAT1_offset, io->metadata_size);
+
+	// Offset the units so each cluster of the data region falls in exactly one
+	state->unit = boot_calc.cluster_size ? boot_calc.cluster_size : IO_ALIGNMENT;
+	state->shift = (state->unit - io->metadata_size % state->unit) % state->unit;
+
+	state->units = (io->size + state->shift + state->unit - 1) / state->unit;
+	state->metadata_units = (io->metadata_size + state->shift) / state->unit;
+	state->dirty = calloc((state->units + DIRTY_BITS - 1) / DIRTY_BITS + 1, sizeof(uint64_t));
+
+	// Once loaded, our copy is written back over the image. A writer has to be the only
+	// one from before it loads, or it would undo commits made since.
+	if (io->writable)
+	{
+		disk_lock_writer(io);
+	}
+
+	// Loaded under the shared lock, so the copy holds one consistent state of the metadata.
+	// Taken before the image is allocated, there's no metadata buffer to refresh yet.
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+
+	state->allocated = (io->size + MEMORY_HUGE_PAGE - 1) & ~(uint64_t)(MEMORY_HUGE_PAGE - 1);
+	state->reserved = mmap(NULL, state->allocated + MEMORY_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (state->reserved == MAP_FAILED || state->dirty == NULL)
+	{
+		quit("Not enough memory to hold the disk, run without --in-memory.");
+	}
+	io->map = (byte*)(((uintptr_t)state->reserved + MEMORY_HUGE_PAGE - 1) & ~(uintptr_t)(MEMORY_HUGE_PAGE - 1));
+
+	// Fewer TLB misses and page faults, failure only costs speed
+	madvise(io->map, state->allocated, MADV_HUGEPAGE);
+
+	memory_load(io);
+	disk_unlock_metadata(io);
+
+	if (!io->writable)
+	{
+		mprotect(io->map, state->allocated, PROT_READ);
+	}
+}
+
+static void memory_dirty(disk_io* io, uint64_t offset, size_t length)
+{
+	memory_state* state = io->backend;
+	if (length == 0)
+	{
+		return;
+	}
+
+	uint64_t first = (offset + state->shift) / state->unit;
+	uint64_t last  = (offset + length - 1 + state->shift) / state->unit;
+
+	// A word at a time, several threads may be writing clusters that share one
+	for (uint64_t word = first / DIRTY_BITS; word <= last / DIRTY_BITS; ++word)
+	{
+		uint64_t low  = word == first / DIRTY_BITS ? first % DIRTY_BITS : 0;
+		uint64_t high = word == last / DIRTY_BITS ? last % DIRTY_BITS : DIRTY_BITS - 1;
+		uint64_t mask = (high == DIRTY_BITS - 1 ? ~(uint64_t)0 : (((uint64_t)1 << (high + 1)) - 1)) & ~(((uint64_t)1 << low) - 1);
+
+		if ((__atomic_load_n(&state->dirty[word], __ATOMIC_RELAXED) & mask) != mask)
+		{
+			__atomic_fetch_or(&state->dirty[word], mask, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void memory_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	memcpy(buffer, &io->map[offset], length);
+}
+
+static void memory_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	memcpy(&io->map[offset], buffer, length);
+	memory_dirty(io, offset, length);
+}
+
+/* MEMORY WRITE BACK
+ * Write the dirty units in a stretch of the image back to it, each run of adjacent ones in one go.
+ * @param disk_io*  : io - The disk in memory
+ * @param uint64_t  : first - First unit of the stretch
+ * @param uint64_t  : last - One past its last unit
+ * @returns uint64_t - Number of bytes written, on failure terminates with EXIT_FAILURE.
+ */
+static uint64_t memory_write_back(disk_io* io, uint64_t first, uint64_t last)
+{
+	memory_state* state = io->backend;
+	uint64_t written = 0;
+
+	uint64_t unit = first;
+	while (unit < last)
+	{
+		uint64_t* word = &state->dirty[unit / DIRTY_BITS];
+
+		// Skip clean words whole
+		if (*word == 0)
+		{
+			unit = (unit / DIRTY_BITS + 1) * DIRTY_BITS;
+			continue;
+		}
+		if ((*word & ((uint64_t)1 << (unit % DIRTY_BITS))) == 0)
+		{
+			++unit;
+			continue;
+		}
+
+		// Take in every dirty unit that follows
+		uint64_t end_unit = unit;
+		while (end_unit < last && (state->dirty[end_unit / DIRTY_BITS] & ((uint64_t)1 << (end_unit % DIRTY_BITS))) != 0)
+		{
+			state->dirty[end_unit / DIRTY_BITS] &= ~((uint64_t)1 << (end_unit % DIRTY_BITS));
+			++end_unit;
+		}
+
+		uint64_t start = unit * state->unit;
+		start = start > state->shift ? start - state->shift : 0;
+		uint64_t end = MIN(end_unit * state->unit - state->shift, io->size);
+
+		pwrite_all(io->fd, &io->map[start], end - start, start);
+		written += end - start;
+		unit = end_unit;
+	}
+
+	return written;
+}
+
+static bool memory_any_dirty(memory_state* state, uint64_t first, uint64_t last)
+{
+	for (uint64_t unit = first; unit < last; ++unit)
+	{
+		if ((state->dirty[unit / DIRTY_BITS] & ((uint64_t)1 << (unit % DIRTY_BITS))) != 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void memory_sync(disk_io* io)
+{
+	memory_state* state = io->backend;
+	if (!io->writable)
+	{
+		return;
+	}
+
+	TRACE_BEGIN(span);
+
+	// Data first, then the metadata that refers to it. Tools that sync take their own locks.
+	uint64_t written = memory_write_back(io, state->metadata_units, state->units);
+	written += memory_write_back(io, 0, state->metadata_units);
+
+	if (fsync(io->fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	TRACE_END(span, "write back", "bytes", written);
+}
+
+static void memory_close(disk_io* io)
+{
+	memory_state* state = io->backend;
+
+	if (io->writable)
+	{
+		TRACE_BEGIN(span);
+
+		uint64_t written = memory_write_back(io, state->metadata_units, state->units);
+
+		// The tool has let go of its locks by now, readers are kept out while the metadata lands
+		if (memory_any_dirty(state, 0, state->metadata_units))
+		{
+			// The data it refers to has to reach the disk before it does
+			if (written > 0 && fsync(io->fd) != 0)
+			{
+				char* err = strerror(errno);
+				quit(err);
+			}
+
+			disk_lock_metadata(io, DISK_LOCK_EXCLUSIVE);
+			written += memory_write_back(io, 0, state->metadata_units);
+			disk_unlock_metadata(io);
+		}
+
+		// Then the metadata, or the data alone when that's all that changed
+		if (written > 0 && fsync(io->fd) != 0)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+
+		TRACE_END(span, "write back", "bytes", written);
+	}
+
+	munmap(state->reserved, state->allocated + MEMORY_HUGE_PAGE);
+	free(state->dirty);
+	free(state);
+	io->backend = NULL;
+
+	close(io->fd);
+}
+
+const struct disk_io_ops memory_ops =
+{
+	.name  = "memory",
+	.open  = memory_open,
+	.read  = memory_read,
+	.write = memory_write,
+	.sync  = memory_sync,
+	.close = memory_close,
+
+	.dirty = memory_dirty,
+};
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "overlay.h"
+
+#include "SFS.h"
+
+// Overlay backend. The base image is mapped read-only and private, and is never
+// written. Blocks a tool writes are copied into the overlay file the first time
+// they're touched, and from then on read from there. Opening an overlay only maps
+// its header and index, which are faulted in as blocks are looked up, so starting
+// a tool costs the same whatever the size of the image.
+
+typedef struct
+{
+	int base_fd;
+	byte* base;
+	uint32_t block_size;
+
+	// Header and index are NULL for a read-only tool whose overlay doesn't exist yet
+	overlay_file overlay;
+
+	pthread_mutex_t lock;
+} overlay_state;
+
+uint32_t overlay_block_size(const byte* boot)
+{
+	boot_sector sector;
+	for (int i = 0; i < LEN_Boot_Sector_Required; ++i)
+	{
+		sector.raw[i].value = boot[i].value;
+	}
+
+	// A sector, as long as the boot sector's idea of one is sane
+	uint32_t size = sector.data.Bytes_Per_Sector.value;
+	if (size < 512 || size > IO_ALIGNMENT || (size & (size - 1)) != 0)
+	{
+		size = 512;
+	}
+	return size;
+}
+
+static void overlay_stamp(overlay_file* overlay, int base_fd)
+{
+	struct stat base_stat;
+	if (fstat(base_fd, &base_stat) == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	overlay->header->base_size = base_stat.st_size;
+	overlay->header->base_mtime_sec = base_stat.st_mtim.tv_sec;
+	overlay->header->base_mtime_nsec = base_stat.st_mtim.tv_nsec;
+}
+
+/* OVERLAY OPEN
+ * Open an overlay file and map its header and index, creating an empty one if asked to.
+ * @param overlay_file* : overlay - Receives the opened overlay, release with overlay_close()
+ * @param const char*   : path - Location of the overlay file
+ * @param bool          : create - Open it writable, creating it when it doesn't exist
+ * @param int           : base_fd - The base image the overlay sits on
+ * @param uint64_t      : base_size - Size of the base image
+ * @param uint32_t      : block_size - Granularity blocks are copied into the overlay at
+ * @returns bool - false when the overlay doesn't exist and @param(create) isn't set.
+ *               - Terminates with EXIT_FAILURE if it isn't an overlay of this base image.
+ */
+bool overlay_open(overlay_file* overlay, const char* path, bool create, int base_fd, uint64_t base_size, uint32_t block_size)
+{
+	memset(overlay, 0, sizeof(overlay_file));
+
+	overlay->fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (overlay->fd == -1 && errno == ENOENT && !create)
+	{
+		return false;
+	}
+	if (overlay->fd == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	uint64_t num_blocks = (base_size + block_size - 1) / block_size;
+	uint64_t data_offset = (OVERLAY_HEADER_SIZE + num_blocks * sizeof(uint32_t) + IO_ALIGNMENT - 1) & ~(uint64_t)(IO_ALIGNMENT - 1);
+
+	struct stat overlay_stat;
+	if (fstat(overlay->fd, &overlay_stat) == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	// A new overlay is all holes, nothing is written until a block is
+	bool fresh = overlay_stat.st_size == 0;
+	if (fresh && ftruncate(overlay->fd, data_offset) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+	if (!fresh && (uint64_t)overlay_stat.st_size < data_offset)
+	{
+		quit("Overlay is truncated, or belongs to a different base image.");
+	}
+
+	overlay->mapped = data_offset;
+	overlay->header = mmap(NULL, overlay->mapped, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, overlay->fd, 0);
+	if (overlay->header == MAP_FAILED)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+	overlay->index = (uint32_t*)((byte*)overlay->header + OVERLAY_HEADER_SIZE);
+
+	if (fresh)
+	{
+		memcpy(overlay->header->magic, OVERLAY_MAGIC, LEN_Overlay_Magic);
+		overlay->header->version = OVERLAY_VERSION;
+		overlay->header->block_size = block_size;
+		overlay->header->num_blocks = num_blocks;
+		overlay->header->data_offset = data_offset;
+		overlay->header->used_slots = 0;
+		overlay_stamp(overlay, base_fd);
+		return true;
+	}
+
+	struct stat base_stat;
+	if (fstat(base_fd, &base_stat) == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	if (memcmp(overlay->header->magic, OVERLAY_MAGIC, LEN_Overlay_Magic) != 0 || overlay->header->version != OVERLAY_VERSION)
+	{
+		quit("File is not an overlay, or was made by an incompatible version.");
+	}
+
+	if (overlay->header->block_size != block_size ||
+		overlay->header->num_blocks != num_blocks ||
+		overlay->header->data_offset != data_offset ||
+		overlay->header->base_size != (uint64_t)base_stat.st_size)
+	{
+		quit("Overlay was started from a different base image, or the base has changed since.");
+	}
+
+	// A commit that stopped part way has already changed the base, the overlay still
+	// holds every block it had, so committing it again finishes the job
+	if (!overlay->header->committing &&
+		(overlay->header->base_mtime_sec != base_stat.st_mtim.tv_sec ||
+		 overlay->header->base_mtime_nsec != base_stat.st_mtim.tv_nsec))
+	{
+		quit("Overlay was started from a different base image, or the base has changed since.");
+	}
+
+	return true;
+}
+
+/* OVERLAY BEGIN COMMIT
+ * Mark an overlay as being folded into its base, before the base is written.
+ * @param overlay_file* : overlay - An overlay opened writable
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void overlay_begin_commit(overlay_file* overlay)
+{
+	overlay->header->committing = 1;
+
+	if (msync(overlay->header, overlay->mapped, MS_SYNC) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+/* OVERLAY RESET
+ * Empty an overlay, after its blocks have been folded into the base image.
+ * @param overlay_file* : overlay - An overlay opened writable
+ * @param int           : base_fd - The base image, whose current state the overlay now starts from
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+void overlay_reset(overlay_file* overlay, int base_fd)
+{
+	// Punching the index and data back into holes zeroes them
+	if (ftruncate(overlay->fd, OVERLAY_HEADER_SIZE) != 0 ||
+		ftruncate(overlay->fd, overlay->header->data_offset) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	overlay->header->used_slots = 0;
+	overlay->header->committing = 0;
+	overlay_stamp(overlay, base_fd);
+
+	if (msync(overlay->header, overlay->mapped, MS_SYNC) != 0 || fsync(overlay->fd) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+void overlay_close(overlay_file* overlay)
+{
+	if (overlay->header != NULL)
+	{
+		munmap(overlay->header, overlay->mapped);
+	}
+	if (overlay->fd != -1)
+	{
+		close(overlay->fd);
+	}
+}
+
+static void overlay_backend_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	overlay_state* state = calloc(1, sizeof(overlay_state));
+	if (state == NULL)
+	{
+		quit("Out of memory while opening the disk.");
+	}
+	io->backend = state;
+
+	// The base is only ever read, whatever the tool means to do
+	state->base_fd = open(path, O_RDONLY);
+	if (state->base_fd == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	struct stat base_stat;
+	if (fstat(state->base_fd, &base_stat) == -1)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+	io->size = base_stat.st_size;
+
+	if (io->size < LEN_Boot_Sector_Required)
+	{
+		quit("Disk image is too small to hold a boot sector.");
+	}
+
+	state->base = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, state->base_fd, 0);
+	if (state->base == MAP_FAILED)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+
+	state->block_size = overlay_block_size(state->base);
+	pthread_mutex_init(&state->lock, NULL);
+
+	// Locks go on the overlay, it's what tools sharing it need to agree on.
+	// Without one there's nothing to write, so nothing to agree on either.
+	if (overlay_open(&state->overlay, options->overlay, io->writable, state->base_fd, io->size, state->block_size))
+		io->fd = state->overlay.fd;
+	else
+		io->fd = state->base_fd;
+
+	// Half of it may be in the base already, it's only safe to use once the commit is done
+	if (state->overlay.header != NULL && state->overlay.header->committing)
+	{
+		quit("Overlay is being committed, or a commit of it stopped part way, run diskcommit again to finish it.");
+	}
+}
+
+static inline uint32_t overlay_entry(const overlay_state* state, uint64_t block)
+{
+	return state->overlay.index != NULL ? __atomic_load_n(&state->overlay.index[block], __ATOMIC_ACQUIRE) : 0;
+}
+
+static void overlay_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	overlay_state* state = io->backend;
+	uint32_t block_size = state->block_size;
+	byte* out = buffer;
+
+	// Blocks in consecutive overlay slots are read with one pread
+	byte* run_out = NULL;
+	uint64_t run_position = 0;
+	size_t run_length = 0;
+
+	while (length > 0)
+	{
+		uint64_t block = offset / block_size;
+		uint32_t within = offset % block_size;
+		size_t span = MIN((uint64_t)length, (uint64_t)(block_size - within));
+		uint32_t entry = overlay_entry(state, block);
+
+		if (entry == 0)
+		{
+			memcpy(out, &state->base[offset], span);
+		}
+		else
+		{
+			uint64_t position = state->overlay.header->data_offset + (uint64_t)(entry - 1) * block_size + within;
+			if (run_length > 0 && run_position + run_length == position && run_out + run_length == out)
+			{
+				run_length += span;
+			}
+			else
+			{
+				if (run_length > 0)
+				{
+					pread_all(state->overlay.fd, run_out, run_length, run_position);
+				}
+				run_out = out;
+				run_position = position;
+				run_length = span;
+			}
+		}
+
+		out += span;
+		offset += span;
+		length -= span;
+	}
+
+	if (run_length > 0)
+	{
+		pread_all(state->overlay.fd, run_out, run_length, run_position);
+	}
+}
+
+// The slot holding @block, allocating one when it's first written. A block only
+// partly covered by the write starts out as a copy of the base. A new slot isn't
+// entered in the index here, the caller publishes it once the block's data is in it.
+static uint64_t overlay_slot(disk_io* io, overlay_state* state, uint64_t block, bool whole)
+{
+	uint32_t entry = state->overlay.index[block];
+	if (entry != 0)
+	{
+		return entry - 1;
+	}
+
+	overlay_header* header = state->overlay.header;
+	if (header->used_slots >= UINT32_MAX)
+	{
+		quit("Overlay is full.");
+	}
+
+	uint64_t slot = header->used_slots++;
+	if (!whole)
+	{
+		uint64_t start = block * state->block_size;
+		pwrite_all(state->overlay.fd, &state->base[start], MIN((uint64_t)state->block_size, io->size - start),
+				   header->data_offset + slot * state->block_size);
+	}
+
+	return slot;
+}
+
+static void overlay_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	overlay_state* state = io->backend;
+	uint32_t block_size = state->block_size;
+	const byte* in = buffer;
+
+	// Writers already hold the image's writer lock, this covers threads within one tool
+	pthread_mutex_lock(&state->lock);
+
+	// Blocks new to the overlay get consecutive slots from here on, in block order
+	uint64_t first_block = offset / block_size;
+	uint64_t end_block = length > 0 ? (offset + length - 1) / block_size + 1 : first_block;
+	uint64_t first_slot = state->overlay.header->used_slots;
+
+	const byte* run_in = NULL;
+	uint64_t run_position = 0;
+	size_t run_length = 0;
+
+	while (length > 0)
+	{
+		uint64_t block = offset / block_size;
+		uint32_t within = offset % block_size;
+		size_t span = MIN((uint64_t)length, (uint64_t)(block_size - within));
+
+		// The image's last block may be short
+		bool whole = within == 0 && (span == block_size || offset + span == io->size);
+		uint64_t position = state->overlay.header->data_offset + overlay_slot(io, state, block, whole) * block_size + within;
+
+		if (run_length > 0 && run_position + run_length == position)
+		{
+			run_length += span;
+		}
+		else
+		{
+			if (run_length > 0)
+			{
+				pwrite_all(state->overlay.fd, run_in, run_length, run_position);
+			}
+			run_in = in;
+			run_position = position;
+			run_length = span;
+		}
+
+		in += span;
+		offset += span;
+		length -= span;
+	}
+
+	if (run_length > 0)
+	{
+		pwrite_all(state->overlay.fd, run_in, run_length, run_position);
+	}
+
+	// Only with their data written are the new blocks entered in the index. A crash
+	// before this leaves them reading from the base, never from an unwritten slot.
+	for (uint64_t block = first_block; block < end_block; ++block)
+	{
+		if (state->overlay.index[block] == 0)
+		{
+			__atomic_store_n(&state->overlay.index[block], (uint32_t)(++first_slot), __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void overlay_sync(disk_io* io)
+{
+	overlay_state* state = io->backend;
+	if (state->overlay.header == NULL)
+	{
+		return;
+	}
+
+	if (fsync(state->overlay.fd) != 0 || msync(state->overlay.header, state->overlay.mapped, MS_SYNC) != 0)
+	{
+		char* err = strerror(errno);
+		quit(err);
+	}
+}
+
+static void overlay_prefetch(disk_io* io, const disk_range* ranges, size_t count)
+{
+	overlay_state* state = io->backend;
+
+	// Only the base is worth hinting, the overlay holds a handful of blocks
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint64_t start = ranges[i].offset & ~(uint64_t)(IO_ALIGNMENT - 1);
+		uint64_t end = MIN(ranges[i].offset + ranges[i].length, io->size);
+		if (end > start)
+		{
+			madvise(&state->base[start], end - start, MADV_WILLNEED);
+		}
+	}
+}
+
+static void overlay_backend_close(disk_io* io)
+{
+	overlay_state* state = io->backend;
+
+	overlay_close(&state->overlay);
+	munmap(state->base, io->size);
+	close(state->base_fd);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+const struct disk_io_ops overlay_ops =
+{
+	.name  = "overlay",
+	.open  = overlay_backend_open,
+	.read  = overlay_read,
+	.write = overlay_write,
+	.sync  = overlay_sync,
+	.close = overlay_backend_close,
+
+	.prefetch = overlay_prefetch,
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packed_types.h"
+
+#include "SFS.h"
+
+#define OVERLAY_MAGIC       "SFSOVLY1"
+#define LEN_Overlay_Magic   8
+#define OVERLAY_VERSION     1
+
+// The header gets a page to itself, the block index follows it
+#define OVERLAY_HEADER_SIZE 4096
+
+// Start of an overlay file. Blocks are the base image's sectors, so every FAT, directory
+// and cluster write lands on whole blocks. Block b of the image lives in slot index[b] - 1
+// of the data area, or in the base image when its index entry is 0.
+typedef struct
+{
+	char     magic[LEN_Overlay_Magic];
+	uint32_t version;
+	uint32_t block_size;
+
+	// The base image the overlay was started from, it's stale once the base changes
+	uint64_t base_size;
+	int64_t  base_mtime_sec;
+	int64_t  base_mtime_nsec;
+
+	uint64_t num_blocks;
+	uint64_t data_offset;
+	uint64_t used_slots;
+
+	// Set while diskcommit folds the overlay into the base. The base changes under it
+	// then, so it's let back in as it is until a commit gets through and empties it.
+	uint32_t committing;
+	uint32_t _reserved;
+} overlay_header;
+
+// An overlay file, with its header and index mapped shared
+typedef struct
+{
+	int fd;
+	overlay_header* header;
+	uint32_t* index;
+	size_t mapped;
+} overlay_file;
+
+bool overlay_open(overlay_file* overlay, const char* path, bool create, int base_fd, uint64_t base_size, uint32_t block_size);
+
+void overlay_begin_commit(overlay_file* overlay);
+
+void overlay_reset(overlay_file* overlay, int base_fd);
+
+void overlay_close(overlay_file* overlay);
+
+uint32_t overlay_block_size(const byte* boot);
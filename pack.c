@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "disk_io.h"
+#include "pack.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "trace.h"
+
+#include "SFS.h"
+
+// Packed image backend. Only the header is read on open, the index is mapped and
+// faulted in as chunks are looked up. Chunks are decoded the first time a read
+// reaches them and kept in a small cache, least recently used going first, so a
+// tool that only looks at the metadata decodes the first few chunks and no more.
+
+// A decoded chunk
+typedef struct
+{
+	uint64_t chunk;
+	byte* data;
+	uint64_t last_used;
+} pack_slot;
+
+typedef struct
+{
+	pack_header header;
+
+	const pack_chunk* index;
+	void* index_map;
+	size_t index_mapped;
+
+	pack_slot slots[PACK_CACHE_CHUNKS];
+	uint64_t clock;
+	pthread_mutex_t lock;
+} pack_state;
+
+/* PACK DETECT
+ * Whether a file is a packed image, going by its magic.
+ * @param const char* : path - Location of the file
+ * @returns bool - false for anything else, including files that can't be read.
+ */
+bool pack_detect(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	char magic[LEN_Pack_Magic];
+	bool packed = pread(fd, magic, LEN_Pack_Magic, 0) == LEN_Pack_Magic && memcmp(magic, PACK_MAGIC, LEN_Pack_Magic) == 0;
+
+	close(fd);
+	return packed;
+}
+
+static void pack_open(disk_io* io, const char* path, const sfs_options* options)
+{
+	if (io->writable)
+	{
+		quit("Packed images are read-only, unpack it with diskunpack to change it.");
+	}
+
+	disk_open_fd(io, path, 0);
+	uint64_t file_size = io->size;
+
+	pack_state* state = calloc(1, sizeof(pack_state));
+	if (state == NULL)
+	{
+		quit("Out of memory while opening the disk.");
+	}
+
+	if (file_size < sizeof(pack_header))
+	{
+		quit("Packed image is too small to hold its header.");
+	}
+	pread_all(io->fd, &state->header, sizeof(pack_header), 0);
+
+	const pack_header* header = &state->header;
+	uint32_t chunk_size = header->chunk_size;
+	if (memcmp(header->magic, PACK_MAGIC, LEN_Pack_Magic) != 0 || header->version != PACK_VERSION ||
+		chunk_size < PACK_MIN_CHUNK || chunk_size > PACK_MAX_CHUNK || (chunk_size & (chunk_size - 1)) != 0 ||
+		header->num_chunks != (header->image_size + chunk_size - 1) / chunk_size ||
+		header->index_offset > file_size || header->num_chunks > (file_size - header->index_offset) / sizeof(pack_chunk))
+	{
+		quit("Packed image header is corrupt.");
+	}
+
+	// Map from the page the index starts in, mmap offsets have to be page aligned
+	uint64_t map_start = header->index_offset & ~(uint64_t)(IO_ALIGNMENT - 1);
+	state->index_mapped = header->index_offset - map_start + header->num_chunks * sizeof(pack_chunk);
+	if (state->index_mapped > 0)
+	{
+		state->index_map = mmap(NULL, state->index_mapped, PROT_READ, MAP_SHARED, io->fd, map_start);
+		if (state->index_map == MAP_FAILED)
+		{
+			char* err = strerror(errno);
+			quit(err);
+		}
+		state->index = (const pack_chunk*)((const char*)state->index_map + (header->index_offset - map_start));
+	}
+
+	for (int i = 0; i < PACK_CACHE_CHUNKS; ++i)
+	{
+		state->slots[i].chunk = UINT64_MAX;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+
+	// From here on the tools see the image, not the pack
+	io->size = header->image_size;
+	io->backend = state;
+}
+
+/* PACK DECODE
+ * Read a chunk from the pack and decode it, checking it against its CRC.
+ * @param disk_io* : io - The packed image
+ * @param uint64_t : chunk - Which chunk
+ * @param byte*    : data - Receives the chunk, a whole chunk's worth of room
+ * @returns void - On failure terminates with EXIT_FAILURE.
+ */
+static void pack_decode(disk_io* io, uint64_t chunk, byte* data)
+{
+	pack_state* state = io->backend;
+	const pack_chunk* entry = &state->index[chunk];
+	uint32_t chunk_size = state->header.chunk_size;
+	size_t length = MIN((uint64_t)chunk_size, state->header.image_size - chunk * chunk_size);
+
+	TRACE_BEGIN(span);
+
+	switch (entry->encoding)
+	{
+		case PACK_ZERO:
+			{
+				memset(data, 0, length);
+				TRACE_END(span, "decode chunk", "chunk", chunk);
+				return;
+			}
+
+		case PACK_RAW:
+			{
+				if (entry->length != length)
+				{
+					quit("Packed image index is corrupt.");
+				}
+				pread_all(io->fd, data, length, entry->offset);
+			}
+			break;
+
+		case PACK_LZ:
+			{
+				// Chunks that don't shrink are stored raw, so none is longer than a chunk
+				if (entry->length > chunk_size)
+				{
+					quit("Packed image index is corrupt.");
+				}
+
+				byte* packed = malloc(entry->length ? entry->length : 1);
+				if (packed == NULL)
+				{
+					quit("Out of memory while decoding the disk.");
+				}
+
+				pread_all(io->fd, packed, entry->length, entry->offset);
+				bool decoded = lz_decompress(packed, entry->length, data, length);
+				free(packed);
+
+				if (!decoded)
+				{
+					quit("Packed image holds a corrupt chunk.");
+				}
+			}
+			break;
+
+		default:
+			quit("Packed image index is corrupt.");
+	}
+
+	if (crc32c_final(crc32c_update(crc32c_init(), data, length)) != entry->crc)
+	{
+		quit("Packed image holds a corrupt chunk.");
+	}
+
+	TRACE_END(span, "decode chunk", "chunk", chunk);
+}
+
+static pack_slot* pack_find(pack_state* state, uint64_t chunk)
+{
+	for (int i = 0; i < PACK_CACHE_CHUNKS; ++i)
+	{
+		if (state->slots[i].chunk == chunk)
+		{
+			return &state->slots[i];
+		}
+	}
+	return NULL;
+}
+
+static void pack_read(disk_io* io, void* buffer, size_t length, uint64_t offset)
+{
+	pack_state* state = io->backend;
+	uint32_t chunk_size = state->header.chunk_size;
+	byte* out = buffer;
+
+	// A chunk missing from the cache is decoded into here without holding the lock,
+	// then swapped with the buffer of the slot it replaces
+	byte* decoded = NULL;
+
+	while (length > 0)
+	{
+		uint64_t chunk = offset / chunk_size;
+		size_t within = offset % chunk_size;
+		size_t piece = MIN(length, (size_t)(chunk_size - within));
+
+		pthread_mutex_lock(&state->lock);
+		pack_slot* slot = pack_find(state, chunk);
+		if (slot == NULL && piece == chunk_size)
+		{
+			// A whole chunk is decoded straight into the caller's buffer. A tool streaming
+			// a file won't come back for it, so it isn't worth evicting anything for.
+			pthread_mutex_unlock(&state->lock);
+			pack_decode(io, chunk, out);
+
+			out    += piece;
+			offset += piece;
+			length -= piece;
+			continue;
+		}
+		if (slot == NULL)
+		{
+			pthread_mutex_unlock(&state->lock);
+
+			if (decoded == NULL && (decoded = malloc(chunk_size)) == NULL)
+			{
+				quit("Out of memory while decoding the disk.");
+			}
+			pack_decode(io, chunk, decoded);
+
+			pthread_mutex_lock(&state->lock);
+
+			// Another thread may have decoded it meanwhile
+			slot = pack_find(state, chunk);
+			if (slot == NULL)
+			{
+				slot = &state->slots[0];
+				for (int i = 1; i < PACK_CACHE_CHUNKS; ++i)
+				{
+					if (state->slots[i].last_used < slot->last_used)
+					{
+						slot = &state->slots[i];
+					}
+				}
+
+				byte* evicted = slot->data;
+				slot->data = decoded;
+				slot->chunk = chunk;
+				decoded = evicted;
+			}
+		}
+
+		slot->last_used = ++state->clock;
+		memcpy(out, &slot->data[within], piece);
+		pthread_mutex_unlock(&state->lock);
+
+		out    += piece;
+		offset += piece;
+		length -= piece;
+	}
+
+	free(decoded);
+}
+
+static void pack_write(disk_io* io, const void* buffer, size_t length, uint64_t offset)
+{
+	// pack_open() refuses to open one writable, so no tool gets here
+	quit("Packed images are read-only, unpack it with diskunpack to change it.");
+}
+
+static void pack_sync(disk_io* io)
+{
+}
+
+static void pack_close(disk_io* io)
+{
+	pack_state* state = io->backend;
+
+	for (int i = 0; i < PACK_CACHE_CHUNKS; ++i)
+	{
+		free(state->slots[i].data);
+	}
+	if (state->index_map != NULL)
+	{
+		munmap(state->index_map, state->index_mapped);
+	}
+
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+	io->backend = NULL;
+
+	close(io->fd);
+}
+
+const struct disk_io_ops pack_ops =
+{
+	.name  = "pack",
+	.open  = pack_open,
+	.read  = pack_read,
+	.write = pack_write,
+	.sync  = pack_sync,
+	.close = pack_close,
+};
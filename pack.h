@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "SFS.h"
+
+#define PACK_MAGIC        "SFSPACK1"
+#define LEN_Pack_Magic    8
+#define PACK_VERSION      1
+
+// Images are split into chunks of this size by default, each compressed on its own
+#define PACK_DEFAULT_CHUNK (64u << 10)
+#define PACK_MIN_CHUNK     4096
+#define PACK_MAX_CHUNK     (16u << 20)
+
+// Decoded chunks kept by a tool reading a packed image
+#define PACK_CACHE_CHUNKS 16
+
+// How a chunk is stored
+typedef enum
+{
+	// Every byte is zero, nothing is stored
+	PACK_ZERO = 0,
+	// Stored as is, it didn't compress
+	PACK_RAW  = 1,
+	// Compressed with lz.h
+	PACK_LZ   = 2
+} PACK_ENCODING;
+
+// A packed image starts with the header, the chunks follow and the index comes last.
+// The header is written once everything else is in place, so a pack that was cut
+// short is never mistaken for a whole one.
+#pragma pack(push, 1)
+typedef struct
+{
+	char     magic[LEN_Pack_Magic];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t image_size;
+	uint64_t num_chunks;
+	uint64_t index_offset;
+} pack_header;
+
+// One per chunk, in image order
+typedef struct
+{
+	uint64_t offset;
+	uint32_t length;
+	// CRC-32C of the decoded chunk
+	uint32_t crc;
+	uint8_t  encoding;
+	uint8_t  _reserved[7];
+} pack_chunk;
+#pragma pack(pop)
+
+bool pack_detect(const char* path);
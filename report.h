@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "FAT_view.h"
+#include "layout.h"
+
+#include "SFS.h"
+
+// What diskinfo reports about a disk, gathered while its metadata is locked and printed after.
+// diskinfo and diskinfo --scan both go through it, so one image reads the same either way.
+typedef struct
+{
+	boot_sector boot;
+	boot_extra boot_calc;
+
+	char label[LEN_Volume_Label + 1];
+	unsigned int num_files;
+	uint64_t free_space;
+
+	// Only mapped when the layout is asked for
+	bool has_layout;
+	disk_layout layout;
+} info_report;
+
+void info_report_gather(info_report* report, const byte* disk, const boot_sector* boot, const boot_extra* boot_calc, FAT_view* fat, bool layout);
+
+void info_report_print(FILE* out, const info_report* report, bool json);
+
+void info_report_free(info_report* report);
+
+// disklist's reports, shared with disklist --scan in the same way
+void list_report_files(FILE* out, const byte* disk, const boot_extra* boot_calc, FAT_view* fat, bool json);
+
+void list_report_layout(FILE* out, const disk_layout* layout, bool json);
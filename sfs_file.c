@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "directory_sector.h"
+#include "boot_sector.h"
+#include "disk_io.h"
+#include "FAT_view.h"
+#include "sfs_file.h"
+
+#include "SFS.h"
+
+// Most ranges handed to the backend per read
+#define SFS_READ_BATCH 256
+
+/* SFS OPEN
+ * Look a file up in the root directory and get it ready for sfs_pread().
+ * @param disk_io*    : io - An opened FAT12 disk image
+ * @param const char* : name - A case-insensitive filename in the root directory of @param(io)
+ * @returns sfs_file* - The opened file, release with sfs_close(). NULL with errno set to ENOENT
+ *                      when there's no such file. Terminates with EXIT_FAILURE if the disk isn't FAT12.
+ */
+sfs_file* sfs_open(disk_io* io, const char* name)
+{
+	boot_sector boot;
+	boot_extra boot_calc = initialize_boot(&boot, disk_metadata_range(io, 0, LEN_Boot_Sector_Required));
+
+	// Start by copying and null-terminating the string
+	char FS_type[LEN_File_System_Type + 1];
+	memcpy(&FS_type, boot.data.File_System_Type, LEN_File_System_Type);
+	FS_type[LEN_File_System_Type] = '\0';
+
+	if (strstr(FS_type, "FAT12") == NULL)
+	{
+		// Didn't find it...
+		quit("Disk doesn't list file system type as \"FAT12\"");
+	}
+
+	if (boot_calc.data_offset > io->size || boot_calc.cluster_size == 0)
+	{
+		quit("Disk geometry lies outside of the image.");
+	}
+
+	char filename[LEN_Filename + 1 + LEN_Extension + 1];
+	memset(&filename, '\0', sizeof(filename));
+
+	sfs_file* file = NULL;
+
+	disk_lock_metadata(io, DISK_LOCK_SHARED);
+
+	const byte* root = disk_metadata_range(io, boot_calc.root_offset, boot_calc.data_offset - boot_calc.root_offset);
+	for (uint64_t entry_offset = 0; boot_calc.root_offset + entry_offset < boot_calc.data_offset; entry_offset += sizeof(directory_entry))
+	{
+		directory_entry sector;
+		for (int i = 0; i < sizeof(directory_entry); ++i)
+		{
+			sector.raw[i].value = root[entry_offset + i].value;
+		}
+
+		// Same idea of what a file is as diskget
+		if (sector.raw[0].value == 0x0 ||
+			sector.raw[0].value == 0xE5 ||
+			(sector.data.Attributes.value & (VOL_LABEL | SYSTEM | SUBDIR | ARCHIVE)) != 0)
+		{
+			continue;
+		}
+
+		trim_filename(filename, sector.data.Filename, sector.data.Extension);
+		if (strcasecmp(filename, name) != 0)
+		{
+			continue;
+		}
+
+		file = calloc(1, sizeof(sfs_file));
+		if (file == NULL)
+		{
+			quit("Out of memory while opening a file.");
+		}
+
+		file->io = io;
+		file->boot_calc = boot_calc;
+		memcpy(file->name, filename, sizeof(file->name));
+		file->size = sector.data.File_Size.value;
+		file->next_cluster = sector.data.First_Logical_Cluster.value;
+		pthread_mutex_init(&file->lock, NULL);
+		break;
+	}
+
+	disk_unlock_metadata(io);
+
+	if (file == NULL)
+	{
+		errno = ENOENT;
+	}
+	return file;
+}
+
+void sfs_close(sfs_file* file)
+{
+	if (file == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_destroy(&file->lock);
+	free(file->extents);
+	free(file);
+}
+
+/* EXTEND INDEX
+ * Walk the chain on from where the index stops until it covers @param(end). Call with the file's lock held.
+ * @param sfs_file* : file - The file to index
+ * @param uint64_t  : end - Offset within the file the index needs to reach
+ * @returns void - Sets the file's damaged flag if the chain stops short, loops or leaves the image.
+ */
+static void extend_index(sfs_file* file, uint64_t end)
+{
+	if (file->indexed >= end || file->damaged)
+	{
+		return;
+	}
+
+	const boot_extra* calc = &file->boot_calc;
+	unsigned int clusters = (file->size + calc->cluster_size - 1) / calc->cluster_size;
+
+	// The chain may have been committed to since the last extension
+	disk_lock_metadata(file->io, DISK_LOCK_SHARED);
+
+	FAT_view fat;
+	FAT_view_init(&fat, file->io, calc, FAT_CACHED);
+
+	while (file->indexed < end)
+	{
+		unsigned int wanted = clusters - file->indexed / calc->cluster_size;
+
+		cluster_extent extent;
+		if (wanted == 0 || !FAT_next_extent(&fat, &file->next_cluster, wanted, &extent))
+		{
+			file->damaged = true;
+			break;
+		}
+
+		// A chain longer than the table has to be going round in circles
+		file->visited += extent.count;
+		uint64_t location = calc->data_offset + (uint64_t)(extent.cluster - 2) * calc->cluster_size;
+		if (file->visited > fat.FAT_size ||
+			location + (uint64_t)extent.count * calc->cluster_size > file->io->size)
+		{
+			file->damaged = true;
+			break;
+		}
+
+		if (file->num_extents == file->capacity)
+		{
+			file->capacity = file->capacity ? file->capacity * 2 : 16;
+			file->extents = realloc(file->extents, file->capacity * sizeof(file_extent));
+			if (file->extents == NULL)
+			{
+				quit("Out of memory while indexing a file.");
+			}
+		}
+
+		file_extent* entry = &file->extents[file->num_extents++];
+		entry->file_offset = file->indexed;
+		entry->cluster = extent.cluster;
+		entry->count = extent.count;
+
+		file->indexed += (uint64_t)extent.count * calc->cluster_size;
+	}
+
+	FAT_view_free(&fat);
+	disk_unlock_metadata(file->io);
+}
+
+// The last extent starting at or before @offset, the index has to cover it
+static unsigned int find_extent(const sfs_file* file, uint64_t offset)
+{
+	unsigned int low = 0;
+	unsigned int high = file->num_extents;
+
+	while (high - low > 1)
+	{
+		unsigned int middle = low + (high - low) / 2;
+		if (file->extents[middle].file_offset <= offset)
+			low = middle;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/* SFS PREAD
+ * Read part of a file without disturbing any other reader, like pread(2).
+ * Only the clusters holding the range are read, found through the file's extent index.
+ * @param sfs_file* : file - A file from sfs_open()
+ * @param void*     : buffer - Receives the data
+ * @param size_t    : length - How many bytes to read
+ * @param uint64_t  : offset - Where in the file to start
+ * @returns ssize_t - The number of bytes read, short at the end of the file and 0 past it.
+ *                    -1 with errno set to EIO when the file's cluster chain is damaged.
+ */
+ssize_t sfs_pread(sfs_file* file, void* buffer, size_t length, uint64_t offset)
+{
+	if (offset >= file->size)
+	{
+		return 0;
+	}
+
+	uint64_t end = MIN(offset + length, (uint64_t)file->size);
+	unsigned int cluster_size = file->boot_calc.cluster_size;
+	byte* out = buffer;
+	uint64_t position = offset;
+
+	while (position < end)
+	{
+		disk_range ranges[SFS_READ_BATCH];
+		size_t count = 0;
+		size_t total = 0;
+
+		pthread_mutex_lock(&file->lock);
+
+		extend_index(file, end);
+		uint64_t reachable = MIN(end, file->indexed);
+
+		for (unsigned int idx = position < reachable ? find_extent(file, position) : file->num_extents;
+			 idx < file->num_extents && position + total < reachable && count < SFS_READ_BATCH;
+			 ++idx)
+		{
+			const file_extent* extent = &file->extents[idx];
+			uint64_t within = position + total - extent->file_offset;
+			uint64_t span = MIN((uint64_t)extent->count * cluster_size - within, reachable - position - total);
+
+			ranges[count].offset = file->boot_calc.data_offset + (uint64_t)(extent->cluster - 2) * cluster_size + within;
+			ranges[count].length = span;
+			count += 1;
+			total += span;
+		}
+
+		pthread_mutex_unlock(&file->lock);
+
+		if (count == 0)
+		{
+			// The chain ran out before the range did
+			break;
+		}
+
+		disk_read_ranges(file->io, ranges, count, out);
+		out += total;
+		position += total;
+	}
+
+	if (position == offset && position < end)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	return position - offset;
+}
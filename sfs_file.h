@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "directory_sector.h"
+#include "disk_io.h"
+
+#include "SFS.h"
+
+// A run of contiguous clusters and where it sits within the file
+typedef struct
+{
+	uint64_t file_offset;
+	unsigned int cluster;
+	unsigned int count;
+} file_extent;
+
+// A file in the root directory, opened for random access reads.
+// Its extents are indexed as reads reach them, so a seek costs a binary
+// search rather than a walk down the chain from the first cluster.
+typedef struct
+{
+	disk_io* io;
+	boot_extra boot_calc;
+
+	char name[LEN_Filename + 1 + LEN_Extension + 1];
+	unsigned int size;
+
+	// The index, in file order, and how far along the file it reaches
+	file_extent* extents;
+	unsigned int num_extents;
+	unsigned int capacity;
+	uint64_t indexed;
+
+	// Where the chain walk carries on from, and how many clusters it has seen
+	unsigned int next_cluster;
+	unsigned int visited;
+	bool damaged;
+
+	// Extending the index is serialised, reads themselves aren't
+	pthread_mutex_t lock;
+} sfs_file;
+
+sfs_file* sfs_open(disk_io* io, const char* name);
+
+ssize_t sfs_pread(sfs_file* file, void* buffer, size_t length, uint64_t offset);
+
+void sfs_close(sfs_file* file);
@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "boot_sector.h"
+#include "directory_sector.h"
+#include "FAT_entry.h"
+#include "disk_io.h"
+#include "crc32c.h"
+#include "trace.h"
+#include "sfs_index.h"
+
+#include "SFS.h"
+
+// Metadata index, kept beside the image as <image>.sfsidx. It holds the FAT already
+// decoded, the free extents, the lowest free cluster and the root directory's names,
+// so a tool that has it mapped can skip decoding and scanning them. It's checked
+// against the image's size, mtime and a CRC of its FATs and root directory before
+// each use, and rebuilt from the image when any of them differ. Writers that keep it
+// up to date mark it invalid while they change it, and stamp it again on close.
+
+static size_t index_layout(uint32_t FAT_size, uint32_t max_extents, uint32_t max_names, size_t* extents_at, size_t* names_at)
+{
+	size_t table_at = sizeof(index_header);
+	*extents_at = (table_at + (size_t)FAT_size * sizeof(uint16_t) + 7) & ~(size_t)7;
+	*names_at = *extents_at + (size_t)max_extents * sizeof(index_extent);
+	return *names_at + (size_t)max_names * sizeof(index_name);
+}
+
+static void index_limits(const boot_extra* boot_calc, uint32_t* max_extents, uint32_t* max_names)
+{
+	// Free runs are separated by at least one cluster in use
+	*max_extents = boot_calc->FAT_size / 2 + 1;
+	*max_names = (boot_calc->data_offset - boot_calc->root_offset) / sizeof(directory_entry);
+}
+
+static char* index_path(const char* image_path)
+{
+	char* path = malloc(strlen(image_path) + sizeof(INDEX_SUFFIX));
+	if (path == NULL)
+	{
+		quit("Out of memory while opening the index.");
+	}
+	strcpy(path, image_path);
+	strcat(path, INDEX_SUFFIX);
+	return path;
+}
+
+static void index_unmap(sfs_index* index)
+{
+	munmap(index->header, index->mapped);
+	close(index->fd);
+	free(index);
+}
+
+/* INDEX MAP
+ * Map an index file shared, for reading and updating in place.
+ * @param int         : fd - The index file, its size already set
+ * @param size_t      : size - Size of the file
+ * @returns sfs_index* - The mapped index, NULL when it can't be mapped.
+ */
+static sfs_index* index_map(int fd, size_t size)
+{
+	sfs_index* index = calloc(1, sizeof(sfs_index));
+	if (index == NULL)
+	{
+		quit("Out of memory while opening the index.");
+	}
+
+	index->fd = fd;
+	index->mapped = size;
+	index->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (index->header == MAP_FAILED)
+	{
+		close(fd);
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+static void index_sections(sfs_index* index)
+{
+	size_t extents_at;
+	size_t names_at;
+	index_layout(index->header->FAT_size, index->header->max_extents, index->header->max_names, &extents_at, &names_at);
+
+	index->table = (uint16_t*)((byte*)index->header + sizeof(index_header));
+	index->extents = (index_extent*)((byte*)index->header + extents_at);
+	index->names = (index_name*)((byte*)index->header + names_at);
+}
+
+static uint32_t index_checksum(disk_io* io, const boot_extra* boot_calc)
+{
+	size_t length = boot_calc->data_offset - boot_calc->FAT1_offset;
+	const byte* region = disk_metadata_range(io, boot_calc->FAT1_offset, length);
+	return crc32c_final(crc32c_update(crc32c_init(), region, length));
+}
+
+static void index_stamp(sfs_index* index, const struct stat* image_stat)
+{
+	index->header->image_size = image_stat->st_size;
+	index->header->image_mtime_sec = image_stat->st_mtim.tv_sec;
+	index->header->image_mtime_nsec = image_stat->st_mtim.tv_nsec;
+}
+
+static bool index_is_file(const directory_entry* entry)
+{
+	// Every name a new file could clash with, as diskput sees them
+	return entry->raw[0].value != 0x0 &&
+		   entry->raw[0].value != 0xE5 &&
+		   (entry->data.Attributes.value & (VOL_LABEL | SYSTEM | ARCHIVE)) == 0;
+}
+
+static int index_name_compare(const void* a, const void* b)
+{
+	const index_name* left = a;
+	const index_name* right = b;
+
+	int order = strcasecmp(left->name, right->name);
+	return order != 0 ? order : (int)left->slot - (int)right->slot;
+}
+
+/* INDEX FILL
+ * Decode the image's metadata into a freshly mapped index.
+ * @param sfs_index*        : index - The index, its header sized for the image
+ * @param disk_io*          : io - The disk, its metadata locked
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ */
+static void index_fill(sfs_index* index, disk_io* io, const boot_extra* boot_calc)
+{
+	index_header* header = index->header;
+	const byte* disk = disk_metadata(io);
+
+	TRACE_BEGIN(span);
+
+	header->free_clusters = 0;
+	header->num_extents = 0;
+	for (unsigned int cluster = 0; cluster < boot_calc->FAT_size; ++cluster)
+	{
+		unsigned int entry = read_FAT_entry(disk, boot_calc->FAT1_offset, cluster);
+		index->table[cluster] = entry;
+
+		if (cluster < 2 || entry != 0)
+		{
+			continue;
+		}
+
+		header->free_clusters += 1;
+
+		// Extend the last run when this cluster follows it
+		index_extent* last = header->num_extents > 0 ? &index->extents[header->num_extents - 1] : NULL;
+		if (last != NULL && last->cluster + last->count == cluster)
+		{
+			last->count += 1;
+		}
+		else
+		{
+			index->extents[header->num_extents].cluster = cluster;
+			index->extents[header->num_extents].count = 1;
+			header->num_extents += 1;
+		}
+	}
+	header->next_free = header->num_extents > 0 ? index->extents[0].cluster : boot_calc->FAT_size;
+
+	header->num_names = 0;
+	for (uint32_t slot = 0; slot < header->max_names; ++slot)
+	{
+		directory_entry entry;
+		memcpy(&entry, &disk[boot_calc->root_offset + (uint64_t)slot * sizeof(directory_entry)], sizeof(directory_entry));
+
+		if (index_is_file(&entry))
+		{
+			index_name* name = &index->names[header->num_names++];
+			memset(name, 0, sizeof(index_name));
+			trim_filename(name->name, entry.data.Filename, entry.data.Extension);
+			name->subdir = (entry.data.Attributes.value & SUBDIR) != 0;
+			name->slot = slot;
+		}
+	}
+	qsort(index->names, header->num_names, sizeof(index_name), index_name_compare);
+
+	header->checksum = index_checksum(io, boot_calc);
+
+	TRACE_END(span, "build index", "entries", boot_calc->FAT_size);
+}
+
+/* INDEX BUILD
+ * Write a new index for the image beside it, replacing any there was.
+ * @param disk_io*          : io - The disk, its metadata locked
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @param const char*       : path - Where the index goes
+ * @returns sfs_index* - The new index, NULL when it couldn't be written.
+ */
+static sfs_index* index_build(disk_io* io, const boot_extra* boot_calc, const char* path)
+{
+	uint32_t max_extents;
+	uint32_t max_names;
+	index_limits(boot_calc, &max_extents, &max_names);
+
+	size_t extents_at;
+	size_t names_at;
+	size_t size = index_layout(boot_calc->FAT_size, max_extents, max_names, &extents_at, &names_at);
+
+	// Written under a temporary name and renamed over the old one, so a tool that
+	// has the old one mapped keeps a whole index, stale as it is
+	char* temp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (temp_path == NULL)
+	{
+		quit("Out of memory while building the index.");
+	}
+	strcpy(temp_path, path);
+	strcat(temp_path, ".XXXXXX");
+
+	struct stat image_stat;
+	int fd = mkstemp(temp_path);
+	if (fd == -1 || fchmod(fd, 0644) != 0 || ftruncate(fd, size) != 0 || fstat(io->fd, &image_stat) != 0)
+	{
+		fprintf(stderr, "Couldn't write the index, carrying on without it: %s\n", strerror(errno));
+		if (fd != -1)
+		{
+			close(fd);
+			unlink(temp_path);
+		}
+		free(temp_path);
+		return NULL;
+	}
+
+	sfs_index* index = index_map(fd, size);
+	if (index == NULL)
+	{
+		unlink(temp_path);
+		free(temp_path);
+		return NULL;
+	}
+
+	memcpy(index->header->magic, INDEX_MAGIC, LEN_Index_Magic);
+	index->header->version = INDEX_VERSION;
+	index->header->FAT_size = boot_calc->FAT_size;
+	index->header->max_extents = max_extents;
+	index->header->max_names = max_names;
+	index_sections(index);
+	index_fill(index, io, boot_calc);
+	index_stamp(index, &image_stat);
+
+	if (rename(temp_path, path) != 0)
+	{
+		fprintf(stderr, "Couldn't write the index, carrying on without it: %s\n", strerror(errno));
+		unlink(temp_path);
+		index_unmap(index);
+		index = NULL;
+	}
+
+	free(temp_path);
+	return index;
+}
+
+/* INDEX OPEN
+ * Map the index already beside the image, when there is one laid out for this geometry.
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @param const char*       : path - Location of the index
+ * @returns sfs_index* - The index, NULL when there isn't a usable one.
+ */
+static sfs_index* index_open(const boot_extra* boot_calc, const char* path)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	struct stat index_stat;
+	if (fd == -1 || fstat(fd, &index_stat) != 0 || (size_t)index_stat.st_size < sizeof(index_header))
+	{
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return NULL;
+	}
+
+	sfs_index* index = index_map(fd, index_stat.st_size);
+	if (index == NULL)
+	{
+		return NULL;
+	}
+
+	uint32_t max_extents;
+	uint32_t max_names;
+	index_limits(boot_calc, &max_extents, &max_names);
+
+	size_t extents_at;
+	size_t names_at;
+	const index_header* header = index->header;
+	if (memcmp(header->magic, INDEX_MAGIC, LEN_Index_Magic) != 0 || header->version != INDEX_VERSION ||
+		header->FAT_size != boot_calc->FAT_size || header->max_extents != max_extents || header->max_names != max_names ||
+		index_layout(header->FAT_size, max_extents, max_names, &extents_at, &names_at) != (size_t)index_stat.st_size ||
+		header->num_extents > max_extents || header->num_names > max_names)
+	{
+		index_unmap(index);
+		return NULL;
+	}
+
+	index_sections(index);
+	return index;
+}
+
+static bool index_valid(const sfs_index* index, disk_io* io, const boot_extra* boot_calc)
+{
+	struct stat image_stat;
+	if (fstat(io->fd, &image_stat) != 0)
+	{
+		return false;
+	}
+
+	// Size and mtime first, the checksum catches changes made within one tick of the clock
+	const index_header* header = index->header;
+	return header->image_size == (uint64_t)image_stat.st_size &&
+		   header->image_mtime_sec == image_stat.st_mtim.tv_sec &&
+		   header->image_mtime_nsec == image_stat.st_mtim.tv_nsec &&
+		   header->checksum == index_checksum(io, boot_calc);
+}
+
+/* DISK INDEX
+ * Get at the image's metadata index, when the tool was asked to use one. An index that's
+ * missing or out of date is rebuilt from the image and written beside it.
+ * @param disk_io*          : io - The disk, with its metadata locked or the writer lock held
+ * @param const boot_extra* : boot_calc - Geometry of the disk
+ * @returns sfs_index* - The index, valid until the metadata is unlocked.
+ *                     - NULL without --index, or when the index can't be written.
+ */
+sfs_index* disk_index(disk_io* io, const boot_extra* boot_calc)
+{
+	if (!io->use_index || boot_calc->FAT_size == 0 || boot_calc->data_offset > io->metadata_size ||
+		boot_calc->FAT1_offset > boot_calc->root_offset || boot_calc->root_offset > boot_calc->data_offset)
+	{
+		return NULL;
+	}
+
+	char* path = index_path(io->path);
+
+	if (io->index == NULL)
+	{
+		io->index = index_open(boot_calc, path);
+	}
+
+	TRACE_BEGIN(span);
+	if (io->index != NULL && !index_valid(io->index, io, boot_calc))
+	{
+		index_unmap(io->index);
+		io->index = NULL;
+	}
+	TRACE_END(span, "check index", "valid", io->index != NULL);
+
+	if (io->index == NULL)
+	{
+		io->index = index_build(io, boot_calc, path);
+
+		// Don't try again on every lookup
+		io->use_index = io->index != NULL;
+	}
+
+	free(path);
+	return io->index;
+}
+
+/* INDEX CLOSE
+ * Let go of the disk's index. One this tool changed is stamped with the image's size and
+ * mtime as they are now, after the backend has written everything back.
+ * @param disk_io* : io - The disk, already closed by its backend
+ */
+void index_close(disk_io* io)
+{
+	sfs_index* index = io->index;
+	if (index == NULL)
+	{
+		return;
+	}
+
+	struct stat image_stat;
+	if (index->changed && stat(io->path, &image_stat) == 0)
+	{
+		index_stamp(index, &image_stat);
+	}
+
+	index_unmap(index);
+	io->index = NULL;
+}
+
+/* INDEX FIND
+ * Look up a file in the root directory by name, ignoring case.
+ * @param const sfs_index* : index - The disk's index
+ * @param const char*      : name - Name of the file
+ * @param bool             : files_only - Pass over subdirectories of that name, as a scan that skips them would
+ * @param unsigned int*    : slot - Receives the position of its directory entry
+ * @returns bool - false when there's no file of that name.
+ */
+bool index_find(const sfs_index* index, const char* name, bool files_only, unsigned int* slot)
+{
+	// Lowest slot of the names that match, that's the one a scan of the directory finds first
+	uint32_t low = 0;
+	uint32_t high = index->header->num_names;
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		if (strcasecmp(index->names[middle].name, name) < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	// Names that match are in slot order, take the first one that's wanted
+	for (; low < index->header->num_names && strcasecmp(index->names[low].name, name) == 0; ++low)
+	{
+		if (!files_only || !index->names[low].subdir)
+		{
+			*slot = index->names[low].slot;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void index_take(sfs_index* index, unsigned int cluster)
+{
+	index_header* header = index->header;
+
+	// Last run starting at or before the cluster
+	uint32_t low = 0;
+	uint32_t high = header->num_extents;
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		if (index->extents[middle].cluster <= cluster)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if (low == 0)
+	{
+		return;
+	}
+
+	uint32_t position = low - 1;
+	index_extent* run = &index->extents[position];
+	if (cluster >= run->cluster + run->count)
+	{
+		return;
+	}
+
+	header->free_clusters -= 1;
+
+	if (run->count == 1)
+	{
+		memmove(run, run + 1, (header->num_extents - position - 1) * sizeof(index_extent));
+		header->num_extents -= 1;
+	}
+	else if (cluster == run->cluster)
+	{
+		run->cluster += 1;
+		run->count -= 1;
+	}
+	else if (cluster == run->cluster + run->count - 1)
+	{
+		run->count -= 1;
+	}
+	else if (header->num_extents < header->max_extents)
+	{
+		// Split around the cluster
+		memmove(run + 2, run + 1, (header->num_extents - position - 1) * sizeof(index_extent));
+		run[1].cluster = cluster + 1;
+		run[1].count = run->cluster + run->count - cluster - 1;
+		run->count = cluster - run->cluster;
+		header->num_extents += 1;
+	}
+}
+
+/* INDEX ADD FILE
+ * Bring the index up to date with a file just committed to the image: its clusters leave
+ * the free extents, the FAT entries along its chain are copied in and its name is added.
+ * @param disk_io*                : io - The disk, with the new metadata committed and locked exclusively
+ * @param sfs_index*              : index - The index from disk_index()
+ * @param const boot_extra*       : boot_calc - Geometry of the disk
+ * @param const directory_entry*  : entry - The new file's directory entry
+ * @param unsigned int            : slot - Position of the entry in the root directory
+ */
+void index_add_file(disk_io* io, sfs_index* index, const boot_extra* boot_calc, const directory_entry* entry, unsigned int slot)
+{
+	index_header* header = index->header;
+	const byte* disk = disk_metadata(io);
+
+	// Readers rebuild rather than trust it until it's stamped on close
+	header->image_mtime_sec = -1;
+	index->changed = true;
+
+	unsigned int steps = 0;
+	for (unsigned int cluster = entry->data.First_Logical_Cluster.value;
+		 cluster >= 2 && cluster < boot_calc->FAT_size && steps < boot_calc->FAT_size;
+		 cluster = index->table[cluster], ++steps)
+	{
+		index->table[cluster] = read_FAT_entry(disk, boot_calc->FAT1_offset, cluster);
+		index_take(index, cluster);
+	}
+	header->next_free = header->num_extents > 0 ? index->extents[0].cluster : boot_calc->FAT_size;
+
+	if (header->num_names < header->max_names)
+	{
+		index_name name;
+		memset(&name, 0, sizeof(index_name));
+		directory_entry copy = *entry;
+		trim_filename(name.name, copy.data.Filename, copy.data.Extension);
+		name.subdir = (copy.data.Attributes.value & SUBDIR) != 0;
+		name.slot = slot;
+
+		uint32_t position = 0;
+		while (position < header->num_names && index_name_compare(&index->names[position], &name) < 0)
+		{
+			++position;
+		}
+		memmove(&index->names[position + 1], &index->names[position], (header->num_names - position) * sizeof(index_name));
+		index->names[position] = name;
+		header->num_names += 1;
+	}
+
+	header->checksum = index_checksum(io, boot_calc);
+}
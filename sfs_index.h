@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packed_types.h"
+#include "boot_sector.h"
+#include "directory_sector.h"
+#include "disk_io.h"
+
+#include "SFS.h"
+
+#define INDEX_MAGIC       "SFSIDX01"
+#define LEN_Index_Magic   8
+#define INDEX_VERSION     2
+
+// Appended to the image's path to name its index
+#define INDEX_SUFFIX      ".sfsidx"
+
+// Start of an index file. The decoded FAT follows it, then the free extents in cluster
+// order, then the names in the root directory sorted case-insensitively. Each section
+// is sized for the most it could ever hold, so writers update it in place.
+typedef struct
+{
+	char     magic[LEN_Index_Magic];
+	uint32_t version;
+	uint32_t FAT_size;
+
+	// The image the index describes. It only holds while all of these match.
+	uint64_t image_size;
+	int64_t  image_mtime_sec;
+	int64_t  image_mtime_nsec;
+	// CRC-32C of the FATs and root directory
+	uint32_t checksum;
+
+	uint32_t free_clusters;
+	// Lowest free cluster, FAT_size when there's none
+	uint32_t next_free;
+
+	uint32_t num_extents;
+	uint32_t max_extents;
+	uint32_t num_names;
+	uint32_t max_names;
+	uint32_t _reserved;
+} index_header;
+
+// A run of free clusters
+typedef struct
+{
+	uint32_t cluster;
+	uint32_t count;
+} index_extent;
+
+// A root directory entry that holds a file or a subdirectory, by name
+typedef struct
+{
+	char     name[LEN_Filename + 1 + LEN_Extension + 1];
+	// Set for a subdirectory, which diskput's names clash with but diskget never retrieves
+	uint8_t  subdir;
+	// Position of the entry in the root directory
+	uint16_t slot;
+} index_name;
+
+// An index file, mapped shared
+struct sfs_index
+{
+	int fd;
+	index_header* header;
+	uint16_t* table;
+	index_extent* extents;
+	index_name* names;
+	size_t mapped;
+
+	// Set once this tool has changed the index, it's stamped with the image's mtime on close
+	bool changed;
+};
+
+sfs_index* disk_index(disk_io* io, const boot_extra* boot_calc);
+
+void index_close(disk_io* io);
+
+bool index_find(const sfs_index* index, const char* name, bool files_only, unsigned int* slot);
+
+void index_add_file(disk_io* io, sfs_index* index, const boot_extra* boot_calc, const directory_entry* entry, unsigned int slot);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "SFS.h"
+
+// Streams are read and written in blocks of this size, headers take one each
+#define TAR_BLOCK_SIZE 512
+
+#define TAR_MAGIC     "ustar"
+#define TAR_VERSION   "00"
+
+// Member types, anything else is skipped on import
+#define TAR_REGULAR      '0'
+#define TAR_REGULAR_OLD  '\0'
+#define TAR_DIRECTORY    '5'
+
+// A POSIX ustar header, numbers are NUL or space terminated octal text
+#pragma pack(push, 1)
+typedef struct
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} tar_header;
+#pragma pack(pop)
+
+/* TAR PARSE NUMBER
+ * Read a numeric header field, octal text or, as GNU tar writes values too large
+ * for it, big-endian binary flagged by the top bit of the first byte.
+ * @param const char* : field - The field
+ * @param size_t      : length - Its size in the header
+ * @param uint64_t*   : value - Receives the number
+ * @returns bool - false when the field holds neither form.
+ */
+static inline bool tar_parse_number(const char* field, size_t length, uint64_t* value)
+{
+	*value = 0;
+
+	if ((unsigned char)field[0] & 0x80)
+	{
+		for (size_t i = 1; i < length; ++i)
+		{
+			if (*value >> 56)
+			{
+				return false;
+			}
+			*value = (*value << 8) | (unsigned char)field[i];
+		}
+		return true;
+	}
+
+	size_t i = 0;
+	while (i < length && field[i] == ' ')
+	{
+		++i;
+	}
+	for (; i < length && field[i] != '\0' && field[i] != ' '; ++i)
+	{
+		if (field[i] < '0' || field[i] > '7' || *value >> 61)
+		{
+			return false;
+		}
+		*value = (*value << 3) | (field[i] - '0');
+	}
+	return true;
+}
+
+// Write a numeric header field as zero padded, NUL terminated octal text
+static inline void tar_format_number(char* field, size_t length, uint64_t value)
+{
+	snprintf(field, length, "%0*llo", (int)length - 1, (unsigned long long)value);
+}
+
+// Sum of the header's bytes with the checksum field counted as spaces
+static inline unsigned int tar_checksum(const tar_header* header)
+{
+	const unsigned char* raw = (const unsigned char*)header;
+	unsigned int sum = 0;
+
+	for (size_t i = 0; i < sizeof(tar_header); ++i)
+	{
+		bool in_checksum = i >= offsetof(tar_header, checksum) && i < offsetof(tar_header, checksum) + sizeof(header->checksum);
+		sum += in_checksum ? ' ' : raw[i];
+	}
+	return sum;
+}
+
+// The two zero blocks that end an archive are recognised by the first of them
+static inline bool tar_is_end(const tar_header* header)
+{
+	const unsigned char* raw = (const unsigned char*)header;
+	for (size_t i = 0; i < sizeof(tar_header); ++i)
+	{
+		if (raw[i] != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Bytes of padding that follow @size bytes of member data
+static inline size_t tar_padding(uint64_t size)
+{
+	return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "SFS.h"
+
+// Buckets hold this many seconds' worth of tokens, so a tool that paused
+// for a while can't follow it with an unthrottled burst
+#define THROTTLE_BURST 0.1
+
+// Seconds between progress reports
+#define THROTTLE_REPORT_INTERVAL 1.0
+
+// From linux/ioprio.h, which older toolchains don't ship
+#define THROTTLE_IOPRIO_WHO_PROCESS 1
+#define THROTTLE_IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_BEST_EFFORT          2
+#define IOPRIO_IDLE                 3
+#define IOPRIO_DEFAULT_LEVEL        4
+
+// Token buckets for bytes and operations, shared by every thread of a tool.
+// A transfer larger than the bucket drives it negative, and the caller then
+// sleeps off the debt, so any transfer size keeps to the average rate.
+typedef struct
+{
+	uint64_t max_bw;
+	uint64_t max_iops;
+	double byte_tokens;
+	double op_tokens;
+	double refilled;
+
+	// Progress, reported to stderr when asked for
+	const char* label;
+	bool progress;
+	uint64_t total;
+	uint64_t bytes;
+	uint64_t ops;
+	double started;
+	double last_report;
+	uint64_t last_bytes;
+	uint64_t last_ops;
+
+	pthread_mutex_t lock;
+} throttle;
+
+static inline double throttle_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* THROTTLE INIT
+ * Set up rate limiting and progress reporting for one tool's transfers.
+ * @param throttle*          : t - The throttle to set up, release with throttle_finish()
+ * @param const sfs_options* : options - The limits, 0 for none, and whether to report progress
+ * @param const char*        : label - Name printed at the start of each report
+ * @param uint64_t           : total - Bytes the tool expects to move, 0 if unknown
+ */
+static inline void throttle_init(throttle* t, const sfs_options* options, const char* label, uint64_t total)
+{
+	t->max_bw = options->max_bw;
+	t->max_iops = options->max_iops;
+	t->byte_tokens = t->max_bw * THROTTLE_BURST;
+	t->op_tokens = t->max_iops * THROTTLE_BURST;
+
+	t->label = label;
+	t->progress = options->progress;
+	t->total = total;
+	t->bytes = 0;
+	t->ops = 0;
+	t->last_bytes = 0;
+	t->last_ops = 0;
+
+	t->started = throttle_now();
+	t->refilled = t->started;
+	t->last_report = t->started;
+
+	pthread_mutex_init(&t->lock, NULL);
+}
+
+// Readahead past a second's worth of the byte limit would go around it
+static inline uint64_t throttle_window(const throttle* t, uint64_t readahead)
+{
+	return t->max_bw > 0 ? MIN(readahead, t->max_bw) : readahead;
+}
+
+static inline void throttle_report(throttle* t, double now)
+{
+	double elapsed = now - t->last_report;
+	double rate = elapsed > 0 ? (t->bytes - t->last_bytes) / elapsed : 0;
+	double iops = elapsed > 0 ? (t->ops - t->last_ops) / elapsed : 0;
+
+	fprintf(stderr, "%s: %.1f MiB", t->label, t->bytes / 1048576.0);
+	if (t->total > 0)
+	{
+		fprintf(stderr, " of %.1f MiB (%.0f%%)", t->total / 1048576.0, 100.0 * MIN(t->bytes, t->total) / t->total);
+	}
+	fprintf(stderr, ", %.1f MiB/s, %.0f IOPS\n", rate / 1048576.0, iops);
+
+	t->last_report = now;
+	t->last_bytes = t->bytes;
+	t->last_ops = t->ops;
+}
+
+/* THROTTLE IO
+ * Account for one transfer, sleeping if it takes the tool over its limits.
+ * Writers call it before each transfer, readers after, either way the next one waits.
+ * Safe to call from several threads at once.
+ * @param throttle* : t - The tool's throttle
+ * @param uint64_t  : bytes - Size of the transfer
+ */
+static inline void throttle_io(throttle* t, uint64_t bytes)
+{
+	if (t->max_bw == 0 && t->max_iops == 0 && !t->progress)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&t->lock);
+
+	double now = throttle_now();
+	double wait = 0;
+
+	if (t->max_bw > 0)
+	{
+		t->byte_tokens += (now - t->refilled) * t->max_bw;
+		if (t->byte_tokens > t->max_bw * THROTTLE_BURST) t->byte_tokens = t->max_bw * THROTTLE_BURST;
+		t->byte_tokens -= bytes;
+		if (t->byte_tokens < 0) wait = -t->byte_tokens / t->max_bw;
+	}
+
+	if (t->max_iops > 0)
+	{
+		t->op_tokens += (now - t->refilled) * t->max_iops;
+		if (t->op_tokens > t->max_iops * THROTTLE_BURST) t->op_tokens = t->max_iops * THROTTLE_BURST;
+		t->op_tokens -= 1;
+		if (t->op_tokens < 0 && -t->op_tokens / t->max_iops > wait) wait = -t->op_tokens / t->max_iops;
+	}
+
+	t->refilled = now;
+	t->bytes += bytes;
+	t->ops += 1;
+
+	if (t->progress && now - t->last_report >= THROTTLE_REPORT_INTERVAL)
+	{
+		throttle_report(t, now);
+	}
+
+	pthread_mutex_unlock(&t->lock);
+
+	// Sleep outside the lock, the debt stays on the bucket for whoever comes next
+	if (wait > 0)
+	{
+		struct timespec pause = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+		while (nanosleep(&pause, &pause) != 0)
+			;
+	}
+}
+
+// Print the average rate over the whole run when reporting progress
+static inline void throttle_finish(throttle* t)
+{
+	if (t->progress)
+	{
+		double elapsed = throttle_now() - t->started;
+		fprintf(stderr, "%s: %.1f MiB in %.1f s, %.1f MiB/s, %.1f IOPS average\n", t->label,
+			t->bytes / 1048576.0, elapsed,
+			elapsed > 0 ? t->bytes / 1048576.0 / elapsed : 0.0,
+			elapsed > 0 ? t->ops / elapsed : 0.0);
+	}
+
+	pthread_mutex_destroy(&t->lock);
+}
+
+/* THROTTLE SET IOPRIO
+ * Move the process, and any threads it starts afterwards, into an I/O scheduling class.
+ * Only schedulers that support priorities, like BFQ, take any notice.
+ * @param int : class - IOPRIO_BEST_EFFORT or IOPRIO_IDLE, 0 leaves the priority alone
+ * @param int : level - Priority within the class, 0 (highest) to 7
+ * @returns void - A warning is printed if the kernel refuses.
+ */
+static inline void throttle_set_ioprio(int class, int level)
+{
+	if (class == 0)
+	{
+		return;
+	}
+
+	int value = (class << THROTTLE_IOPRIO_CLASS_SHIFT) | level;
+	if (syscall(SYS_ioprio_set, THROTTLE_IOPRIO_WHO_PROCESS, 0, value) != 0)
+	{
+		perror("Warning: couldn't set the I/O priority");
+	}
+}
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "trace.h"
+
+#include "SFS.h"
+
+// Event tracing. Each thread records finished spans into a ring of its own, so
+// trace points never contend with each other. The rings are chained together
+// as they're created, and written out as Chrome trace-event JSON when the tool
+// exits, ready for chrome://tracing or ui.perfetto.dev.
+
+bool trace_enabled = false;
+
+#ifndef SFS_NO_TRACE
+
+typedef struct trace_ring
+{
+	struct trace_ring* next;
+	pid_t tid;
+
+	// Events ever recorded, the ring holds the last TRACE_RING_EVENTS of them
+	uint64_t recorded;
+	trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+static const char* trace_path = NULL;
+static uint64_t trace_epoch = 0;
+
+static trace_ring* trace_rings = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring* trace_local = NULL;
+
+static uint64_t trace_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Major faults taken by the calling thread so far, to spot spans that waited on the disk through a mapping
+static long trace_major_faults(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_THREAD, &usage) == -1)
+	{
+		return 0;
+	}
+	return usage.ru_majflt;
+}
+
+static trace_ring* trace_ring_local(void)
+{
+	if (trace_local == NULL)
+	{
+		trace_ring* ring = calloc(1, sizeof(trace_ring));
+		if (ring == NULL)
+		{
+			quit("Out of memory while tracing.");
+		}
+		ring->tid = syscall(SYS_gettid);
+
+		pthread_mutex_lock(&trace_lock);
+		ring->next = trace_rings;
+		trace_rings = ring;
+		pthread_mutex_unlock(&trace_lock);
+
+		trace_local = ring;
+	}
+	return trace_local;
+}
+
+void trace_span_begin(trace_span* span)
+{
+	span->major_faults = trace_major_faults();
+	span->start = trace_clock();
+}
+
+void trace_span_end(const trace_span* span, const char* name, const char* arg_name, uint64_t arg)
+{
+	uint64_t end = trace_clock();
+	trace_ring* ring = trace_ring_local();
+
+	trace_event* event = &ring->events[ring->recorded % TRACE_RING_EVENTS];
+	event->name = name;
+	event->arg_name = arg_name;
+	event->arg = arg;
+	event->start = span->start;
+	event->duration = end - span->start;
+	event->major_faults = trace_major_faults() - span->major_faults;
+
+	ring->recorded += 1;
+}
+
+/* TRACE DUMP
+ * Write every ring out as Chrome trace-event JSON, runs when the tool exits.
+ * Complete ("X") events are written per thread in the order they finished.
+ */
+static void trace_dump(void)
+{
+	trace_enabled = false;
+
+	FILE* out = fopen(trace_path, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Failed to write trace to %s: %s\n", trace_path, strerror(errno));
+		return;
+	}
+
+	pid_t pid = getpid();
+	uint64_t dropped = 0;
+	bool first = true;
+
+	fprintf(out, "{\"traceEvents\":[\n");
+
+	pthread_mutex_lock(&trace_lock);
+	for (trace_ring* ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+				first ? "" : ",\n", pid, ring->tid, ring->tid == pid ? "main" : "worker", ring->tid);
+		first = false;
+
+		uint64_t kept = MIN(ring->recorded, (uint64_t)TRACE_RING_EVENTS);
+		dropped += ring->recorded - kept;
+
+		for (uint64_t i = ring->recorded - kept; i < ring->recorded; ++i)
+		{
+			const trace_event* event = &ring->events[i % TRACE_RING_EVENTS];
+			uint64_t start = event->start - trace_epoch;
+
+			fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"sfs\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{",
+					event->name, pid, ring->tid,
+					(unsigned long long)(start / 1000), (unsigned int)(start % 1000),
+					(unsigned long long)(event->duration / 1000), (unsigned int)(event->duration % 1000));
+
+			if (event->arg_name != NULL)
+			{
+				fprintf(out, "\"%s\":%llu,", event->arg_name, (unsigned long long)event->arg);
+			}
+			fprintf(out, "\"major_faults\":%ld}}", event->major_faults);
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped);
+	fclose(out);
+}
+
+#endif
+
+/* TRACE START
+ * Turn tracing on, events are written to @param(path) when the tool exits.
+ * @param const char* : path - Where to write the Chrome trace-event JSON
+ */
+void trace_start(const char* path)
+{
+#ifdef SFS_NO_TRACE
+	fprintf(stderr, "Tracing was compiled out of this build, ignoring --trace %s\n", path);
+#else
+	trace_path = path;
+	trace_epoch = trace_clock();
+	trace_enabled = true;
+
+	// quit() exits too, so a failed run still leaves its trace behind
+	atexit(trace_dump);
+#endif
+}
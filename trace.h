@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Events each thread keeps, older ones are overwritten once its ring is full
+#define TRACE_RING_EVENTS 16384
+
+// One finished span, timestamps are nanoseconds on the monotonic clock
+typedef struct
+{
+	const char* name;
+	const char* arg_name;
+	uint64_t arg;
+	uint64_t start;
+	uint64_t duration;
+	long major_faults;
+} trace_event;
+
+// Taken when a span opens, handed back when it closes
+typedef struct
+{
+	uint64_t start;
+	long major_faults;
+} trace_span;
+
+// Set by trace_start(), checked by every trace point before doing anything else
+extern bool trace_enabled;
+
+void trace_start(const char* path);
+
+void trace_span_begin(trace_span* span);
+
+void trace_span_end(const trace_span* span, const char* name, const char* arg_name, uint64_t arg);
+
+// Build with -DSFS_NO_TRACE (make TRACE=0) and trace points vanish entirely,
+// otherwise a disabled trace point costs one predictable branch
+#ifdef SFS_NO_TRACE
+
+#define TRACE_BEGIN(span)
+#define TRACE_RESTART(span)
+#define TRACE_END(span, name, arg_name, arg)
+
+#else
+
+#define TRACE_BEGIN(span) \
+	trace_span span; \
+	if (__builtin_expect(trace_enabled, 0)) trace_span_begin(&span)
+
+// Open @span again, for loops timing each pass but not what comes between
+#define TRACE_RESTART(span) \
+	do { if (__builtin_expect(trace_enabled, 0)) trace_span_begin(&span); } while (0)
+
+#define TRACE_END(span, name, arg_name, arg) \
+	do { if (__builtin_expect(trace_enabled, 0)) trace_span_end(&span, name, arg_name, arg); } while (0)
+
+#endif